@@ -35,6 +35,9 @@ void app_init(app_configuration *conf) {
 
 	switch (appconf.app_to_use) {
 	case APP_PPM:
+		if (appconf.app_ppm_conf.input_type == PPM_INPUT_SBUS) {
+			hw_stop_i2c();
+		}
 		app_ppm_configure(&appconf.app_ppm_conf);
 		app_ppm_start();
 		break;
@@ -49,8 +52,12 @@ void app_init(app_configuration *conf) {
 		hw_stop_i2c();
 		app_ppm_configure(&appconf.app_ppm_conf);
 		app_ppm_start();
-		app_uartcomm_configure(appconf.app_uart_baudrate);
-		app_uartcomm_start();
+
+		// SBUS uses the UART
+		if (appconf.app_ppm_conf.input_type != PPM_INPUT_SBUS) {
+			app_uartcomm_configure(appconf.app_uart_baudrate);
+			app_uartcomm_start();
+		}
 		break;
 
 	case APP_NUNCHUK:
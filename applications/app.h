@@ -37,6 +37,7 @@ void app_ppm_start(void);
 void app_ppm_configure(ppm_config *conf);
 void app_uartcomm_start(void);
 void app_uartcomm_configure(uint32_t baudrate);
+void app_uartcomm_get_stream_stats(uint32_t *frames, uint32_t *errors, uint32_t *lost);
 void app_nunchuk_start(void);
 void app_nunchuk_configure(chuk_config *conf);
 float app_nunchuk_get_decoded_chuk(void);
@@ -35,26 +35,41 @@
 #include "led_external.h"
 #include "datatypes.h"
 #include "comm_can.h"
+#include "throttle.h"
 
 // Settings
 #define OUTPUT_ITERATION_TIME_MS		1
 #define MAX_CURR_DIFFERENCE				5.0
-#define MAX_CAN_AGE						0.1
+#define CHUK_CONVERSION_TIME_US			3000
 
 // Threads
 static msg_t chuk_thread(void *arg);
 static WORKING_AREA(chuk_thread_wa, 1024);
 static msg_t output_thread(void *arg);
 static WORKING_AREA(output_thread_wa, 1024);
+static Thread *chuk_tp;
+
+// Polling states
+typedef enum {
+	CHUK_STATE_INIT = 0,
+	CHUK_STATE_READ
+} CHUK_STATE;
+
+// Private functions
+static void chuk_decode(uint8_t *rxbuf);
 
 // Private variables
 static volatile bool is_running = false;
 static volatile chuck_data chuck_d;
 static volatile int chuck_error = 0;
 static volatile chuk_config config;
+static VirtualTimer chuk_vt;
+static volatile bool config_changed = true;
+static throttle_t throttle;
 
 void app_nunchuk_configure(chuk_config *conf) {
 	config = *conf;
+	config_changed = true;
 }
 
 void app_nunchuk_start(void) {
@@ -68,10 +83,26 @@ float app_nunchuk_get_decoded_chuk(void) {
 	return ((float)chuck_d.js_y - 128.0) / 128.0;
 }
 
+static void chuk_timer_func(void *p) {
+	(void)p;
+
+	chSysLockFromIsr();
+	chEvtSignalI(chuk_tp, (eventmask_t) 1);
+	chSysUnlockFromIsr();
+}
+
+/*
+ * Polls the nunchuk with a state machine. The initialization sequence is only
+ * sent after startup and after errors. In the running state the next
+ * conversion is started right after reading the previous one, and a virtual
+ * timer paces the reads so that the conversion time runs in parallel with the
+ * decoding. The I2C transfers themselves are done with DMA by the driver.
+ */
 static msg_t chuk_thread(void *arg) {
 	(void)arg;
 
 	chRegSetThreadName("APP Nunchuk");
+	chuk_tp = chThdSelf();
 	is_running = true;
 
 	uint8_t rxbuf[10];
@@ -79,6 +110,7 @@ static msg_t chuk_thread(void *arg) {
 	msg_t status = RDY_OK;
 	systime_t tmo = MS2ST(5);
 	i2caddr_t chuck_addr = 0x52;
+	CHUK_STATE state = CHUK_STATE_INIT;
 
 	hw_start_i2c();
 	chThdSleepMilliseconds(10);
@@ -86,79 +118,106 @@ static msg_t chuk_thread(void *arg) {
 	for(;;) {
 		bool is_ok = true;
 
-		txbuf[0] = 0xF0;
-		txbuf[1] = 0x55;
-		i2cAcquireBus(&HW_I2C_DEV);
-		status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 2, rxbuf, 0, tmo);
-		i2cReleaseBus(&HW_I2C_DEV);
-		is_ok = status == RDY_OK;
-
-		if (is_ok) {
-			txbuf[0] = 0xFB;
-			txbuf[1] = 0x00;
+		switch (state) {
+		case CHUK_STATE_INIT:
+			txbuf[0] = 0xF0;
+			txbuf[1] = 0x55;
 			i2cAcquireBus(&HW_I2C_DEV);
 			status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 2, rxbuf, 0, tmo);
-			i2cReleaseBus(&HW_I2C_DEV);
 			is_ok = status == RDY_OK;
-		}
 
-		if (is_ok) {
-			txbuf[0] = 0x00;
-			i2cAcquireBus(&HW_I2C_DEV);
-			status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 1, rxbuf, 0, tmo);
+			if (is_ok) {
+				txbuf[0] = 0xFB;
+				txbuf[1] = 0x00;
+				status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 2, rxbuf, 0, tmo);
+				is_ok = status == RDY_OK;
+			}
+
+			if (is_ok) {
+				txbuf[0] = 0x00;
+				status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 1, rxbuf, 0, tmo);
+				is_ok = status == RDY_OK;
+			}
 			i2cReleaseBus(&HW_I2C_DEV);
-			is_ok = status == RDY_OK;
-		}
 
-		if (is_ok) {
-			chThdSleepMilliseconds(3);
+			if (is_ok) {
+				state = CHUK_STATE_READ;
+			}
+			break;
 
+		case CHUK_STATE_READ:
 			i2cAcquireBus(&HW_I2C_DEV);
 			status = i2cMasterReceiveTimeout(&HW_I2C_DEV, chuck_addr, rxbuf, 6, tmo);
-			i2cReleaseBus(&HW_I2C_DEV);
 			is_ok = status == RDY_OK;
-		}
-
-		if (is_ok) {
-			static uint8_t last_buffer[10];
-			int same = 1;
 
-			for (int i = 0;i < 6;i++) {
-				if (last_buffer[i] != rxbuf[i]) {
-					same = 0;
-				}
+			// Start the next conversion right away
+			if (is_ok) {
+				txbuf[0] = 0x00;
+				status = i2cMasterTransmitTimeout(&HW_I2C_DEV, chuck_addr, txbuf, 1, rxbuf, 0, tmo);
+				is_ok = status == RDY_OK;
 			}
+			i2cReleaseBus(&HW_I2C_DEV);
 
-			memcpy(last_buffer, rxbuf, 6);
+			if (is_ok) {
+				chuk_decode(rxbuf);
+			}
+			break;
 
-			if (!same) {
-				chuck_error = 0;
-				chuck_d.js_x = rxbuf[0];
-				chuck_d.js_y = rxbuf[1];
-				chuck_d.acc_x = (rxbuf[2] << 2) | ((rxbuf[5] >> 2) & 3);
-				chuck_d.acc_y = (rxbuf[3] << 2) | ((rxbuf[5] >> 4) & 3);
-				chuck_d.acc_z = (rxbuf[4] << 2) | ((rxbuf[5] >> 6) & 3);
-				chuck_d.bt_z = !((rxbuf[5] >> 0) & 1);
-				chuck_d.bt_c = !((rxbuf[5] >> 1) & 1);
+		default:
+			break;
+		}
 
-				timeout_reset();
+		if (is_ok) {
+			// Wait for the conversion to finish
+			chSysLock();
+			if (chVTIsArmedI(&chuk_vt)) {
+				chVTResetI(&chuk_vt);
 			}
+			chVTSetI(&chuk_vt, US2ST(CHUK_CONVERSION_TIME_US), chuk_timer_func, NULL);
+			chSysUnlock();
 
-			if (timeout_has_timeout()) {
-				chuck_error = 1;
-			}
+			chEvtWaitAny((eventmask_t) 1);
 		} else {
 			chuck_error = 2;
+			state = CHUK_STATE_INIT;
 			hw_try_restore_i2c();
 			chThdSleepMilliseconds(100);
 		}
-
-		chThdSleepMilliseconds(10);
 	}
 
 	return 0;
 }
 
+static void chuk_decode(uint8_t *rxbuf) {
+	static uint8_t last_buffer[10];
+	int same = 1;
+
+	for (int i = 0;i < 6;i++) {
+		if (last_buffer[i] != rxbuf[i]) {
+			same = 0;
+		}
+	}
+
+	memcpy(last_buffer, rxbuf, 6);
+
+	if (!same) {
+		chuck_error = 0;
+		chuck_d.js_x = rxbuf[0];
+		chuck_d.js_y = rxbuf[1];
+		chuck_d.acc_x = (rxbuf[2] << 2) | ((rxbuf[5] >> 2) & 3);
+		chuck_d.acc_y = (rxbuf[3] << 2) | ((rxbuf[5] >> 4) & 3);
+		chuck_d.acc_z = (rxbuf[4] << 2) | ((rxbuf[5] >> 6) & 3);
+		chuck_d.bt_z = !((rxbuf[5] >> 0) & 1);
+		chuck_d.bt_c = !((rxbuf[5] >> 1) & 1);
+
+		timeout_reset();
+	}
+
+	if (timeout_has_timeout()) {
+		chuck_error = 1;
+	}
+}
+
 static msg_t output_thread(void *arg) {
 	(void)arg;
 
@@ -167,10 +226,22 @@ static msg_t output_thread(void *arg) {
 	for(;;) {
 		chThdSleepMilliseconds(OUTPUT_ITERATION_TIME_MS);
 
+		if (config_changed) {
+			config_changed = false;
+			const throttle_config thr_conf = {config.hyst, config.expo,
+					config.ramp_time_pos, config.ramp_time_neg,
+					config.rpm_lim_start, config.rpm_lim_end};
+			throttle_configure(&throttle, &thr_conf);
+		}
+
 		if (timeout_has_timeout() || chuck_error != 0 || config.ctrl_type == CHUK_CTRL_TYPE_NONE) {
 			continue;
 		}
 
+		// Controllers seen recently on the CAN bus
+		can_peer peers[CAN_STATUS_MSGS_TO_STORE];
+		const int peer_num = comm_can_get_peers(peers);
+
 		static bool is_reverse = false;
 		static bool was_z = false;
 		const float current_now = mcpwm_get_tot_current_directional_filtered();
@@ -188,8 +259,7 @@ static msg_t output_thread(void *arg) {
 
 		led_external_set_reversed(is_reverse);
 
-		float out_val = app_nunchuk_get_decoded_chuk();
-		utils_deadband(&out_val, config.hyst, 1.0);
+		float out_val = throttle_curve(&throttle, app_nunchuk_get_decoded_chuk());
 
 		// LEDs
 		float x_axis = ((float)chuck_d.js_x - 128.0) / 128.0;
@@ -229,14 +299,18 @@ static msg_t output_thread(void *arg) {
 			// Send the same duty cycle to the other controllers
 			if (config.multi_esc) {
 				float duty = mcpwm_get_duty_cycle_now();
+				uint8_t can_ids[CAN_STATUS_MSGS_TO_STORE];
+				float can_vals[CAN_STATUS_MSGS_TO_STORE];
+				int can_num = 0;
 
-				for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-					can_status_msg *msg = comm_can_get_status_msg_index(i);
+				for (int i = 0;i < peer_num;i++) {
+					can_peer *peer = &peers[i];
 
-					if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-						comm_can_set_duty(msg->id, duty);
-					}
+					can_ids[can_num] = peer->id;
+					can_vals[can_num++] = duty;
 				}
+
+				comm_can_set_duty_multi(can_ids, can_vals, can_num);
 			}
 
 			continue;
@@ -263,44 +337,38 @@ static msg_t output_thread(void *arg) {
 		float current_highest_abs = current_now;
 
 		if (config.multi_esc) {
-			for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-				can_status_msg *msg = comm_can_get_status_msg_index(i);
+			for (int i = 0;i < peer_num;i++) {
+				can_peer *peer = &peers[i];
 
-				if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-					float rpm_tmp = msg->rpm;
-					if (is_reverse) {
-						rpm_tmp = -rpm_tmp;
-					}
+				float rpm_tmp = peer->rpm;
+				if (is_reverse) {
+					rpm_tmp = -rpm_tmp;
+				}
 
-					if (rpm_tmp < rpm_lowest) {
-						rpm_lowest = rpm_tmp;
-					}
+				if (rpm_tmp < rpm_lowest) {
+					rpm_lowest = rpm_tmp;
+				}
 
-					// Make the current directional
-					float msg_current = msg->current;
-					if (msg->duty < 0.0) {
-						msg_current = -msg_current;
-					}
+				// Make the current directional
+				float msg_current = peer->current;
+				if (peer->duty < 0.0) {
+					msg_current = -msg_current;
+				}
 
-					if (fabsf(msg_current) > fabsf(current_highest_abs)) {
-						current_highest_abs = msg_current;
-					}
+				if (fabsf(msg_current) > fabsf(current_highest_abs)) {
+					current_highest_abs = msg_current;
 				}
 			}
 		}
 
 		// Apply ramping
-		static float prev_current = 0.0;
 		const float current_range = mcconf->l_current_max + fabsf(mcconf->l_current_min);
-		const float ramp_time = fabsf(current) > fabsf(prev_current) ? config.ramp_time_pos : config.ramp_time_neg;
-
-		if (ramp_time > 0.01) {
-			const float ramp_step = ((float)OUTPUT_ITERATION_TIME_MS * current_range) / (ramp_time * 1000.0);
+		const float prev_current = throttle_get_output(&throttle);
+		float current_goal = throttle_ramp(&throttle, current, current_range);
+		const float ramp_step = throttle_get_ramp_step(&throttle);
 
-			float current_goal = prev_current;
-			const float goal_tmp = current_goal;
-			utils_step_towards(&current_goal, current, ramp_step);
-			bool is_decreasing = current_goal < goal_tmp;
+		if (ramp_step > 0.0) {
+			bool is_decreasing = current_goal < prev_current;
 
 			// Make sure the desired current is close to the actual current to avoid surprises
 			// when changing direction
@@ -319,68 +387,59 @@ static msg_t output_thread(void *arg) {
 			bool is_decreasing2 = goal_tmp2 < current_goal;
 			if (!is_decreasing || is_decreasing2) {
 				current_goal = goal_tmp2;
+				throttle_set_output(&throttle, current_goal);
 			}
-
-			current = current_goal;
 		}
 
-		prev_current = current;
+		current = current_goal;
+
+		// Setpoints for the other controllers, sent as group frames
+		uint8_t can_ids[CAN_STATUS_MSGS_TO_STORE];
+		float can_vals[CAN_STATUS_MSGS_TO_STORE];
+		int can_num = 0;
 
 		if (current < 0.0) {
 			mcpwm_set_brake_current(current);
 
 			// Send brake command to all ESCs seen recently on the CAN bus
-			for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-				can_status_msg *msg = comm_can_get_status_msg_index(i);
+			for (int i = 0;i < peer_num;i++) {
+				can_peer *peer = &peers[i];
 
-				if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-					comm_can_set_current_brake(msg->id, current);
-				}
+				can_ids[can_num] = peer->id;
+				can_vals[can_num++] = current;
 			}
+
+			comm_can_set_current_brake_multi(can_ids, can_vals, can_num);
 		} else {
 			// Apply soft RPM limit
-			if (rpm_lowest > config.rpm_lim_end && current > 0.0) {
-				current = mcconf->cc_min_current;
-			} else if (rpm_lowest > config.rpm_lim_start && current > 0.0) {
-				current = utils_map(rpm_lowest, config.rpm_lim_start, config.rpm_lim_end, current, mcconf->cc_min_current);
-			} else if (rpm_lowest < -config.rpm_lim_end && current < 0.0) {
-				current = mcconf->cc_min_current;
-			} else if (rpm_lowest < -config.rpm_lim_start && current < 0.0) {
-				rpm_lowest = -rpm_lowest;
-				current = -current;
-				current = utils_map(rpm_lowest, config.rpm_lim_start, config.rpm_lim_end, current, mcconf->cc_min_current);
-				current = -current;
-			}
+			current = throttle_rpm_limit(&throttle, rpm_lowest, current, mcconf->cc_min_current);
 
 			float current_out = current;
 
 			// Traction control
 			if (config.multi_esc) {
-				for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-					can_status_msg *msg = comm_can_get_status_msg_index(i);
-
-					if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-						if (config.tc) {
-							float rpm_tmp = msg->rpm;
-							if (is_reverse) {
-								rpm_tmp = -rpm_tmp;
-							}
-
-							float diff = rpm_tmp - rpm_lowest;
-							current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
-							if (current_out < mcconf->cc_min_current) {
-								current_out = 0.0;
-							}
-						}
+				for (int i = 0;i < peer_num;i++) {
+					can_peer *peer = &peers[i];
 
+					if (config.tc) {
+						float rpm_tmp = peer->rpm;
 						if (is_reverse) {
-							comm_can_set_current(msg->id, -current_out);
-						} else {
-							comm_can_set_current(msg->id, current_out);
+							rpm_tmp = -rpm_tmp;
+						}
+
+						float diff = rpm_tmp - rpm_lowest;
+						current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
+						if (current_out < mcconf->cc_min_current) {
+							current_out = 0.0;
 						}
 					}
+
+					can_ids[can_num] = peer->id;
+					can_vals[can_num++] = is_reverse ? -current_out : current_out;
 				}
 
+				comm_can_set_current_multi(can_ids, can_vals, can_num);
+
 				if (config.tc) {
 					float diff = rpm_local - rpm_lowest;
 					current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
@@ -32,11 +32,9 @@
 #include "timeout.h"
 #include "utils.h"
 #include "comm_can.h"
+#include "throttle.h"
 #include <math.h>
 
-// Settings
-#define MAX_CAN_AGE						0.1
-
 // Threads
 static msg_t ppm_thread(void *arg);
 static WORKING_AREA(ppm_thread_wa, 1024);
@@ -49,15 +47,19 @@ static void servodec_func(void);
 // Private variables
 static volatile bool is_running = false;
 static volatile ppm_config config;
+static volatile bool config_changed = true;
+static throttle_t throttle;
 
 // Private functions
 void update(void *p);
 
 void app_ppm_configure(ppm_config *conf) {
 	config = *conf;
+	config_changed = true;
 
 	if (is_running) {
 		servodec_set_pulse_options(config.pulse_start, config.pulse_width);
+		servodec_set_filter(config.median_filter_len, config.max_pulse_step);
 	}
 }
 
@@ -90,17 +92,30 @@ static msg_t ppm_thread(void *arg) {
 	ppm_tp = chThdSelf();
 
 	servodec_set_pulse_options(config.pulse_start, config.pulse_width);
-	servodec_init(servodec_func);
+	servodec_set_filter(config.median_filter_len, config.max_pulse_step);
+	servodec_init(config.input_type, servodec_func);
 	is_running = true;
 
 	for(;;) {
 		chEvtWaitAny((eventmask_t) 1);
 
+		if (config_changed) {
+			config_changed = false;
+			const throttle_config thr_conf = {config.hyst, config.expo,
+					config.ramp_time_pos, config.ramp_time_neg,
+					config.rpm_lim_start, config.rpm_lim_end};
+			throttle_configure(&throttle, &thr_conf);
+		}
+
 		if (timeout_has_timeout()) {
 			continue;
 		}
 
-		float servo_val = servodec_get_servo(0);
+		// Controllers seen recently on the CAN bus
+		can_peer peers[CAN_STATUS_MSGS_TO_STORE];
+		const int peer_num = comm_can_get_peers(peers);
+
+		float servo_val = servodec_get_servo(config.channel);
 
 		switch (config.ctrl_type) {
 		case PPM_CTRL_TYPE_CURRENT_NOREV:
@@ -114,21 +129,20 @@ static msg_t ppm_thread(void *arg) {
 			break;
 		}
 
-		utils_deadband(&servo_val, config.hyst, 1.0);
+		servo_val = throttle_curve(&throttle, servo_val);
+		servo_val = throttle_ramp(&throttle, servo_val, 1.0);
 
 		// Find lowest RPM
 		float rpm_local = mcpwm_get_rpm();
 		float rpm_lowest = rpm_local;
 		if (config.multi_esc) {
-			for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-				can_status_msg *msg = comm_can_get_status_msg_index(i);
+			for (int i = 0;i < peer_num;i++) {
+				can_peer *peer = &peers[i];
 
-				if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-					float rpm_tmp = msg->rpm;
+				float rpm_tmp = peer->rpm;
 
-					if (fabsf(rpm_tmp) < fabsf(rpm_lowest)) {
-						rpm_lowest = rpm_tmp;
-					}
+				if (fabsf(rpm_tmp) < fabsf(rpm_lowest)) {
+					rpm_lowest = rpm_tmp;
 				}
 			}
 		}
@@ -176,16 +190,22 @@ static msg_t ppm_thread(void *arg) {
 			break;
 		}
 
+		// Setpoints for the other controllers, sent as group frames
+		uint8_t can_ids[CAN_STATUS_MSGS_TO_STORE];
+		float can_vals[CAN_STATUS_MSGS_TO_STORE];
+		int can_num = 0;
+
 		if (send_duty && config.multi_esc) {
 			float duty = mcpwm_get_duty_cycle_now();
 
-			for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-				can_status_msg *msg = comm_can_get_status_msg_index(i);
+			for (int i = 0;i < peer_num;i++) {
+				can_peer *peer = &peers[i];
 
-				if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-					comm_can_set_duty(msg->id, duty);
-				}
+				can_ids[can_num] = peer->id;
+				can_vals[can_num++] = duty;
 			}
+
+			comm_can_set_duty_multi(can_ids, can_vals, can_num);
 		}
 
 		if (current_mode) {
@@ -193,28 +213,17 @@ static msg_t ppm_thread(void *arg) {
 				mcpwm_set_brake_current(current);
 
 				// Send brake command to all ESCs seen recently on the CAN bus
-				for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-					can_status_msg *msg = comm_can_get_status_msg_index(i);
+				for (int i = 0;i < peer_num;i++) {
+					can_peer *peer = &peers[i];
 
-					if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-						comm_can_set_current_brake(msg->id, current);
-					}
+					can_ids[can_num] = peer->id;
+					can_vals[can_num++] = current;
 				}
+
+				comm_can_set_current_brake_multi(can_ids, can_vals, can_num);
 			} else {
 				// Apply soft RPM limit
-				if (rpm_lowest > config.rpm_lim_end && current > 0.0) {
-					current = mcconf->cc_min_current;
-				} else if (rpm_lowest > config.rpm_lim_start && current > 0.0) {
-					current = utils_map(rpm_lowest, config.rpm_lim_start, config.rpm_lim_end, current, mcconf->cc_min_current);
-				} else if (rpm_lowest < -config.rpm_lim_end && current < 0.0) {
-					current = mcconf->cc_min_current;
-				} else if (rpm_lowest < -config.rpm_lim_start && current < 0.0) {
-					rpm_lowest = -rpm_lowest;
-					current = -current;
-					current = utils_map(rpm_lowest, config.rpm_lim_start, config.rpm_lim_end, current, mcconf->cc_min_current);
-					current = -current;
-					rpm_lowest = -rpm_lowest;
-				}
+				current = throttle_rpm_limit(&throttle, rpm_lowest, current, mcconf->cc_min_current);
 
 				float current_out = current;
 				bool is_reverse = false;
@@ -228,31 +237,28 @@ static msg_t ppm_thread(void *arg) {
 
 				// Traction control
 				if (config.multi_esc) {
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						can_status_msg *msg = comm_can_get_status_msg_index(i);
-
-						if (msg->id >= 0 && UTILS_AGE_S(msg->rx_time) < MAX_CAN_AGE) {
-							if (config.tc) {
-								float rpm_tmp = msg->rpm;
-								if (is_reverse) {
-									rpm_tmp = -rpm_tmp;
-								}
-
-								float diff = rpm_tmp - rpm_lowest;
-								current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
-								if (current_out < mcconf->cc_min_current) {
-									current_out = 0.0;
-								}
-							}
+					for (int i = 0;i < peer_num;i++) {
+						can_peer *peer = &peers[i];
 
+						if (config.tc) {
+							float rpm_tmp = peer->rpm;
 							if (is_reverse) {
-								comm_can_set_current(msg->id, -current_out);
-							} else {
-								comm_can_set_current(msg->id, current_out);
+								rpm_tmp = -rpm_tmp;
+							}
+
+							float diff = rpm_tmp - rpm_lowest;
+							current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
+							if (current_out < mcconf->cc_min_current) {
+								current_out = 0.0;
 							}
 						}
+
+						can_ids[can_num] = peer->id;
+						can_vals[can_num++] = is_reverse ? -current_out : current_out;
 					}
 
+					comm_can_set_current_multi(can_ids, can_vals, can_num);
+
 					if (config.tc) {
 						float diff = rpm_local - rpm_lowest;
 						current_out = utils_map(diff, 0.0, config.tc_max_diff, current, 0.0);
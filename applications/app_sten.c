@@ -32,6 +32,7 @@
 #include "utils.h"
 #include "hw.h"
 #include "timeout.h"
+#include "throttle.h"
 #include <math.h>
 
 // Settings
@@ -42,6 +43,8 @@
 
 // Private variables
 static volatile float out_received = 0.0;
+static throttle_t throttle;
+static const throttle_config throttle_conf = {0.0, 0.0, 0.0, 0.0, RPM_MAX_1, RPM_MAX_2};
 
 // Threads
 static msg_t uart_thread(void *arg);
@@ -117,6 +120,7 @@ static UARTConfig uart_cfg = {
 };
 
 void app_sten_init(void) {
+	throttle_configure(&throttle, &throttle_conf);
 	chThdCreateStatic(uart_thread_wa, sizeof(uart_thread_wa), NORMALPRIO - 1, uart_thread, NULL);
 }
 
@@ -171,11 +175,7 @@ static void set_output(float output) {
 		}
 
 		// Soft RPM limit
-		if (rpm > RPM_MAX_2) {
-			current = -mcpwm_get_configuration()->cc_min_current;
-		} else if (rpm > RPM_MAX_1) {
-			current = utils_map(rpm, RPM_MAX_1, RPM_MAX_2, current, -mcpwm_get_configuration()->cc_min_current);
-		}
+		current = throttle_rpm_limit(&throttle, rpm, current, -mcpwm_get_configuration()->cc_min_current);
 
 		// Some low-pass filtering
 		static float current_p1 = 0.0;
@@ -29,6 +29,8 @@
 #include "mcpwm.h"
 #include "packet.h"
 #include "commands.h"
+#include "timeout.h"
+#include "buffer.h"
 
 #include <string.h>
 
@@ -36,6 +38,10 @@
 #define BAUDRATE					115200
 #define PACKET_HANDLER				1
 #define SERIAL_RX_BUFFER_SIZE		1024
+#define STREAM_SYNC					0xA5
+#define STREAM_FRAME_LEN			9		// sync, seq, cmd, int32 value, fletcher16
+#define STREAM_TELEMETRY_LEN		15		// sync, seq, fault, int32 rpm, 3 x int16, fletcher16
+#define STREAM_TIMEOUT_MS			100		// Go back to packet mode without frames for this time
 
 // Threads
 static msg_t packet_process_thread(void *arg);
@@ -48,10 +54,24 @@ static int serial_rx_read_pos = 0;
 static int serial_rx_write_pos = 0;
 static int is_running = 0;
 
+// Stream mode. Setpoint frames are received with DMA after the sync byte
+// has been received as a character.
+static volatile bool stream_mode = false;
+static volatile bool stream_telemetry = false;
+static uint8_t stream_rx[STREAM_FRAME_LEN];
+static uint8_t stream_frame[STREAM_FRAME_LEN];
+static uint8_t stream_seq_last = 0;
+static systime_t stream_last_time = 0;
+static uint32_t stream_frames = 0;
+static uint32_t stream_errors = 0;
+static uint32_t stream_lost = 0;
+
 // Private functions
 static void process_packet(unsigned char *data, unsigned char len);
 static void send_packet_wrapper(unsigned char *data, unsigned char len);
 static void send_packet(unsigned char *data, unsigned char len);
+static void stream_process_frame(void);
+static uint16_t fletcher16(const uint8_t *data, int len);
 
 /*
  * This callback is invoked when a transmission buffer has been completely
@@ -82,14 +102,25 @@ static void rxerr(UARTDriver *uartp, uartflags_t e) {
  * was not ready to receive it, the character is passed as parameter.
  */
 static void rxchar(UARTDriver *uartp, uint16_t c) {
-	(void)uartp;
+	if (stream_mode) {
+		if (c == STREAM_SYNC) {
+			stream_rx[0] = STREAM_SYNC;
+			chSysLockFromIsr();
+			uartStartReceiveI(uartp, STREAM_FRAME_LEN - 1, stream_rx + 1);
+			chSysUnlockFromIsr();
+		}
+		return;
+	}
+
 	serial_rx_buffer[serial_rx_write_pos++] = c;
 
 	if (serial_rx_write_pos == SERIAL_RX_BUFFER_SIZE) {
 		serial_rx_write_pos = 0;
 	}
 
-	chEvtSignal(process_tp, (eventmask_t) 1);
+	chSysLockFromIsr();
+	chEvtSignalI(process_tp, (eventmask_t) 1);
+	chSysUnlockFromIsr();
 }
 
 /*
@@ -97,6 +128,12 @@ static void rxchar(UARTDriver *uartp, uint16_t c) {
  */
 static void rxend(UARTDriver *uartp) {
 	(void)uartp;
+
+	memcpy(stream_frame, stream_rx, STREAM_FRAME_LEN);
+
+	chSysLockFromIsr();
+	chEvtSignalI(process_tp, (eventmask_t) 2);
+	chSysUnlockFromIsr();
 }
 
 /*
@@ -115,6 +152,20 @@ static UARTConfig uart_cfg = {
 };
 
 static void process_packet(unsigned char *data, unsigned char len) {
+	// Stream mode is negotiated here since it only applies to this UART.
+	// [COMM_UART_STREAM][enable][send telemetry]
+	if (len >= 3 && data[0] == COMM_UART_STREAM) {
+		uint8_t reply[2];
+		reply[0] = COMM_UART_STREAM;
+		reply[1] = data[1] ? 1 : 0;
+		packet_send_packet(reply, 2, PACKET_HANDLER);
+
+		stream_telemetry = data[2];
+		stream_last_time = chTimeNow();
+		stream_mode = data[1];
+		return;
+	}
+
 	commands_set_send_func(send_packet_wrapper);
 	commands_process_packet(data, len);
 }
@@ -169,7 +220,7 @@ static msg_t packet_process_thread(void *arg) {
 	process_tp = chThdSelf();
 
 	for(;;) {
-		chEvtWaitAny((eventmask_t) 1);
+		eventmask_t evt = chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(STREAM_TIMEOUT_MS));
 
 		while (serial_rx_read_pos != serial_rx_write_pos) {
 			packet_process_byte(serial_rx_buffer[serial_rx_read_pos++], PACKET_HANDLER);
@@ -178,7 +229,118 @@ static msg_t packet_process_thread(void *arg) {
 				serial_rx_read_pos = 0;
 			}
 		}
+
+		if (evt & EVENT_MASK(1)) {
+			stream_process_frame();
+		}
+
+		if (stream_mode && chTimeElapsedSince(stream_last_time) > MS2ST(STREAM_TIMEOUT_MS)) {
+			stream_mode = false;
+		}
 	}
 
 	return 0;
 }
+
+/*
+ * Apply a setpoint frame and optionally reply with a telemetry frame.
+ * [STREAM_SYNC][seq][UART_STREAM_CMD][int32 value][fletcher16]
+ */
+static void stream_process_frame(void) {
+	uint8_t frame[STREAM_FRAME_LEN];
+
+	chSysLock();
+	memcpy(frame, stream_frame, STREAM_FRAME_LEN);
+	chSysUnlock();
+
+	int32_t ind = STREAM_FRAME_LEN - 2;
+	if (fletcher16(frame, STREAM_FRAME_LEN - 2) != buffer_get_uint16(frame, &ind)) {
+		stream_errors++;
+		return;
+	}
+
+	const uint8_t seq = frame[1];
+	if (stream_frames > 0) {
+		stream_lost += (uint8_t)(seq - stream_seq_last - 1);
+	}
+	stream_seq_last = seq;
+	stream_frames++;
+	stream_last_time = chTimeNow();
+
+	ind = 3;
+	const int32_t value = buffer_get_int32(frame, &ind);
+
+	switch (frame[2]) {
+	case UART_STREAM_CMD_CURRENT:
+		mcpwm_set_current((float)value / 1000.0);
+		timeout_reset();
+		break;
+
+	case UART_STREAM_CMD_CURRENT_BRAKE:
+		mcpwm_set_brake_current((float)value / 1000.0);
+		timeout_reset();
+		break;
+
+	case UART_STREAM_CMD_DUTY:
+		mcpwm_set_duty((float)value / 100000.0);
+		timeout_reset();
+		break;
+
+	case UART_STREAM_CMD_RPM:
+		mcpwm_set_pid_speed((float)value);
+		timeout_reset();
+		break;
+
+	case UART_STREAM_CMD_STOP:
+		stream_mode = false;
+		return;
+
+	default:
+		break;
+	}
+
+	// Skip the telemetry if the previous frame is still being sent
+	if (stream_telemetry && HW_UART_DEV.txstate != UART_TX_ACTIVE) {
+		static uint8_t tx[STREAM_TELEMETRY_LEN];
+		ind = 0;
+		tx[ind++] = STREAM_SYNC;
+		tx[ind++] = seq;
+		tx[ind++] = mcpwm_get_fault();
+		buffer_append_int32(tx, (int32_t)mcpwm_get_rpm(), &ind);
+		buffer_append_int16(tx, (int16_t)(mcpwm_get_tot_current_directional_filtered() * 100.0), &ind);
+		buffer_append_int16(tx, (int16_t)(mcpwm_get_duty_cycle_now() * 1000.0), &ind);
+		buffer_append_int16(tx, (int16_t)(GET_INPUT_VOLTAGE() * 10.0), &ind);
+		buffer_append_uint16(tx, fletcher16(tx, ind), &ind);
+		uartStartSend(&HW_UART_DEV, ind, tx);
+	}
+}
+
+static uint16_t fletcher16(const uint8_t *data, int len) {
+	uint16_t sum1 = 0;
+	uint16_t sum2 = 0;
+
+	for (int i = 0;i < len;i++) {
+		sum1 = (sum1 + data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+/**
+ * Get statistics for the setpoint stream mode.
+ *
+ * @param frames
+ * Pointer to store the number of valid frames in.
+ *
+ * @param errors
+ * Pointer to store the number of frames with a bad checksum in.
+ *
+ * @param lost
+ * Pointer to store the number of frames that were missing in the sequence in.
+ */
+void app_uartcomm_get_stream_stats(uint32_t *frames, uint32_t *errors, uint32_t *lost) {
+	*frames = stream_frames;
+	*errors = stream_errors;
+	*lost = stream_lost;
+}
@@ -3,6 +3,7 @@ APPSRC =	applications/app.c \
 			applications/app_sten.c \
 			applications/app_gurgalof.c \
 			applications/app_uartcomm.c \
-			applications/app_nunchuk.c
+			applications/app_nunchuk.c \
+			applications/throttle.c
 
 APPINC = applications
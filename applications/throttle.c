@@ -0,0 +1,210 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * throttle.c
+ *
+ * Input shaping shared by the apps. The deadband and the throttle curve are
+ * precomputed into a lookup table, and the ramping and soft RPM limit use
+ * precomputed rates so that the per iteration work is small and the same
+ * for all input sources.
+ */
+
+#include "throttle.h"
+#include "utils.h"
+#include <math.h>
+
+/**
+ * Configure a throttle and build its lookup table. The state of the ramp is
+ * kept, so this can be called while the throttle is used.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @param conf
+ * The configuration to use.
+ */
+void throttle_configure(throttle_t *t, const throttle_config *conf) {
+	float expo = conf->expo;
+	utils_truncate_number(&expo, 0.0, 1.0);
+
+	for (int i = 0;i <= THROTTLE_TABLE_SIZE;i++) {
+		float x = (float)i / (float)THROTTLE_TABLE_SIZE;
+		utils_deadband(&x, conf->deadband, 1.0);
+		t->table[i] = (1.0 - expo) * x + expo * x * x * x;
+	}
+
+	t->ramp_rate_pos = conf->ramp_time_pos > 0.01 ? 1.0 / conf->ramp_time_pos : 0.0;
+	t->ramp_rate_neg = conf->ramp_time_neg > 0.01 ? 1.0 / conf->ramp_time_neg : 0.0;
+
+	t->rpm_lim_start = conf->rpm_lim_start;
+	t->rpm_lim_end = conf->rpm_lim_end;
+	if (conf->rpm_lim_end > conf->rpm_lim_start) {
+		t->rpm_lim_k = 1.0 / (conf->rpm_lim_end - conf->rpm_lim_start);
+	} else {
+		t->rpm_lim_k = 0.0;
+	}
+}
+
+/**
+ * Apply the deadband and the throttle curve.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @param in
+ * The input in the range [-1.0 1.0].
+ *
+ * @return
+ * The shaped output in the range [-1.0 1.0].
+ */
+float throttle_curve(const throttle_t *t, float in) {
+	float x = fabsf(in);
+	if (x > 1.0) {
+		x = 1.0;
+	}
+
+	const float pos = x * (float)THROTTLE_TABLE_SIZE;
+	const int ind = (int)pos;
+	float out;
+
+	if (ind >= THROTTLE_TABLE_SIZE) {
+		out = t->table[THROTTLE_TABLE_SIZE];
+	} else {
+		out = t->table[ind] + (pos - (float)ind) * (t->table[ind + 1] - t->table[ind]);
+	}
+
+	return in < 0.0 ? -out : out;
+}
+
+/**
+ * Move the output of the throttle towards a target with the configured ramp
+ * times. Increasing the magnitude uses ramp_time_pos and decreasing it uses
+ * ramp_time_neg. The time step is measured between calls.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @param target
+ * The target output.
+ *
+ * @param range
+ * The output change made during one ramp time, e.g. 1.0 for normalized
+ * values or the current range in amperes.
+ *
+ * @return
+ * The ramped output.
+ */
+float throttle_ramp(throttle_t *t, float target, float range) {
+	const systime_t now = chTimeNow();
+	float dt = t->has_time ? (float)(now - t->last_time) / (float)CH_FREQUENCY : 0.0;
+	t->last_time = now;
+	t->has_time = true;
+
+	if (dt > THROTTLE_MAX_DT) {
+		dt = THROTTLE_MAX_DT;
+	}
+
+	const float rate = fabsf(target) > fabsf(t->out) ? t->ramp_rate_pos : t->ramp_rate_neg;
+
+	if (rate > 0.0) {
+		t->last_step = rate * range * dt;
+		utils_step_towards(&t->out, target, t->last_step);
+	} else {
+		t->last_step = 0.0;
+		t->out = target;
+	}
+
+	return t->out;
+}
+
+/**
+ * Get the current output of the ramp.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @return
+ * The output.
+ */
+float throttle_get_output(const throttle_t *t) {
+	return t->out;
+}
+
+/**
+ * Get the largest step the output was allowed to take in the last call to
+ * throttle_ramp.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @return
+ * The step in the units of the output, or 0 if ramping was disabled.
+ */
+float throttle_get_ramp_step(const throttle_t *t) {
+	return t->last_step;
+}
+
+/**
+ * Override the output of the ramp, e.g. when the output is corrected
+ * after ramping or when the throttle is not used.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @param out
+ * The new output.
+ */
+void throttle_set_output(throttle_t *t, float out) {
+	t->out = out;
+}
+
+/**
+ * Apply the soft RPM limit. Between rpm_lim_start and rpm_lim_end the output
+ * is mapped linearly towards out_min, in both directions.
+ *
+ * @param t
+ * The throttle.
+ *
+ * @param rpm
+ * The RPM to limit on.
+ *
+ * @param out
+ * The output.
+ *
+ * @param out_min
+ * The output to use above rpm_lim_end, for a positive output. It is mirrored
+ * for negative outputs.
+ *
+ * @return
+ * The limited output.
+ */
+float throttle_rpm_limit(const throttle_t *t, float rpm, float out, float out_min) {
+	if (out < 0.0) {
+		return -throttle_rpm_limit(t, -rpm, -out, out_min);
+	}
+
+	if (out == 0.0 || rpm <= t->rpm_lim_start) {
+		return out;
+	}
+
+	if (rpm >= t->rpm_lim_end) {
+		return out_min;
+	}
+
+	return out + (rpm - t->rpm_lim_start) * t->rpm_lim_k * (out_min - out);
+}
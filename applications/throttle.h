@@ -0,0 +1,63 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * throttle.h
+ */
+
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include "ch.h"
+#include <stdbool.h>
+
+// Settings
+#define THROTTLE_TABLE_SIZE		64
+#define THROTTLE_MAX_DT			0.05	// Longest time step used for ramping, in seconds
+
+typedef struct {
+	float deadband;			// Input range around zero that gives zero output
+	float expo;				// 0.0 is linear, 1.0 is cubic
+	float ramp_time_pos;	// Ramp time when the output magnitude increases, 0 to disable
+	float ramp_time_neg;	// Ramp time when the output magnitude decreases, 0 to disable
+	float rpm_lim_start;	// Start decreasing the output at this RPM
+	float rpm_lim_end;		// Output is fully decreased at this RPM
+} throttle_config;
+
+typedef struct {
+	float table[THROTTLE_TABLE_SIZE + 1];
+	float ramp_rate_pos;
+	float ramp_rate_neg;
+	float rpm_lim_start;
+	float rpm_lim_end;
+	float rpm_lim_k;
+	float out;
+	float last_step;
+	systime_t last_time;
+	bool has_time;
+} throttle_t;
+
+// Functions
+void throttle_configure(throttle_t *t, const throttle_config *conf);
+float throttle_curve(const throttle_t *t, float in);
+float throttle_ramp(throttle_t *t, float target, float range);
+float throttle_get_output(const throttle_t *t);
+float throttle_get_ramp_step(const throttle_t *t);
+void throttle_set_output(throttle_t *t, float out);
+float throttle_rpm_limit(const throttle_t *t, float rpm, float out, float out_min);
+
+#endif /* THROTTLE_H_ */
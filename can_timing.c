@@ -0,0 +1,81 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * can_timing.c
+ */
+
+#include "can_timing.h"
+#include <math.h>
+
+/**
+ * Compute CAN_BTR for a bit rate. All bit lengths from 25 down to 8 time quanta
+ * that give an exact prescaler are tried, and the one with the sample point
+ * closest to sample_point is used. SJW is one time quantum.
+ *
+ * @param pclk
+ * The CAN peripheral clock (APB1) in Hz.
+ *
+ * @param bitrate
+ * The desired bit rate in bit/s.
+ *
+ * @param sample_point
+ * The desired sample point as a fraction of the bit time.
+ *
+ * @param btr
+ * Pointer to store the computed register value in.
+ *
+ * @return
+ * True if a valid bit timing was found, false otherwise.
+ */
+bool can_timing_calc_btr(uint32_t pclk, uint32_t bitrate, float sample_point, uint32_t *btr) {
+	bool found = false;
+	float best_err = 1.0;
+
+	for (uint32_t tq = 25;tq >= 8;tq--) {
+		if (pclk % (bitrate * tq) != 0) {
+			continue;
+		}
+
+		const uint32_t brp = pclk / (bitrate * tq);
+		if (brp < 1 || brp > 1024) {
+			continue;
+		}
+
+		// One quantum is used by the sync segment
+		int32_t ts1 = (int32_t)(sample_point * (float)tq + 0.5) - 1;
+		if (ts1 > 16) {
+			ts1 = 16;
+		} else if (ts1 < 1) {
+			ts1 = 1;
+		}
+
+		const int32_t ts2 = (int32_t)tq - 1 - ts1;
+		if (ts2 < 1 || ts2 > 8) {
+			continue;
+		}
+
+		const float err = fabsf((float)(1 + ts1) / (float)tq - sample_point);
+		if (err < best_err) {
+			best_err = err;
+			*btr = ((uint32_t)(ts2 - 1) << 20) | ((uint32_t)(ts1 - 1) << 16) | (brp - 1);
+			found = true;
+		}
+	}
+
+	return found;
+}
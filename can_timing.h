@@ -0,0 +1,39 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * can_timing.h
+ *
+ * CAN bit timing calculation. This file has no ChibiOS dependency, so that it
+ * can be tested on the host.
+ */
+
+#ifndef CAN_TIMING_H_
+#define CAN_TIMING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// CAN_BTR fields, same layout as in the STM32 reference manual
+#define CAN_TIMING_BTR_BRP(btr)		(((btr) & 0x3FF) + 1)
+#define CAN_TIMING_BTR_TS1(btr)		((((btr) >> 16) & 0xF) + 1)
+#define CAN_TIMING_BTR_TS2(btr)		((((btr) >> 20) & 0x7) + 1)
+
+// Functions
+bool can_timing_calc_btr(uint32_t pclk, uint32_t bitrate, float sample_point, uint32_t *btr);
+
+#endif /* CAN_TIMING_H_ */
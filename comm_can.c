@@ -31,37 +31,183 @@
 #include "timeout.h"
 #include "commands.h"
 #include "app.h"
+#include "utils.h"
+#include "crc.h"
+#include "hw.h"
+#include "timesync.h"
+#include "can_timing.h"
+
+#include <string.h>
+#include <math.h>
 
 // Settings
 #define CANDx			CAND1
+#define CAN_SAMPLE_POINT			0.875	// Target sample point as a fraction of the bit time
+#define RX_BUFFER_SIZE				256
+#define TRANSPORT_WINDOW			8		// Chunks to send before waiting for an ack
+#define TRANSPORT_ACK_TIMEOUT_MS	20
+#define TRANSPORT_RETRIES			3
+
+// Buffer modes
+#define BUFFER_MODE_PROCESS			0		// Process the payload and reply to the sender
+#define BUFFER_MODE_REPLY			1		// Payload is a reply, send it to the host
+
+// Ack status
+#define ACK_IN_PROGRESS				0
+#define ACK_DONE					1
+#define ACK_CRC_ERROR				2
+#define ACK_BUSY					3
 
 // Threads
 static WORKING_AREA(cancom_thread_wa, 1024);
 static WORKING_AREA(cancom_status_thread_wa, 1024);
+static WORKING_AREA(cancom_process_thread_wa, 4096);
+static WORKING_AREA(cancom_tx_thread_wa, 512);
 static msg_t cancom_thread(void *arg);
 static msg_t cancom_status_thread(void *arg);
+static msg_t cancom_process_thread(void *arg);
+static msg_t cancom_tx_thread(void *arg);
+static Thread *process_tp;
+static Thread *tx_tp;
+
+// Private functions
+static void send_group(CAN_PACKET_ID cmd, const uint8_t *ids, const float *values,
+		float scale, int num);
+static int16_t get_group_slot(CANRxFrame *rxmsg, uint8_t base_id);
+static void rx_fill(CANRxFrame *rxmsg, bool is_last);
+static void send_ack(uint8_t status);
+static bool queue_process(uint8_t sender, uint8_t mode, uint8_t *data, unsigned int len);
+static void send_packet_wrapper(unsigned char *data, unsigned char len);
+static CAN_TX_PRIO get_tx_prio(uint32_t id);
+static can_status_msg *get_status_slot(uint8_t id, bool allocate);
+static bool status_due(systime_t *last, uint16_t rate_hz);
+static void update_stats(void);
+static void update_peer(int slot, can_status_msg *msg);
+static void expire_peers(void);
+static bool tx_idle(void);
+static void apply_baud(void);
 
 // Variables
 static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
+static uint8_t stat_index[256]; // Controller id to stat_msgs index, 0xFF if not stored
 static Mutex can_mtx;
+static volatile bool baud_pending = false;
+static volatile uint32_t baud_btr;
+
+// Active peers, compact and age filtered. Modified with the system locked.
+static can_peer peers[CAN_STATUS_MSGS_TO_STORE];
+static int peer_pos[CAN_STATUS_MSGS_TO_STORE]; // stat_msgs index to peers index, -1 if not active
+static int peer_num = 0;
+
+// Transmit queues, filled by comm_can_transmit and drained by cancom_tx_thread
+typedef struct {
+	CANTxFrame *frames;
+	int size;
+	volatile int read;
+	volatile int write;
+	volatile uint32_t drops;
+} tx_queue;
+
+static CANTxFrame tx_frames_setpoint[CAN_TX_QUEUE_SETPOINT];
+static CANTxFrame tx_frames_status[CAN_TX_QUEUE_STATUS];
+static CANTxFrame tx_frames_bulk[CAN_TX_QUEUE_BULK];
+static tx_queue tx_queues[CAN_TX_PRIO_NUM] = {
+		{tx_frames_setpoint, CAN_TX_QUEUE_SETPOINT, 0, 0, 0},
+		{tx_frames_status, CAN_TX_QUEUE_STATUS, 0, 0, 0},
+		{tx_frames_bulk, CAN_TX_QUEUE_BULK, 0, 0, 0}
+};
+
+// Statistics
+static volatile uint32_t rx_frames = 0;
+static volatile uint32_t tx_frames = 0;
+static volatile uint32_t tx_mailbox_full = 0;
+static volatile uint32_t rx_overflows = 0;
+static volatile uint32_t framing_errors = 0;
+static volatile uint32_t bus_off = 0;
+static volatile uint32_t bus_off_recoveries = 0;
+static volatile bool in_bus_off = false;
+static uint16_t rx_cnt_cmd[CAN_STATS_CMDS]; // Modified with the system locked
+static uint16_t tx_cnt_cmd[CAN_STATS_CMDS]; // Modified with the system locked
+static uint16_t rx_rate_cmd[CAN_STATS_CMDS];
+static uint16_t tx_rate_cmd[CAN_STATS_CMDS];
+static uint32_t rx_frames_last = 0;
+static uint32_t tx_frames_last = 0;
+static uint16_t rx_rate = 0;
+static uint16_t tx_rate = 0;
+
+// Transport receive state
+static uint8_t rx_buffer[RX_BUFFER_SIZE];
+static bool rx_active = false;
+static uint8_t rx_sender;
+static uint8_t rx_mode;
+static unsigned int rx_len;
+static uint16_t rx_crc;
+static uint8_t rx_next_seq;
+static uint8_t rx_transfer;
+
+// Last processed transfer per sender, used to detect retransmissions
+typedef struct {
+	int16_t transfer; // -1 if none
+	uint16_t len;
+	uint16_t crc;
+} rx_transfer_info;
+
+static rx_transfer_info rx_last_transfer[256];
+
+// Transport processing state
+static uint8_t process_buffer[RX_BUFFER_SIZE];
+static unsigned int process_len;
+static uint8_t process_sender;
+static uint8_t process_mode;
+static volatile bool process_busy = false;
+
+// Transport send state
+static Mutex tx_buffer_mtx;
+static uint8_t tx_transfer = 0;
+static Semaphore ack_sem;
+static volatile uint8_t ack_sender;
+static volatile uint8_t ack_seq;
+static volatile uint8_t ack_status;
+
+// Time synchronization state
+static uint8_t sync_seq = 0;
+static volatile bool sync_tx_done = false;
+static volatile uint8_t sync_tx_seq;
+static volatile uint32_t sync_tx_local;
+static volatile bool sync_have_master = false;
+static volatile uint8_t sync_master_id;
+static volatile systime_t sync_master_time;
+static volatile uint8_t sync_rx_seq;
+static volatile uint32_t sync_rx_local;
 
 /*
- * 500KBaud, automatic wakeup, automatic recover
- * from abort mode.
+ * 500KBaud with 14 tq and the sample point at 85.7 %,
+ * automatic wakeup, automatic recover from abort mode.
+ * This is the timing that comm_can_set_baud computes
+ * for 500k, so the driver is not restarted at startup.
  * See section 22.7.7 on the STM32 reference manual.
  */
-static const CANConfig cancfg = {
+static CANConfig cancfg = {
 		CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_TXFP,
 		CAN_BTR_SJW(0) | CAN_BTR_TS2(1) |
-		CAN_BTR_TS1(8) | CAN_BTR_BRP(6)
+		CAN_BTR_TS1(10) | CAN_BTR_BRP(5)
 };
 
 void comm_can_init(void) {
 	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
 		stat_msgs[i].id = -1;
+		peer_pos[i] = -1;
+	}
+
+	memset(stat_index, 0xFF, sizeof(stat_index));
+
+	for (int i = 0;i < 256;i++) {
+		rx_last_transfer[i].transfer = -1;
 	}
 
 	chMtxInit(&can_mtx);
+	chMtxInit(&tx_buffer_mtx);
+	chSemInit(&ack_sem, 0);
 
 	palSetPadMode(GPIOB, 8,
 			PAL_MODE_ALTERNATE(GPIO_AF_CAN1) |
@@ -80,6 +226,41 @@ void comm_can_init(void) {
 			cancom_thread, NULL);
 	chThdCreateStatic(cancom_status_thread_wa, sizeof(cancom_status_thread_wa), NORMALPRIO,
 			cancom_status_thread, NULL);
+	chThdCreateStatic(cancom_process_thread_wa, sizeof(cancom_process_thread_wa), NORMALPRIO,
+			cancom_process_thread, NULL);
+	chThdCreateStatic(cancom_tx_thread_wa, sizeof(cancom_tx_thread_wa), NORMALPRIO + 2,
+			cancom_tx_thread, NULL);
+}
+
+/**
+ * Set the CAN bit rate. The bit timing is computed from the APB1 clock and
+ * CAN_SAMPLE_POINT. If it changes, the CAN driver is restarted from the status
+ * thread once the transmit queues are empty and no transfer is in progress,
+ * so that a reply to the packet that changed the bit rate is not lost.
+ *
+ * @param baud
+ * The bit rate to use.
+ */
+void comm_can_set_baud(CAN_BAUD baud) {
+	uint32_t bitrate;
+
+	switch (baud) {
+	case CAN_BAUD_125K: bitrate = 125000; break;
+	case CAN_BAUD_250K: bitrate = 250000; break;
+	case CAN_BAUD_500K: bitrate = 500000; break;
+	case CAN_BAUD_1M: bitrate = 1000000; break;
+	default: return;
+	}
+
+	uint32_t btr;
+	if (!can_timing_calc_btr(STM32_PCLK1, bitrate, CAN_SAMPLE_POINT, &btr)) {
+		return;
+	}
+
+	chSysLock();
+	baud_btr = btr;
+	baud_pending = btr != cancfg.btr;
+	chSysUnlock();
 }
 
 static msg_t cancom_thread(void *arg) {
@@ -87,21 +268,54 @@ static msg_t cancom_thread(void *arg) {
 	chRegSetThreadName("CAN");
 
 	EventListener el;
+	EventListener el_err;
 	CANRxFrame rxmsg;
 	int32_t ind = 0;
 
 	chEvtRegister(&CANDx.rxfull_event, &el, 0);
+	chEvtRegister(&CANDx.error_event, &el_err, 1);
 
 	while(!chThdShouldTerminate()) {
-		if (chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(10)) == 0) {
+		eventmask_t evt = chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(10));
+
+		if (evt == 0) {
 			continue;
 		}
 
+		// Time sync frames are timestamped when the thread wakes up to keep
+		// the processing time of earlier frames out of the measurement.
+		const uint32_t rx_local = timesync_get_local_us();
+
+		if (evt & EVENT_MASK(1)) {
+			flagsmask_t flags = chEvtGetAndClearFlags(&el_err);
+
+			if ((flags & CAN_BUS_OFF_ERROR) && !in_bus_off) {
+				in_bus_off = true;
+				bus_off++;
+			}
+
+			if (flags & CAN_OVERFLOW_ERROR) {
+				rx_overflows++;
+			}
+
+			if (flags & CAN_FRAMING_ERROR) {
+				framing_errors++;
+			}
+		}
+
 		chMtxLock(&can_mtx);
 		msg_t result = canReceive(&CANDx, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
 		chMtxUnlock();
 
 		while (result == RDY_OK) {
+			rx_frames++;
+
+			if (rxmsg.IDE == CAN_IDE_EXT && ((rxmsg.EID >> 8) & 0xFF) < CAN_STATS_CMDS) {
+				chSysLock();
+				rx_cnt_cmd[(rxmsg.EID >> 8) & 0xFF]++;
+				chSysUnlock();
+			}
+
 			if (rxmsg.IDE == CAN_IDE_EXT) {
 				uint8_t id = rxmsg.EID & 0xFF;
 				CAN_PACKET_ID cmd = rxmsg.EID >> 8;
@@ -133,24 +347,142 @@ static msg_t cancom_thread(void *arg) {
 						timeout_reset();
 						break;
 
+					case CAN_PACKET_BUFFER_START:
+						ind = 2;
+						rx_sender = rxmsg.data8[0];
+						rx_mode = rxmsg.data8[1];
+						rx_len = buffer_get_uint16(rxmsg.data8, &ind);
+						rx_crc = buffer_get_uint16(rxmsg.data8, &ind);
+						rx_transfer = rxmsg.DLC > 6 ? rxmsg.data8[6] : 0;
+
+						// The transfer numbers start over when the sender reboots. The
+						// same number with another payload is a new transfer, not a
+						// retransmission.
+						if (rx_last_transfer[rx_sender].transfer == rx_transfer &&
+								(rx_last_transfer[rx_sender].len != rx_len ||
+										rx_last_transfer[rx_sender].crc != rx_crc)) {
+							rx_last_transfer[rx_sender].transfer = -1;
+						}
+						rx_next_seq = 0;
+						rx_active = rx_len > 0 && rx_len < RX_BUFFER_SIZE;
+						break;
+
+					case CAN_PACKET_FILL_RX_BUFFER:
+						rx_fill(&rxmsg, false);
+						break;
+
+					case CAN_PACKET_FILL_RX_BUFFER_LAST:
+						rx_fill(&rxmsg, true);
+						break;
+
+					case CAN_PACKET_BUFFER_ACK:
+						ack_sender = rxmsg.data8[0];
+						ack_seq = rxmsg.data8[1];
+						ack_status = rxmsg.data8[2];
+						chSemSignal(&ack_sem);
+						break;
+
+					case CAN_PACKET_PROCESS_SHORT_BUFFER:
+						if (rxmsg.DLC > 2) {
+							queue_process(rxmsg.data8[0], rxmsg.data8[1], rxmsg.data8 + 2, rxmsg.DLC - 2);
+						}
+						break;
+
 					default:
 						break;
 					}
 				}
 
+				// Group frames are addressed to a base id and carry one slot per controller
+				int16_t slot_val;
+
 				switch (cmd) {
+				case CAN_PACKET_SET_DUTY_GROUP:
+					slot_val = get_group_slot(&rxmsg, id);
+					if (slot_val != CAN_GROUP_SLOT_UNUSED) {
+						mcpwm_set_duty((float)slot_val / 10000.0);
+						timeout_reset();
+					}
+					break;
+
+				case CAN_PACKET_SET_CURRENT_GROUP:
+					slot_val = get_group_slot(&rxmsg, id);
+					if (slot_val != CAN_GROUP_SLOT_UNUSED) {
+						mcpwm_set_current((float)slot_val / 100.0);
+						timeout_reset();
+					}
+					break;
+
+				case CAN_PACKET_SET_CURRENT_BRAKE_GROUP:
+					slot_val = get_group_slot(&rxmsg, id);
+					if (slot_val != CAN_GROUP_SLOT_UNUSED) {
+						mcpwm_set_brake_current((float)slot_val / 100.0);
+						timeout_reset();
+					}
+					break;
+
 				case CAN_PACKET_STATUS:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						stat_tmp = &stat_msgs[i];
-						if (stat_tmp->id == id || stat_tmp->id == -1) {
-							ind = 0;
-							stat_tmp->id = id;
-							stat_tmp->rx_time = chTimeNow();
-							stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
-							stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
-							break;
-						}
+					stat_tmp = get_status_slot(id, true);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time = chTimeNow();
+						stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
+						update_peer(stat_index[id], stat_tmp);
+					}
+					break;
+
+				case CAN_PACKET_STATUS_2:
+					stat_tmp = get_status_slot(id, false);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time_2 = chTimeNow();
+						stat_tmp->amp_hours = (float)buffer_get_int32(rxmsg.data8, &ind) / 10000.0;
+						stat_tmp->amp_hours_charged = (float)buffer_get_int32(rxmsg.data8, &ind) / 10000.0;
+					}
+					break;
+
+				case CAN_PACKET_STATUS_3:
+					stat_tmp = get_status_slot(id, false);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time_3 = chTimeNow();
+						stat_tmp->tacho = buffer_get_int32(rxmsg.data8, &ind);
+						stat_tmp->v_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->fault = rxmsg.data8[ind++];
+					}
+					break;
+
+				case CAN_PACKET_STATUS_4:
+					stat_tmp = get_status_slot(id, false);
+					if (stat_tmp) {
+						ind = 0;
+						stat_tmp->rx_time_4 = chTimeNow();
+						stat_tmp->temp_fet = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->temp_pcb = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+						stat_tmp->current_in = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
+					}
+					break;
+
+				case CAN_PACKET_TIME_SYNC:
+					// Follow the controller with the lowest id
+					if (id < app_get_configuration()->controller_id &&
+							(!sync_have_master || id <= sync_master_id ||
+							chTimeElapsedSince(sync_master_time) > MS2ST(TIMESYNC_TIMEOUT_MS))) {
+						sync_master_id = id;
+						sync_master_time = chTimeNow();
+						sync_have_master = true;
+						sync_rx_seq = rxmsg.data8[0];
+						sync_rx_local = rx_local;
+					}
+					break;
+
+				case CAN_PACKET_TIME_FOLLOW_UP:
+					if (sync_have_master && id == sync_master_id &&
+							rxmsg.data8[0] == sync_rx_seq) {
+						ind = 1;
+						timesync_process_sample(buffer_get_uint32(rxmsg.data8, &ind), sync_rx_local);
 					}
 					break;
 
@@ -166,6 +498,7 @@ static msg_t cancom_thread(void *arg) {
 	}
 
 	chEvtUnregister(&CAND1.rxfull_event, &el);
+	chEvtUnregister(&CAND1.error_event, &el_err);
 	return 0;
 }
 
@@ -173,15 +506,89 @@ static msg_t cancom_status_thread(void *arg) {
 	(void)arg;
 	chRegSetThreadName("CAN status");
 
+	systime_t last_1 = 0;
+	systime_t last_2 = 0;
+	systime_t last_3 = 0;
+	systime_t last_4 = 0;
+	systime_t last_stats = 0;
+	systime_t last_sync = 0;
+
 	for(;;) {
-		if (app_get_configuration()->send_can_status) {
-			// Send status message
-			int32_t send_index = 0;
+		const app_configuration *conf = app_get_configuration();
+
+		// With automatic bus-off management the controller recovers by
+		// itself, detect that here.
+		if (in_bus_off && !(CANDx.can->ESR & CAN_ESR_BOFF)) {
+			in_bus_off = false;
+			bus_off_recoveries++;
+		}
+
+		expire_peers();
+
+		if (baud_pending) {
+			apply_baud();
+		}
+
+		if (status_due(&last_stats, 1)) {
+			update_stats();
+		}
+
+		// This controller is the time master unless it hears one with a lower id
+		timesync_set_master(!sync_have_master ||
+				chTimeElapsedSince(sync_master_time) > MS2ST(TIMESYNC_TIMEOUT_MS));
+
+		if (timesync_is_master()) {
+			uint8_t buffer[5];
+			int32_t send_index;
+
+			if (sync_tx_done) {
+				sync_tx_done = false;
+				send_index = 0;
+				buffer[send_index++] = sync_tx_seq;
+				buffer_append_uint32(buffer, timesync_local_to_sync(sync_tx_local), &send_index);
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_TIME_FOLLOW_UP << 8), buffer, send_index);
+			}
+
+			if (status_due(&last_sync, 1000 / TIMESYNC_INTERVAL_MS)) {
+				buffer[0] = ++sync_seq;
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_TIME_SYNC << 8), buffer, 1);
+			}
+		}
+
+		if (conf->send_can_status) {
+			int32_t send_index;
 			uint8_t buffer[8];
-			buffer_append_int32(buffer, (int32_t)mcpwm_get_rpm(), &send_index);
-			buffer_append_int16(buffer, (int16_t)(mcpwm_get_tot_current() * 10.0), &send_index);
-			buffer_append_int16(buffer, (int16_t)(mcpwm_get_duty_cycle_now() * 1000.0), &send_index);
-			comm_can_transmit(app_get_configuration()->controller_id | ((uint32_t)CAN_PACKET_STATUS << 8), buffer, send_index);
+
+			if (status_due(&last_1, conf->can_status_rate_1)) {
+				send_index = 0;
+				buffer_append_int32(buffer, (int32_t)mcpwm_get_rpm(), &send_index);
+				buffer_append_int16(buffer, (int16_t)(mcpwm_get_tot_current() * 10.0), &send_index);
+				buffer_append_int16(buffer, (int16_t)(mcpwm_get_duty_cycle_now() * 1000.0), &send_index);
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_STATUS << 8), buffer, send_index);
+			}
+
+			if (status_due(&last_2, conf->can_status_rate_2)) {
+				send_index = 0;
+				buffer_append_int32(buffer, (int32_t)(mcpwm_get_amp_hours(false) * 10000.0), &send_index);
+				buffer_append_int32(buffer, (int32_t)(mcpwm_get_amp_hours_charged(false) * 10000.0), &send_index);
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_STATUS_2 << 8), buffer, send_index);
+			}
+
+			if (status_due(&last_3, conf->can_status_rate_3)) {
+				send_index = 0;
+				buffer_append_int32(buffer, mcpwm_get_tachometer_value(false), &send_index);
+				buffer_append_int16(buffer, (int16_t)(GET_INPUT_VOLTAGE() * 10.0), &send_index);
+				buffer[send_index++] = mcpwm_get_fault();
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_STATUS_3 << 8), buffer, send_index);
+			}
+
+			if (status_due(&last_4, conf->can_status_rate_4)) {
+				send_index = 0;
+				buffer_append_int16(buffer, (int16_t)(NTC_TEMP(ADC_IND_TEMP_MOS1) * 10.0), &send_index);
+				buffer_append_int16(buffer, (int16_t)(NTC_TEMP(ADC_IND_TEMP_PCB) * 10.0), &send_index);
+				buffer_append_int16(buffer, (int16_t)(mcpwm_get_tot_current_in_filtered() * 10.0), &send_index);
+				comm_can_transmit(conf->controller_id | ((uint32_t)CAN_PACKET_STATUS_4 << 8), buffer, send_index);
+			}
 		}
 
 		chThdSleepMilliseconds(CAN_STATUS_MSG_INT_MS);
@@ -190,21 +597,147 @@ static msg_t cancom_status_thread(void *arg) {
 	return 0;
 }
 
+static msg_t cancom_process_thread(void *arg) {
+	(void)arg;
+	chRegSetThreadName("CAN process");
+
+	process_tp = chThdSelf();
+
+	for(;;) {
+		chEvtWaitAny((eventmask_t) 1);
+
+		if (process_mode == BUFFER_MODE_PROCESS) {
+			commands_process_packet_reply(process_buffer, process_len, send_packet_wrapper);
+		} else {
+			commands_send_packet(process_buffer, process_len);
+		}
+
+		process_busy = false;
+	}
+
+	return 0;
+}
+
+/*
+ * Moves frames from the transmit queues to the mailboxes, highest priority
+ * first, every time a mailbox becomes empty or a frame is queued.
+ */
+static msg_t cancom_tx_thread(void *arg) {
+	(void)arg;
+	chRegSetThreadName("CAN TX");
+
+	EventListener el;
+
+	tx_tp = chThdSelf();
+	chEvtRegisterMask(&CANDx.txempty_event, &el, (eventmask_t) 2);
+
+	for(;;) {
+		chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(10));
+
+		chMtxLock(&can_mtx);
+
+		for (int prio = 0;prio < CAN_TX_PRIO_NUM;prio++) {
+			tx_queue *q = &tx_queues[prio];
+
+			while (q->read != q->write) {
+				const CANTxFrame *txmsg = &q->frames[q->read];
+
+				if (canTransmit(&CANDx, CAN_ANY_MAILBOX, txmsg, TIME_IMMEDIATE) != RDY_OK) {
+					// All mailboxes are full, wait for the next TX empty event.
+					tx_mailbox_full++;
+					prio = CAN_TX_PRIO_NUM;
+					break;
+				}
+
+				// The follow up carries the time when the sync entered a mailbox
+				if (((txmsg->EID >> 8) & 0xFF) == CAN_PACKET_TIME_SYNC) {
+					sync_tx_local = timesync_get_local_us();
+					sync_tx_seq = txmsg->data8[0];
+					sync_tx_done = true;
+				}
+
+				tx_frames++;
+				if (((txmsg->EID >> 8) & 0xFF) < CAN_STATS_CMDS) {
+					chSysLock();
+					tx_cnt_cmd[(txmsg->EID >> 8) & 0xFF]++;
+					chSysUnlock();
+				}
+
+				q->read = (q->read + 1) % q->size;
+			}
+		}
+
+		chMtxUnlock();
+	}
+
+	return 0;
+}
+
+/**
+ * Queue a frame for transmission. This function never blocks. The priority
+ * is derived from the packet id and if the queue for that priority is full,
+ * the frame is dropped and counted.
+ *
+ * @param id
+ * The extended id of the frame.
+ *
+ * @param data
+ * The frame data.
+ *
+ * @param len
+ * The data length, at most 8.
+ */
 void comm_can_transmit(uint32_t id, uint8_t *data, uint8_t len) {
-	CANTxFrame txmsg;
+	tx_queue *q = &tx_queues[get_tx_prio(id)];
 
-	txmsg.IDE = CAN_IDE_EXT;
-	txmsg.EID = id;
-	txmsg.RTR = CAN_RTR_DATA;
-	txmsg.DLC = len;
+	if (len > 8) {
+		len = 8;
+	}
+
+	chSysLock();
+
+	const int next = (q->write + 1) % q->size;
+	if (next == q->read) {
+		q->drops++;
+		chSysUnlock();
+		return;
+	}
+
+	CANTxFrame *txmsg = &q->frames[q->write];
+	txmsg->IDE = CAN_IDE_EXT;
+	txmsg->EID = id;
+	txmsg->RTR = CAN_RTR_DATA;
+	txmsg->DLC = len;
 
 	for (int i = 0;i < len;i++) {
-		txmsg.data8[i] = data[i];
+		txmsg->data8[i] = data[i];
 	}
 
-	chMtxLock(&can_mtx);
-	canTransmit(&CAND1, CAN_ANY_MAILBOX, &txmsg, MS2ST(2));
-	chMtxUnlock();
+	q->write = next;
+
+	if (tx_tp) {
+		chEvtSignalI(tx_tp, (eventmask_t) 1);
+	}
+
+	chSchRescheduleS();
+	chSysUnlock();
+}
+
+/**
+ * Get the number of frames dropped because a transmit queue was full.
+ *
+ * @param prio
+ * The queue priority.
+ *
+ * @return
+ * The number of dropped frames since startup.
+ */
+uint32_t comm_can_get_tx_drops(CAN_TX_PRIO prio) {
+	if (prio < CAN_TX_PRIO_NUM) {
+		return tx_queues[prio].drops;
+	} else {
+		return 0;
+	}
 }
 
 void comm_can_set_duty(uint8_t controller_id, float duty) {
@@ -235,6 +768,268 @@ void comm_can_set_rpm(uint8_t controller_id, float rpm) {
 	comm_can_transmit(controller_id | ((uint32_t)CAN_PACKET_SET_RPM << 8), buffer, send_index);
 }
 
+/**
+ * Get CAN bus statistics.
+ *
+ * @param stats
+ * Pointer to store the statistics in.
+ */
+void comm_can_get_stats(can_stats *stats) {
+	stats->rx_frames = rx_frames;
+	stats->tx_frames = tx_frames;
+	stats->rx_rate = rx_rate;
+	stats->tx_rate = tx_rate;
+	stats->tx_mailbox_full = tx_mailbox_full;
+
+	for (int i = 0;i < CAN_TX_PRIO_NUM;i++) {
+		stats->tx_drops[i] = comm_can_get_tx_drops(i);
+	}
+
+	stats->rx_overflows = rx_overflows;
+	stats->framing_errors = framing_errors;
+	stats->bus_off = bus_off;
+	stats->bus_off_recoveries = bus_off_recoveries;
+
+	const uint32_t esr = CANDx.can->ESR;
+	stats->tec = (esr >> 16) & 0xFF;
+	stats->rec = (esr >> 24) & 0xFF;
+
+	memset(stats->status_age, 0, sizeof(stats->status_age));
+	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
+		if (stat_msgs[i].id < 0) {
+			continue;
+		}
+
+		const systime_t age = chTimeElapsedSince(stat_msgs[i].rx_time);
+		if (age < MS2ST(10)) {
+			stats->status_age[0]++;
+		} else if (age < MS2ST(100)) {
+			stats->status_age[1]++;
+		} else if (age < MS2ST(1000)) {
+			stats->status_age[2]++;
+		} else {
+			stats->status_age[3]++;
+		}
+	}
+}
+
+/**
+ * Get the number of received frames with a packet id during the last second.
+ *
+ * @param cmd
+ * The packet id.
+ *
+ * @return
+ * The frame rate, or 0 for packet ids that are not tracked.
+ */
+uint16_t comm_can_get_rx_rate(uint8_t cmd) {
+	return cmd < CAN_STATS_CMDS ? rx_rate_cmd[cmd] : 0;
+}
+
+/**
+ * Get the number of transmitted frames with a packet id during the last second.
+ *
+ * @param cmd
+ * The packet id.
+ *
+ * @return
+ * The frame rate, or 0 for packet ids that are not tracked.
+ */
+uint16_t comm_can_get_tx_rate(uint8_t cmd) {
+	return cmd < CAN_STATS_CMDS ? tx_rate_cmd[cmd] : 0;
+}
+
+/**
+ * Send duty cycles to several controllers using group frames. Controllers whose
+ * ids share the same base (id & ~(CAN_GROUP_SLOTS - 1)) are packed into one frame.
+ *
+ * @param ids
+ * The controller ids.
+ *
+ * @param duty
+ * The duty cycle for each controller.
+ *
+ * @param num
+ * The number of controllers.
+ */
+void comm_can_set_duty_multi(const uint8_t *ids, const float *duty, int num) {
+	send_group(CAN_PACKET_SET_DUTY_GROUP, ids, duty, 10000.0, num);
+}
+
+/**
+ * Send currents to several controllers using group frames.
+ *
+ * @param ids
+ * The controller ids.
+ *
+ * @param current
+ * The current for each controller.
+ *
+ * @param num
+ * The number of controllers.
+ */
+void comm_can_set_current_multi(const uint8_t *ids, const float *current, int num) {
+	send_group(CAN_PACKET_SET_CURRENT_GROUP, ids, current, 100.0, num);
+}
+
+/**
+ * Send brake currents to several controllers using group frames.
+ *
+ * @param ids
+ * The controller ids.
+ *
+ * @param current
+ * The brake current for each controller.
+ *
+ * @param num
+ * The number of controllers.
+ */
+void comm_can_set_current_brake_multi(const uint8_t *ids, const float *current, int num) {
+	send_group(CAN_PACKET_SET_CURRENT_BRAKE_GROUP, ids, current, 100.0, num);
+}
+
+/**
+ * Send a buffer to another controller, where it will be processed by
+ * commands_process_packet. Payloads that do not fit in a single frame are
+ * split into sequence numbered chunks that the receiver acknowledges every
+ * TRANSPORT_WINDOW chunks, and a CRC is checked over the reassembled payload.
+ * Every transfer carries a sequence number, so that a payload that is sent
+ * again because only the final ack was lost is not processed twice.
+ * Replies from the receiver come back the same way and are sent to the host
+ * using the current command send function.
+ *
+ * Payloads of up to 6 bytes are sent in a single frame that is not
+ * acknowledged, so there is no delivery guarantee for them.
+ *
+ * Note that this function blocks until the transfer is acknowledged, so it
+ * must not be called from the CAN RX thread.
+ *
+ * @param controller_id
+ * The controller to send the buffer to. Broadcast is not supported.
+ *
+ * @param data
+ * The payload.
+ *
+ * @param len
+ * The payload length.
+ *
+ * @param is_reply
+ * True if the payload is a reply to a buffer received over CAN.
+ *
+ * @return
+ * True if the receiver got the complete payload, false otherwise. For
+ * payloads of up to 6 bytes, true only means that the frame was queued.
+ */
+bool comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool is_reply) {
+	if (controller_id == 255 || len == 0 || len >= RX_BUFFER_SIZE) {
+		return false;
+	}
+
+	const uint8_t own_id = app_get_configuration()->controller_id;
+	const uint8_t mode = is_reply ? BUFFER_MODE_REPLY : BUFFER_MODE_PROCESS;
+	uint8_t buffer[8];
+	int32_t send_index = 0;
+
+	if (len <= 6) {
+		buffer[send_index++] = own_id;
+		buffer[send_index++] = mode;
+		memcpy(buffer + send_index, data, len);
+		send_index += len;
+		comm_can_transmit(controller_id | ((uint32_t)CAN_PACKET_PROCESS_SHORT_BUFFER << 8), buffer, send_index);
+		return true;
+	}
+
+	chMtxLock(&tx_buffer_mtx);
+
+	const unsigned int chunks = (len + 6) / 7;
+	const uint8_t transfer = tx_transfer++;
+	unsigned int seq = 0;
+	int retries = 0;
+	bool restart = true;
+	bool ok = false;
+
+	for (;;) {
+		if (restart) {
+			send_index = 0;
+			buffer[send_index++] = own_id;
+			buffer[send_index++] = mode;
+			buffer_append_uint16(buffer, len, &send_index);
+			buffer_append_uint16(buffer, crc16(data, len), &send_index);
+			buffer[send_index++] = transfer;
+			comm_can_transmit(controller_id | ((uint32_t)CAN_PACKET_BUFFER_START << 8), buffer, send_index);
+			seq = 0;
+			restart = false;
+		}
+
+		unsigned int end = seq + TRANSPORT_WINDOW;
+		if (end > chunks) {
+			end = chunks;
+		}
+
+		chSemReset(&ack_sem, 0);
+
+		for (unsigned int i = seq;i < end;i++) {
+			unsigned int bytes = len - i * 7;
+			if (bytes > 7) {
+				bytes = 7;
+			}
+
+			buffer[0] = i;
+			memcpy(buffer + 1, data + i * 7, bytes);
+
+			CAN_PACKET_ID cmd = (i == (end - 1)) ? CAN_PACKET_FILL_RX_BUFFER_LAST : CAN_PACKET_FILL_RX_BUFFER;
+			comm_can_transmit(controller_id | ((uint32_t)cmd << 8), buffer, bytes + 1);
+		}
+
+		if (chSemWaitTimeout(&ack_sem, MS2ST(TRANSPORT_ACK_TIMEOUT_MS)) != RDY_OK ||
+				ack_sender != controller_id) {
+			// Lost start or ack frame, start over.
+			if (++retries > TRANSPORT_RETRIES) {
+				break;
+			}
+			restart = true;
+			continue;
+		}
+
+		if (ack_status == ACK_DONE) {
+			ok = true;
+			break;
+		} else if (ack_status != ACK_IN_PROGRESS) {
+			break;
+		}
+
+		// Go back to the first chunk the receiver is missing.
+		if (ack_seq <= seq && ++retries > TRANSPORT_RETRIES) {
+			break;
+		}
+		seq = ack_seq;
+	}
+
+	chMtxUnlock();
+
+	return ok;
+}
+
+/**
+ * Get the controllers that have sent a status message during the last
+ * CAN_PEER_MAX_AGE_MS milliseconds. The list is updated when status messages
+ * are received and when they expire, so no age check is needed by the caller.
+ *
+ * @param peers_out
+ * Array with room for CAN_STATUS_MSGS_TO_STORE entries to copy the peers to.
+ *
+ * @return
+ * The number of active peers.
+ */
+int comm_can_get_peers(can_peer *peers_out) {
+	chSysLock();
+	const int num = peer_num;
+	memcpy(peers_out, peers, num * sizeof(can_peer));
+	chSysUnlock();
+
+	return num;
+}
+
 /**
  * Get status message by index.
  *
@@ -262,11 +1057,325 @@ can_status_msg *comm_can_get_status_msg_index(int index) {
  * The message or 0 for an invalid id.
  */
 can_status_msg *comm_can_get_status_msg_id(int id) {
+	if (id < 0 || id > 255 || stat_index[id] == 0xFF) {
+		return 0;
+	}
+
+	return &stat_msgs[stat_index[id]];
+}
+
+static void send_group(CAN_PACKET_ID cmd, const uint8_t *ids, const float *values,
+		float scale, int num) {
+	if (num <= 0) {
+		return;
+	}
+
+	bool sent[num];
+
+	for (int i = 0;i < num;i++) {
+		sent[i] = false;
+	}
+
+	for (int i = 0;i < num;i++) {
+		if (sent[i]) {
+			continue;
+		}
+
+		const uint8_t base_id = ids[i] & ~(CAN_GROUP_SLOTS - 1);
+		int32_t send_index = 0;
+		uint8_t buffer[2 * CAN_GROUP_SLOTS];
+
+		for (int j = 0;j < CAN_GROUP_SLOTS;j++) {
+			buffer_append_int16(buffer, CAN_GROUP_SLOT_UNUSED, &send_index);
+		}
+
+		for (int j = i;j < num;j++) {
+			if ((ids[j] & ~(CAN_GROUP_SLOTS - 1)) == base_id) {
+				float val = values[j] * scale;
+				utils_truncate_number(&val, -32767.0, 32767.0);
+				send_index = 2 * (ids[j] - base_id);
+				buffer_append_int16(buffer, (int16_t)val, &send_index);
+				sent[j] = true;
+			}
+		}
+
+		comm_can_transmit(base_id | ((uint32_t)cmd << 8), buffer, sizeof(buffer));
+	}
+}
+
+/**
+ * Get the slot addressed to this controller from a group frame.
+ *
+ * @param rxmsg
+ * The received frame.
+ *
+ * @param base_id
+ * The base id the frame was sent to.
+ *
+ * @return
+ * The slot value, or CAN_GROUP_SLOT_UNUSED if this controller has no slot in the frame.
+ */
+static int16_t get_group_slot(CANRxFrame *rxmsg, uint8_t base_id) {
+	const int slot = (int)app_get_configuration()->controller_id - (int)base_id;
+
+	if (slot < 0 || slot >= CAN_GROUP_SLOTS || rxmsg->DLC < (2 * slot + 2)) {
+		return CAN_GROUP_SLOT_UNUSED;
+	}
+
+	int32_t ind = 2 * slot;
+	return buffer_get_int16(rxmsg->data8, &ind);
+}
+
+static void rx_fill(CANRxFrame *rxmsg, bool is_last) {
+	if (!rx_active || rxmsg->DLC < 2) {
+		return;
+	}
+
+	// Chunks are only accepted in order, the sender goes back to rx_next_seq
+	// after the next ack.
+	const unsigned int offset = rx_next_seq * 7;
+	if (rxmsg->data8[0] == rx_next_seq && offset < rx_len) {
+		unsigned int bytes = rxmsg->DLC - 1;
+		if ((offset + bytes) > rx_len) {
+			bytes = rx_len - offset;
+		}
+
+		memcpy(rx_buffer + offset, rxmsg->data8 + 1, bytes);
+		rx_next_seq++;
+
+		if ((offset + bytes) == rx_len) {
+			rx_active = false;
+
+			if (crc16(rx_buffer, rx_len) != rx_crc) {
+				send_ack(ACK_CRC_ERROR);
+			} else if (rx_last_transfer[rx_sender].transfer == rx_transfer) {
+				// Retransmission after a lost ack, already processed.
+				send_ack(ACK_DONE);
+			} else if (!queue_process(rx_sender, rx_mode, rx_buffer, rx_len)) {
+				send_ack(ACK_BUSY);
+			} else {
+				rx_last_transfer[rx_sender].transfer = rx_transfer;
+				rx_last_transfer[rx_sender].len = rx_len;
+				rx_last_transfer[rx_sender].crc = rx_crc;
+				send_ack(ACK_DONE);
+			}
+
+			return;
+		}
+	}
+
+	if (is_last) {
+		send_ack(ACK_IN_PROGRESS);
+	}
+}
+
+static void send_ack(uint8_t status) {
+	uint8_t buffer[3];
+	buffer[0] = app_get_configuration()->controller_id;
+	buffer[1] = rx_next_seq;
+	buffer[2] = status;
+	comm_can_transmit(rx_sender | ((uint32_t)CAN_PACKET_BUFFER_ACK << 8), buffer, 3);
+}
+
+static bool queue_process(uint8_t sender, uint8_t mode, uint8_t *data, unsigned int len) {
+	if (process_busy) {
+		return false;
+	}
+
+	memcpy(process_buffer, data, len);
+	process_len = len;
+	process_sender = sender;
+	process_mode = mode;
+	process_busy = true;
+	chEvtSignal(process_tp, (eventmask_t) 1);
+
+	return true;
+}
+
+static void send_packet_wrapper(unsigned char *data, unsigned char len) {
+	comm_can_send_buffer(process_sender, data, len, true);
+}
+
+static CAN_TX_PRIO get_tx_prio(uint32_t id) {
+	switch ((CAN_PACKET_ID)(id >> 8)) {
+	case CAN_PACKET_SET_DUTY:
+	case CAN_PACKET_SET_CURRENT:
+	case CAN_PACKET_SET_CURRENT_BRAKE:
+	case CAN_PACKET_SET_RPM:
+	case CAN_PACKET_SET_DUTY_GROUP:
+	case CAN_PACKET_SET_CURRENT_GROUP:
+	case CAN_PACKET_SET_CURRENT_BRAKE_GROUP:
+		return CAN_TX_PRIO_SETPOINT;
+
+	case CAN_PACKET_STATUS:
+	case CAN_PACKET_STATUS_2:
+	case CAN_PACKET_STATUS_3:
+	case CAN_PACKET_STATUS_4:
+	case CAN_PACKET_TIME_SYNC:
+	case CAN_PACKET_TIME_FOLLOW_UP:
+		return CAN_TX_PRIO_STATUS;
+
+	default:
+		return CAN_TX_PRIO_BULK;
+	}
+}
+
+/**
+ * Get the stored status of a controller, or allocate a free entry for it.
+ *
+ * @param id
+ * The controller id.
+ *
+ * @param allocate
+ * Allocate a free entry if the id is not stored. Only CAN_PACKET_STATUS
+ * allocates entries, so that every stored entry has a valid rx_time.
+ *
+ * @return
+ * The status entry, or 0 if the id is not stored and no entry was allocated.
+ */
+static can_status_msg *get_status_slot(uint8_t id, bool allocate) {
+	if (stat_index[id] != 0xFF) {
+		return &stat_msgs[stat_index[id]];
+	}
+
+	if (!allocate) {
+		return 0;
+	}
+
 	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-		if (stat_msgs[i].id == id) {
+		if (stat_msgs[i].id == -1) {
+			stat_msgs[i].id = id;
+			stat_index[id] = i;
 			return &stat_msgs[i];
 		}
 	}
 
 	return 0;
 }
+
+/**
+ * Check if a status frame with the given rate should be sent now.
+ *
+ * @param last
+ * The time the frame was last sent. Updated if the frame is due.
+ *
+ * @param rate_hz
+ * The rate of the frame in Hz, 0 to disable it.
+ *
+ * @return
+ * True if the frame should be sent.
+ */
+static bool status_due(systime_t *last, uint16_t rate_hz) {
+	if (rate_hz == 0) {
+		return false;
+	}
+
+	systime_t period = CH_FREQUENCY / rate_hz;
+	if (chTimeElapsedSince(*last) < period) {
+		return false;
+	}
+
+	*last = chTimeNow();
+	return true;
+}
+
+/*
+ * Latch the frame counts of the past second as rates. Called once per second.
+ */
+static void update_stats(void) {
+	// Read and clear the counts together, so that no increment is lost
+	chSysLock();
+	for (int i = 0;i < CAN_STATS_CMDS;i++) {
+		rx_rate_cmd[i] = rx_cnt_cmd[i];
+		tx_rate_cmd[i] = tx_cnt_cmd[i];
+		rx_cnt_cmd[i] = 0;
+		tx_cnt_cmd[i] = 0;
+	}
+	chSysUnlock();
+
+	const uint32_t rx_now = rx_frames;
+	const uint32_t tx_now = tx_frames;
+	rx_rate = rx_now - rx_frames_last;
+	tx_rate = tx_now - tx_frames_last;
+	rx_frames_last = rx_now;
+	tx_frames_last = tx_now;
+}
+
+static void update_peer(int slot, can_status_msg *msg) {
+	chSysLock();
+
+	if (peer_pos[slot] < 0) {
+		peer_pos[slot] = peer_num++;
+	}
+
+	can_peer *p = &peers[peer_pos[slot]];
+	p->id = msg->id;
+	p->rx_time = msg->rx_time;
+	p->rpm = msg->rpm;
+	p->current = msg->current;
+	p->duty = msg->duty;
+
+	chSysUnlock();
+}
+
+static void expire_peers(void) {
+	chSysLock();
+
+	for (int i = 0;i < peer_num;i++) {
+		if (chTimeElapsedSince(peers[i].rx_time) > MS2ST(CAN_PEER_MAX_AGE_MS)) {
+			// Move the last peer here to keep the array compact
+			peer_pos[stat_index[peers[i].id]] = -1;
+			peer_num--;
+
+			if (i != peer_num) {
+				peers[i] = peers[peer_num];
+				peer_pos[stat_index[peers[i].id]] = i;
+				i--;
+			}
+		}
+	}
+
+	chSysUnlock();
+}
+
+/*
+ * True when all transmit queues and mailboxes are empty.
+ */
+static bool tx_idle(void) {
+	for (int prio = 0;prio < CAN_TX_PRIO_NUM;prio++) {
+		if (tx_queues[prio].read != tx_queues[prio].write) {
+			return false;
+		}
+	}
+
+	return (CANDx.can->TSR & CAN_TSR_TME) == CAN_TSR_TME;
+}
+
+/*
+ * Restart the CAN driver with the pending bit timing. Nothing is done while a
+ * buffer is processed or sent, or frames are waiting to be sent, so this is
+ * retried every status cycle until the bus is idle.
+ */
+static void apply_baud(void) {
+	if (process_busy || !tx_idle() || !chMtxTryLock(&tx_buffer_mtx)) {
+		return;
+	}
+
+	// Holding can_mtx makes sure that no transmission or reception is
+	// in progress while the driver is restarted.
+	chMtxLock(&can_mtx);
+
+	chSysLock();
+	const uint32_t btr = baud_btr;
+	baud_pending = false;
+	chSysUnlock();
+
+	if (btr != cancfg.btr) {
+		canStop(&CANDx);
+		cancfg.btr = btr;
+		canStart(&CANDx, &cancfg);
+	}
+
+	chMtxUnlock();
+	chMtxUnlock();
+}
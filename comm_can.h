@@ -28,16 +28,33 @@
 #include "conf_general.h"
 
 // Settings
-#define CAN_STATUS_MSG_INT_MS		1
+#define CAN_STATUS_MSG_INT_MS		1		// Base period of the status thread
 #define CAN_STATUS_MSGS_TO_STORE	10
+#define CAN_PEER_MAX_AGE_MS			100		// Peers are dropped from the active list after this time
+#define CAN_TX_QUEUE_SETPOINT		8		// Queue length for setpoint frames
+#define CAN_TX_QUEUE_STATUS			8		// Queue length for status frames
+#define CAN_TX_QUEUE_BULK			32		// Queue length for transport frames
+#define CAN_STATS_CMDS				32		// Packet ids to keep frame rates for
+#define CAN_GROUP_SLOTS				4		// Number of int16 setpoints in a group frame
+#define CAN_GROUP_SLOT_UNUSED		-32768	// Slot value that receivers should ignore
 
 // Functions
 void comm_can_init(void);
+void comm_can_set_baud(CAN_BAUD baud);
 void comm_can_transmit(uint32_t id, uint8_t *data, uint8_t len);
 void comm_can_set_duty(uint8_t controller_id, float duty);
 void comm_can_set_current(uint8_t controller_id, float current);
 void comm_can_set_current_brake(uint8_t controller_id, float current);
 void comm_can_set_rpm(uint8_t controller_id, float rpm);
+void comm_can_set_duty_multi(const uint8_t *ids, const float *duty, int num);
+void comm_can_set_current_multi(const uint8_t *ids, const float *current, int num);
+void comm_can_set_current_brake_multi(const uint8_t *ids, const float *current, int num);
+bool comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool is_reply);
+uint32_t comm_can_get_tx_drops(CAN_TX_PRIO prio);
+void comm_can_get_stats(can_stats *stats);
+uint16_t comm_can_get_rx_rate(uint8_t cmd);
+uint16_t comm_can_get_tx_rate(uint8_t cmd);
+int comm_can_get_peers(can_peer *peers_out);
 can_status_msg *comm_can_get_status_msg_index(int index);
 can_status_msg *comm_can_get_status_msg_id(int id);
 
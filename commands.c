@@ -36,6 +36,8 @@
 #include "app.h"
 #include "timeout.h"
 #include "servo_dec.h"
+#include "comm_can.h"
+#include "timesync.h"
 
 #include <math.h>
 #include <string.h>
@@ -49,13 +51,27 @@ static Thread *detect_tp;
 
 // Private variables
 static uint8_t send_buffer[256];
+static uint8_t detect_send_buffer[32];
+static Mutex process_mtx;
 static float detect_cycle_int_limit;
 static float detect_coupling_k;
 static float detect_current;
 static float detect_min_rpm;
 static float detect_low_duty;
+static float detect_res;
+static float detect_ind;
+static float detect_flux_linkage;
+static float detect_cc_gain;
+static float autotune_rpm;
+static float autotune_rpm_dev;
+static float autotune_duty_amp;
+static float autotune_current_max;
 static void(*send_func)(unsigned char *data, unsigned char len) = 0;
 
+// Private functions
+static void send_motor_id(detect_stage stage);
+static void process_packet(unsigned char *data, unsigned char len);
+
 static void send_packet(unsigned char *data, unsigned char len) {
 	if (send_func) {
 		send_func(data, len);
@@ -63,6 +79,7 @@ static void send_packet(unsigned char *data, unsigned char len) {
 }
 
 void commands_init(void) {
+	chMtxInit(&process_mtx);
 	chThdCreateStatic(detect_thread_wa, sizeof(detect_thread_wa), NORMALPRIO, detect_thread, NULL);
 }
 
@@ -73,11 +90,27 @@ void commands_init(void) {
  * A pointer to the packet sending function.
  */
 void commands_set_send_func(void(*func)(unsigned char *data, unsigned char len)) {
+	chMtxLock(&process_mtx);
 	send_func = func;
+	chMtxUnlock();
 }
 
 /**
- * Process a received buffer with commands and data.
+ * Send a packet using the last provided send function.
+ *
+ * @param data
+ * The packet data.
+ *
+ * @param len
+ * The data length.
+ */
+void commands_send_packet(unsigned char *data, unsigned char len) {
+	send_packet(data, len);
+}
+
+/**
+ * Process a received buffer with commands and data. Packets from different
+ * threads are processed one at a time.
  *
  * @param data
  * The buffer to process.
@@ -86,6 +119,36 @@ void commands_set_send_func(void(*func)(unsigned char *data, unsigned char len))
  * The length of the buffer.
  */
 void commands_process_packet(unsigned char *data, unsigned char len) {
+	chMtxLock(&process_mtx);
+	process_packet(data, len);
+	chMtxUnlock();
+}
+
+/**
+ * Process a received buffer and send the replies with the provided function.
+ * The previous send function is restored afterwards, so that printouts and
+ * other packets that are sent later still go to the last host.
+ *
+ * @param data
+ * The buffer to process.
+ *
+ * @param len
+ * The length of the buffer.
+ *
+ * @param reply_func
+ * The function to send the replies with.
+ */
+void commands_process_packet_reply(unsigned char *data, unsigned char len,
+		void(*reply_func)(unsigned char *data, unsigned char len)) {
+	chMtxLock(&process_mtx);
+	void(*send_func_old)(unsigned char *data, unsigned char len) = send_func;
+	send_func = reply_func;
+	process_packet(data, len);
+	send_func = send_func_old;
+	chMtxUnlock();
+}
+
+static void process_packet(unsigned char *data, unsigned char len) {
 	if (!len) {
 		return;
 	}
@@ -97,10 +160,18 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 	bool at_start;
 	mc_configuration mcconf;
 	app_configuration appconf;
+	can_stats can_st;
+	servodec_stats ppm_st;
 
   uint8_t servo, speed;
   int16_t position;
   uint16_t time_ms;
+	unsigned char traj_servos[SERVOS_NUM];
+	servo_pos_t traj_pos[SERVOS_NUM];
+	unsigned short traj_num;
+	SERVO_TRAJ traj_type;
+	float traj_vel, traj_acc;
+	float offset0, offset1;
 
 	(void)len;
 
@@ -131,6 +202,13 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		buffer_append_int32(send_buffer, mcpwm_get_tachometer_value(false), &ind);
 		buffer_append_int32(send_buffer, mcpwm_get_tachometer_abs_value(false), &ind);
 		send_buffer[ind++] = mcpwm_get_fault();
+		buffer_append_uint32(send_buffer, timesync_get_us(), &ind);
+		mcpwm_get_current_offsets(&offset0, &offset1);
+		buffer_append_int32(send_buffer, (int32_t)(offset0 * 100.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(offset1 * 100.0), &ind);
+		mcpwm_get_current_offset_drift(&offset0, &offset1);
+		buffer_append_int32(send_buffer, (int32_t)(offset0 * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(offset1 * 1000.0), &ind);
 		send_packet(send_buffer, ind);
 		break;
 
@@ -187,6 +265,29 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
     servo_reset_pos(data[0]);
     break;
 
+	case COMM_SERVO_MOVE_TRAJ:
+		ind = 0;
+		traj_type = data[ind++];
+		time_ms = buffer_get_uint16(data, &ind);
+
+		traj_num = 0;
+		while ((ind + 3) <= len && traj_num < SERVOS_NUM) {
+			traj_servos[traj_num] = data[ind++];
+			traj_pos[traj_num] = buffer_get_uint16(data, &ind);
+			traj_num++;
+		}
+
+		servo_move_traj_multiple(traj_type, time_ms, traj_num, traj_servos, traj_pos);
+		break;
+
+	case COMM_SERVO_SET_LIMITS:
+		ind = 0;
+		servo = data[ind++];
+		traj_vel = (float)buffer_get_int32(data, &ind);
+		traj_acc = (float)buffer_get_int32(data, &ind);
+		servo_set_limits(servo, traj_vel, traj_acc);
+		break;
+
 	case COMM_SET_MCCONF:
 		mcconf = *mcpwm_get_configuration();
 
@@ -199,6 +300,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		mcconf.l_in_current_max = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.l_in_current_min = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.l_abs_current_max = (float)buffer_get_int32(data, &ind) / 1000.0;
+		mcconf.l_abs_current_max_hw = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.l_min_erpm = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.l_max_erpm = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.l_max_erpm_fbrake = (float)buffer_get_int32(data, &ind) / 1000.0;
@@ -225,6 +327,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		mcconf.sl_phase_advance_at_br = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.sl_cycle_int_rpm_br = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.sl_bemf_coupling_k = (float)buffer_get_int32(data, &ind) / 1000.0;
+		mcconf.sl_zc_advance = (float)buffer_get_int32(data, &ind) / 1000.0;
 
 		mcconf.hall_dir = data[ind++];
 		mcconf.hall_fwd_add = data[ind++];
@@ -238,6 +341,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		mcconf.cc_startup_boost_duty = (float)buffer_get_int32(data, &ind) / 1000000.0;
 		mcconf.cc_min_current = (float)buffer_get_int32(data, &ind) / 1000.0;
 		mcconf.cc_gain = (float)buffer_get_int32(data, &ind) / 1000000.0;
+		mcconf.cc_kp = (float)buffer_get_int32(data, &ind) / 1000000.0;
 
 		mcconf.m_fault_stop_time_ms = buffer_get_int32(data, &ind);
 
@@ -259,6 +363,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_in_current_max * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_in_current_min * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_abs_current_max * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_abs_current_max_hw * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_min_erpm * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_max_erpm * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.l_max_erpm_fbrake * 1000.0), &ind);
@@ -280,6 +385,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.sl_phase_advance_at_br * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.sl_cycle_int_rpm_br * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.sl_bemf_coupling_k * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(mcconf.sl_zc_advance * 1000.0), &ind);
 
 		send_buffer[ind++] = mcconf.hall_dir;
 		send_buffer[ind++] = mcconf.hall_fwd_add;
@@ -293,6 +399,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.cc_startup_boost_duty * 1000000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.cc_min_current * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(mcconf.cc_gain * 1000000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(mcconf.cc_kp * 1000000.0), &ind);
 
 		buffer_append_int32(send_buffer, mcconf.m_fault_stop_time_ms, &ind);
 
@@ -307,14 +414,26 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		appconf.timeout_msec = buffer_get_uint32(data, &ind);
 		appconf.timeout_brake_current = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.send_can_status = data[ind++];
+		appconf.can_baud = data[ind++];
+		appconf.can_status_rate_1 = buffer_get_uint16(data, &ind);
+		appconf.can_status_rate_2 = buffer_get_uint16(data, &ind);
+		appconf.can_status_rate_3 = buffer_get_uint16(data, &ind);
+		appconf.can_status_rate_4 = buffer_get_uint16(data, &ind);
 
 		appconf.app_to_use = data[ind++];
 
 		appconf.app_ppm_conf.ctrl_type = data[ind++];
+		appconf.app_ppm_conf.input_type = data[ind++];
+		appconf.app_ppm_conf.channel = data[ind++];
 		appconf.app_ppm_conf.pid_max_erpm = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_ppm_conf.hyst = (float)buffer_get_int32(data, &ind) / 1000.0;
+		appconf.app_ppm_conf.expo = (float)buffer_get_int32(data, &ind) / 1000.0;
+		appconf.app_ppm_conf.ramp_time_pos = (float)buffer_get_int32(data, &ind) / 1000.0;
+		appconf.app_ppm_conf.ramp_time_neg = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_ppm_conf.pulse_start = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_ppm_conf.pulse_width = (float)buffer_get_int32(data, &ind) / 1000.0;
+		appconf.app_ppm_conf.median_filter_len = data[ind++];
+		appconf.app_ppm_conf.max_pulse_step = buffer_get_uint16(data, &ind);
 		appconf.app_ppm_conf.rpm_lim_start = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_ppm_conf.rpm_lim_end = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_ppm_conf.multi_esc = data[ind++];
@@ -325,6 +444,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 
 		appconf.app_chuk_conf.ctrl_type = data[ind++];
 		appconf.app_chuk_conf.hyst = (float)buffer_get_int32(data, &ind) / 1000.0;
+		appconf.app_chuk_conf.expo = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_chuk_conf.rpm_lim_start = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_chuk_conf.rpm_lim_end = (float)buffer_get_int32(data, &ind) / 1000.0;
 		appconf.app_chuk_conf.ramp_time_pos = (float)buffer_get_int32(data, &ind) / 1000.0;
@@ -336,6 +456,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		conf_general_store_app_configuration(&appconf);
 		app_set_configuration(&appconf);
 		timeout_configure(appconf.timeout_msec, appconf.timeout_brake_current);
+		comm_can_set_baud(appconf.can_baud);
 		break;
 
 	case COMM_GET_APPCONF:
@@ -347,14 +468,26 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		buffer_append_uint32(send_buffer, appconf.timeout_msec, &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.timeout_brake_current * 1000.0), &ind);
 		send_buffer[ind++] = appconf.send_can_status;
+		send_buffer[ind++] = appconf.can_baud;
+		buffer_append_uint16(send_buffer, appconf.can_status_rate_1, &ind);
+		buffer_append_uint16(send_buffer, appconf.can_status_rate_2, &ind);
+		buffer_append_uint16(send_buffer, appconf.can_status_rate_3, &ind);
+		buffer_append_uint16(send_buffer, appconf.can_status_rate_4, &ind);
 
 		send_buffer[ind++] = appconf.app_to_use;
 
 		send_buffer[ind++] = appconf.app_ppm_conf.ctrl_type;
+		send_buffer[ind++] = appconf.app_ppm_conf.input_type;
+		send_buffer[ind++] = appconf.app_ppm_conf.channel;
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.pid_max_erpm * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.hyst * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.expo * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.ramp_time_pos * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.ramp_time_neg * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.pulse_start * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.pulse_width * 1000.0), &ind);
+		send_buffer[ind++] = appconf.app_ppm_conf.median_filter_len;
+		buffer_append_uint16(send_buffer, appconf.app_ppm_conf.max_pulse_step, &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.rpm_lim_start * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_ppm_conf.rpm_lim_end * 1000.0), &ind);
 		send_buffer[ind++] = appconf.app_ppm_conf.multi_esc;
@@ -365,6 +498,7 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 
 		send_buffer[ind++] = appconf.app_chuk_conf.ctrl_type;
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_chuk_conf.hyst * 1000.0), &ind);
+		buffer_append_int32(send_buffer, (int32_t)(appconf.app_chuk_conf.expo * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_chuk_conf.rpm_lim_start * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_chuk_conf.rpm_lim_end * 1000.0), &ind);
 		buffer_append_int32(send_buffer, (int32_t)(appconf.app_chuk_conf.ramp_time_pos * 1000.0), &ind);
@@ -398,6 +532,25 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		chEvtSignal(detect_tp, (eventmask_t) 1);
 		break;
 
+	case COMM_DETECT_MOTOR_ID:
+		ind = 0;
+		detect_current = (float)buffer_get_int32(data, &ind) / 1000.0;
+		detect_min_rpm = (float)buffer_get_int32(data, &ind) / 1000.0;
+		detect_low_duty = (float)buffer_get_int32(data, &ind) / 1000.0;
+
+		chEvtSignal(detect_tp, (eventmask_t) 2);
+		break;
+
+	case COMM_AUTOTUNE_SPEED_PID:
+		ind = 0;
+		autotune_rpm = (float)buffer_get_int32(data, &ind);
+		autotune_rpm_dev = (float)buffer_get_int32(data, &ind);
+		autotune_duty_amp = (float)buffer_get_int32(data, &ind) / 100000.0;
+		autotune_current_max = (float)buffer_get_int32(data, &ind) / 1000.0;
+
+		chEvtSignal(detect_tp, (eventmask_t) 4);
+		break;
+
 	case COMM_REBOOT:
 		// Lock the system and enter an infinite loop. The watchdog will reboot.
 		__disable_irq();
@@ -411,8 +564,32 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 	case COMM_GET_DECODED_PPM:
 		ind = 0;
 		send_buffer[ind++] = COMM_GET_DECODED_PPM;
-		buffer_append_int32(send_buffer, (int32_t)(servodec_get_servo(0) * 1000000.0), &ind);
+		buffer_append_int32(send_buffer,
+				(int32_t)(servodec_get_servo(app_get_configuration()->app_ppm_conf.channel) * 1000000.0), &ind);
+		send_buffer[ind++] = servodec_get_channels();
+		for (int i = 0;i < servodec_get_channels();i++) {
+			buffer_append_uint16(send_buffer, servodec_get_servo_us(i), &ind);
+		}
+		send_packet(send_buffer, ind);
+		break;
+
+	case COMM_GET_PPM_STATS:
+		servodec_get_stats(&ppm_st);
+		ind = 0;
+		send_buffer[ind++] = COMM_GET_PPM_STATS;
+		buffer_append_uint32(send_buffer, ppm_st.frames, &ind);
+		buffer_append_uint32(send_buffer, ppm_st.invalid, &ind);
+		buffer_append_uint32(send_buffer, ppm_st.rejected, &ind);
+		buffer_append_uint32(send_buffer, ppm_st.dropped, &ind);
+		buffer_append_uint16(send_buffer, ppm_st.rate, &ind);
+		buffer_append_uint32(send_buffer, ppm_st.period_min, &ind);
+		buffer_append_uint32(send_buffer, ppm_st.period_max, &ind);
 		send_packet(send_buffer, ind);
+
+		// A non-zero argument resets the statistics after they have been sent
+		if (len > 0 && data[0]) {
+			servodec_reset_stats();
+		}
 		break;
 
 	case COMM_GET_DECODED_CHUK:
@@ -422,6 +599,43 @@ void commands_process_packet(unsigned char *data, unsigned char len) {
 		send_packet(send_buffer, ind);
 		break;
 
+	case COMM_GET_CAN_STATS:
+		comm_can_get_stats(&can_st);
+
+		ind = 0;
+		send_buffer[ind++] = COMM_GET_CAN_STATS;
+		buffer_append_uint32(send_buffer, can_st.rx_frames, &ind);
+		buffer_append_uint32(send_buffer, can_st.tx_frames, &ind);
+		buffer_append_uint16(send_buffer, can_st.rx_rate, &ind);
+		buffer_append_uint16(send_buffer, can_st.tx_rate, &ind);
+		buffer_append_uint32(send_buffer, can_st.tx_mailbox_full, &ind);
+		for (int i = 0;i < CAN_TX_PRIO_NUM;i++) {
+			buffer_append_uint32(send_buffer, can_st.tx_drops[i], &ind);
+		}
+		buffer_append_uint32(send_buffer, can_st.rx_overflows, &ind);
+		buffer_append_uint32(send_buffer, can_st.framing_errors, &ind);
+		buffer_append_uint32(send_buffer, can_st.bus_off, &ind);
+		buffer_append_uint32(send_buffer, can_st.bus_off_recoveries, &ind);
+		send_buffer[ind++] = can_st.tec;
+		send_buffer[ind++] = can_st.rec;
+		for (int i = 0;i < 4;i++) {
+			send_buffer[ind++] = can_st.status_age[i];
+		}
+		for (int i = 0;i < CAN_STATS_CMDS;i++) {
+			buffer_append_uint16(send_buffer, comm_can_get_rx_rate(i), &ind);
+			buffer_append_uint16(send_buffer, comm_can_get_tx_rate(i), &ind);
+		}
+		send_packet(send_buffer, ind);
+		break;
+
+	case COMM_FORWARD_CAN:
+		// The reply from the target comes back over CAN and is sent with the
+		// current send function.
+		if (len > 1) {
+			comm_can_send_buffer(data[0], data + 1, len - 1, false);
+		}
+		break;
+
 	default:
 		break;
 	}
@@ -455,6 +669,26 @@ void commands_send_samples(uint8_t *data, int len) {
 	send_packet(buffer, index);
 }
 
+/**
+ * Send the synchronized time of the first and the last sample of a capture.
+ *
+ * @param start_us
+ * The time of the first sample in microseconds.
+ *
+ * @param end_us
+ * The time of the last sample in microseconds.
+ */
+void commands_send_sample_time(uint32_t start_us, uint32_t end_us) {
+	uint8_t buffer[9];
+	int32_t index = 0;
+
+	buffer[index++] = COMM_SAMPLE_TIME;
+	buffer_append_uint32(buffer, start_us, &index);
+	buffer_append_uint32(buffer, end_us, &index);
+
+	send_packet(buffer, index);
+}
+
 void commands_send_rotor_pos(float rotor_pos) {
 	uint8_t buffer[5];
 	int32_t index = 0;
@@ -482,6 +716,23 @@ void commands_send_experiment_samples(float *samples, int len) {
 	send_packet(buffer, index);
 }
 
+/*
+ * Send the motor identification results that are available so far. The
+ * values of stages that have not finished yet are 0.
+ */
+static void send_motor_id(detect_stage stage) {
+	int32_t ind = 0;
+	detect_send_buffer[ind++] = COMM_DETECT_MOTOR_ID;
+	detect_send_buffer[ind++] = stage;
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_res * 1000000.0), &ind);
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_ind * 1000000000.0), &ind);
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_flux_linkage * 1000000.0), &ind);
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_cycle_int_limit * 1000.0), &ind);
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_coupling_k * 1000.0), &ind);
+	buffer_append_int32(detect_send_buffer, (int32_t)(detect_cc_gain * 1000000.0), &ind);
+	send_packet(detect_send_buffer, ind);
+}
+
 static msg_t detect_thread(void *arg) {
 	(void)arg;
 
@@ -490,19 +741,67 @@ static msg_t detect_thread(void *arg) {
 	detect_tp = chThdSelf();
 
 	for(;;) {
-		chEvtWaitAny((eventmask_t) 1);
+		eventmask_t evt = chEvtWaitAny((eventmask_t) 7);
+
+		if (evt & (eventmask_t) 1) {
+			if (!conf_general_detect_motor_param(detect_current, detect_min_rpm,
+					detect_low_duty, 0.0, &detect_cycle_int_limit, &detect_coupling_k, 0)) {
+				detect_cycle_int_limit = 0.0;
+				detect_coupling_k = 0.0;
+			}
+
+			int32_t ind = 0;
+			detect_send_buffer[ind++] = COMM_DETECT_MOTOR_PARAM;
+			buffer_append_int32(detect_send_buffer, (int32_t)(detect_cycle_int_limit * 1000.0), &ind);
+			buffer_append_int32(detect_send_buffer, (int32_t)(detect_coupling_k * 1000.0), &ind);
+			send_packet(detect_send_buffer, ind);
+		}
 
-		if (!conf_general_detect_motor_param(detect_current, detect_min_rpm,
-				detect_low_duty, &detect_cycle_int_limit, &detect_coupling_k)) {
+		if (evt & (eventmask_t) 2) {
+			// Identify the motor and report each stage as it starts, so that
+			// the progress can be followed.
+			detect_res = 0.0;
+			detect_ind = 0.0;
+			detect_flux_linkage = 0.0;
 			detect_cycle_int_limit = 0.0;
 			detect_coupling_k = 0.0;
+			detect_cc_gain = 0.0;
+
+			send_motor_id(DETECT_STAGE_RESISTANCE);
+			bool ok = conf_general_measure_resistance(detect_current, &detect_res);
+
+			if (ok) {
+				send_motor_id(DETECT_STAGE_INDUCTANCE);
+				ok = conf_general_measure_inductance(detect_res, &detect_ind);
+			}
+
+			if (ok) {
+				detect_cc_gain = conf_general_calc_cc_gain(detect_res, detect_ind);
+				send_motor_id(DETECT_STAGE_FLUX_LINKAGE);
+				ok = conf_general_detect_motor_param(detect_current, detect_min_rpm,
+						detect_low_duty, detect_res, &detect_cycle_int_limit, &detect_coupling_k,
+						&detect_flux_linkage);
+			}
+
+			send_motor_id(ok ? DETECT_STAGE_DONE : DETECT_STAGE_FAILED);
 		}
 
-		int32_t ind = 0;
-		send_buffer[ind++] = COMM_DETECT_MOTOR_PARAM;
-		buffer_append_int32(send_buffer, (int32_t)(detect_cycle_int_limit * 1000.0), &ind);
-		buffer_append_int32(send_buffer, (int32_t)(detect_coupling_k * 1000.0), &ind);
-		send_packet(send_buffer, ind);
+		if (evt & (eventmask_t) 4) {
+			float kp = 0.0, ki = 0.0, kd = 0.0, ku = 0.0, tu = 0.0;
+			bool ok = conf_general_autotune_speed_pid(autotune_rpm, autotune_rpm_dev,
+					autotune_duty_amp, autotune_current_max, &kp, &ki, &kd, &ku, &tu);
+
+			// The gains have the same scaling as in COMM_SET_MCCONF
+			int32_t ind = 0;
+			detect_send_buffer[ind++] = COMM_AUTOTUNE_SPEED_PID;
+			detect_send_buffer[ind++] = ok;
+			buffer_append_int32(detect_send_buffer, (int32_t)(kp * 1000000.0), &ind);
+			buffer_append_int32(detect_send_buffer, (int32_t)(ki * 1000000.0), &ind);
+			buffer_append_int32(detect_send_buffer, (int32_t)(kd * 1000000.0), &ind);
+			buffer_append_int32(detect_send_buffer, (int32_t)(ku * 1000000.0), &ind);
+			buffer_append_int32(detect_send_buffer, (int32_t)(tu * 1000000.0), &ind);
+			send_packet(detect_send_buffer, ind);
+		}
 	}
 
 	return 0;
@@ -31,8 +31,12 @@
 void commands_init(void);
 void commands_set_send_func(void(*func)(unsigned char *data, unsigned char len));
 void commands_process_packet(unsigned char *data, unsigned char len);
+void commands_process_packet_reply(unsigned char *data, unsigned char len,
+		void(*reply_func)(unsigned char *data, unsigned char len));
+void commands_send_packet(unsigned char *data, unsigned char len);
 void commands_printf(char* format, ...);
 void commands_send_samples(uint8_t *data, int len);
+void commands_send_sample_time(uint32_t start_us, uint32_t end_us);
 void commands_send_rotor_pos(float rotor_pos);
 void commands_send_experiment_samples(float *samples, int len);
 
@@ -13,6 +13,7 @@
 #include "utils.h"
 
 #include <string.h>
+#include <math.h>
 
 // Default configuration file
 #ifdef MCCONF_OUTRUNNER1
@@ -35,7 +36,34 @@
 #include "mcconf_hdd.h"
 #endif
 
+// Motor parameter measurement
+#define MEASURE_RES_DUTY_STEP			0.0002	// Duty cycle increase per msec while ramping up the current
+#define MEASURE_RES_DUTY_MAX			0.5		// Give up the resistance measurement above this duty cycle
+#define MEASURE_RES_SETTLE_TIME			50		// Time in msec to let the current settle before averaging
+#define MEASURE_RES_AVG_TIME			200		// Time in msec to average the resistance measurement current
+#define MEASURE_IND_AVG_TIME			500		// Time in msec to average the inductance measurement pulses
+
+// Motor parameter calculation
+#define CC_GAIN_VOLTAGE					20.0	// Input voltage cc_gain is normalized to, see voltage_scale in mcpwm.c
+#define CC_GAIN_STEP_RATE				1000.0	// Current controller steps per second cc_gain is given for
+
+// Speed PID autotuning
+#define AUTOTUNE_BIAS_TIME				1000	// Time in msec to settle at each duty cycle while finding the relay bias
+#define AUTOTUNE_TIMEOUT				10000	// Give up the relay experiment after this time in msec
+#define AUTOTUNE_CYCLES_SKIP			2		// Relay cycles to skip before measuring
+#define AUTOTUNE_CYCLES					6		// Relay cycles to measure
+#define AUTOTUNE_HYST_RPM				20.0	// Relay hysteresis in ERPM against speed noise
+
 // Parameters that can be overridden
+#ifndef MCPWM_ZC_ADVANCE
+#define MCPWM_ZC_ADVANCE				0.0		// Commutation advance in electrical degrees for COMM_MODE_ZERO_CROSSING
+#endif
+#ifndef MCPWM_CURRENT_CONTROL_KP
+#define MCPWM_CURRENT_CONTROL_KP		0.02	// Current controller proportional gain, scaled to 1 kHz like the error gain
+#endif
+#ifndef MCPWM_MAX_ABS_CURRENT_HW
+#define MCPWM_MAX_ABS_CURRENT_HW		(MCPWM_MAX_ABS_CURRENT * 1.2) // Phase current at which the hardware trips. 0 to disable
+#endif
 #ifndef MCPWM_PWM_MODE
 #define MCPWM_PWM_MODE					PWM_MODE_SYNCHRONOUS // Default PWM mode
 #endif
@@ -115,7 +143,7 @@ void conf_general_init(void) {
 	memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
 
 	int ind = 0;
-	for (unsigned int i = 0;i < (sizeof(app_configuration) / 2);i++) {
+	for (unsigned int i = 0;i < (sizeof(mc_configuration) / 2);i++) {
 		VirtAddVarTab[ind++] = EEPROM_BASE_MCCONF + i;
 	}
 
@@ -157,14 +185,26 @@ void conf_general_read_app_configuration(app_configuration *conf) {
 		conf->timeout_msec = 1000;
 		conf->timeout_brake_current = 0.0;
 		conf->send_can_status = true;
+		conf->can_baud = CAN_BAUD_500K;
+		conf->can_status_rate_1 = 1000;
+		conf->can_status_rate_2 = 10;
+		conf->can_status_rate_3 = 50;
+		conf->can_status_rate_4 = 10;
 
 		conf->app_to_use = APP_NONE;
 
 		conf->app_ppm_conf.ctrl_type = PPM_CTRL_TYPE_CURRENT;
+		conf->app_ppm_conf.input_type = PPM_INPUT_PWM;
+		conf->app_ppm_conf.channel = 0;
 		conf->app_ppm_conf.pid_max_erpm = 15000;
 		conf->app_ppm_conf.hyst = 0.15;
+		conf->app_ppm_conf.expo = 0.0;
+		conf->app_ppm_conf.ramp_time_pos = 0.0;
+		conf->app_ppm_conf.ramp_time_neg = 0.0;
 		conf->app_ppm_conf.pulse_start = 1.0;
 		conf->app_ppm_conf.pulse_width = 1.0;
+		conf->app_ppm_conf.median_filter_len = 1;
+		conf->app_ppm_conf.max_pulse_step = 0;
 		conf->app_ppm_conf.rpm_lim_start = 150000.0;
 		conf->app_ppm_conf.rpm_lim_end = 200000.0;
 		conf->app_ppm_conf.multi_esc = true;
@@ -175,6 +215,7 @@ void conf_general_read_app_configuration(app_configuration *conf) {
 
 		conf->app_chuk_conf.ctrl_type = CHUK_CTRL_TYPE_CURRENT;
 		conf->app_chuk_conf.hyst = 0.15;
+		conf->app_chuk_conf.expo = 0.0;
 		conf->app_chuk_conf.rpm_lim_start = 150000.0;
 		conf->app_chuk_conf.rpm_lim_end = 250000.0;
 		conf->app_chuk_conf.ramp_time_pos = 0.5;
@@ -250,6 +291,7 @@ void conf_general_read_mc_configuration(mc_configuration *conf) {
 		conf->l_in_current_max = MCPWM_IN_CURRENT_MAX;
 		conf->l_in_current_min = MCPWM_IN_CURRENT_MIN;
 		conf->l_abs_current_max = MCPWM_MAX_ABS_CURRENT;
+		conf->l_abs_current_max_hw = MCPWM_MAX_ABS_CURRENT_HW;
 		conf->l_min_erpm = MCPWM_RPM_MIN;
 		conf->l_max_erpm = MCPWM_RPM_MAX;
 		conf->l_max_erpm_fbrake = MCPWM_CURR_MAX_RPM_FBRAKE;
@@ -276,6 +318,7 @@ void conf_general_read_mc_configuration(mc_configuration *conf) {
 		conf->sl_phase_advance_at_br = MCPWM_CYCLE_INT_LIMIT_HIGH_FAC;
 		conf->sl_cycle_int_rpm_br = MCPWM_CYCLE_INT_START_RPM_BR;
 		conf->sl_bemf_coupling_k = MCPWM_BEMF_INPUT_COUPLING_K;
+		conf->sl_zc_advance = MCPWM_ZC_ADVANCE;
 
 		conf->hall_dir = MCPWM_HALL_DIR;
 		conf->hall_fwd_add = MCPWM_HALL_FWD_ADD;
@@ -289,6 +332,7 @@ void conf_general_read_mc_configuration(mc_configuration *conf) {
 		conf->cc_startup_boost_duty = MCPWM_CURRENT_STARTUP_BOOST;
 		conf->cc_min_current = MCPWM_CURRENT_CONTROL_MIN;
 		conf->cc_gain = MCPWM_CURRENT_CONTROL_GAIN;
+		conf->cc_kp = MCPWM_CURRENT_CONTROL_KP;
 
 		conf->m_fault_stop_time_ms = MCPWM_FAULT_STOP_TIME;
 	}
@@ -329,8 +373,39 @@ bool conf_general_store_mc_configuration(mc_configuration *conf) {
 	return is_ok;
 }
 
+/**
+ * Spin up the motor in COMM_MODE_DELAY and measure the flux integrator limit
+ * and the input voltage coupling factor.
+ *
+ * @param current
+ * The current to spin up the motor with.
+ *
+ * @param min_rpm
+ * The minimum ERPM for the delay commutation.
+ *
+ * @param low_duty
+ * The duty cycle to run the motor at while measuring the coupling factor.
+ *
+ * @param res
+ * The phase resistance in ohm, used to correct the flux linkage measurement
+ * for the resistive voltage drop. Not used when flux_linkage is null.
+ *
+ * @param int_limit
+ * Pointer to store the flux integrator limit.
+ *
+ * @param bemf_coupling_k
+ * Pointer to store the coupling factor.
+ *
+ * @param flux_linkage
+ * If not null, the flux linkage is measured from the back-emf while the motor
+ * runs at zero set current and stored here. int_limit is then derived from it instead of being
+ * averaged, and the coupling factor is computed relative to that.
+ *
+ * @return
+ * True if all steps of the detection succeeded.
+ */
 bool conf_general_detect_motor_param(float current, float min_rpm, float low_duty,
-		float *int_limit, float *bemf_coupling_k) {
+		float res, float *int_limit, float *bemf_coupling_k, float *flux_linkage) {
 
 	int ok_steps = 0;
 
@@ -366,11 +441,19 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 		}
 	}
 
-	// Average the cycle integrator for 50 commutations
+	// Average the cycle integrator for 50 commutations. The motor is still
+	// driven in delay mode, but at zero set current, so the output voltage
+	// follows the line to line back-emf amplitude. The drop over the two
+	// phases in series from the remaining current is subtracted.
 	mcpwm_read_reset_avg_cycle_integrator();
 	tacho = mcpwm_get_tachometer_value(0);
+	float bemf_sum = 0.0;
+	float bemf_rpm_sum = 0.0;
 	for (int i = 0;i < 3000;i++) {
 		if ((mcpwm_get_tachometer_value(0) - tacho) < 50) {
+			bemf_sum += fabsf(mcpwm_get_duty_cycle_now()) * GET_INPUT_VOLTAGE() -
+					mcpwm_get_tot_current() * 2.0 * res;
+			bemf_rpm_sum += fabsf(mcpwm_get_rpm());
 			chThdSleepMilliseconds(1);
 		} else {
 			ok_steps++;
@@ -380,6 +463,18 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 
 	*int_limit = mcpwm_read_reset_avg_cycle_integrator();
 
+	if (flux_linkage) {
+		// With trapezoidal back-emf the line to line amplitude is twice the
+		// phase amplitude.
+		if (bemf_rpm_sum > 0.0) {
+			*flux_linkage = (bemf_sum / 2.0) / ((bemf_rpm_sum * 2.0 * M_PI) / 60.0);
+		} else {
+			*flux_linkage = 0.0;
+		}
+
+		*int_limit = conf_general_calc_cycle_int_limit(*flux_linkage);
+	}
+
 	// Wait for the motor to slow down
 	for (int i = 0;i < 5000;i++) {
 		if (mcpwm_get_duty_cycle_now() > low_duty) {
@@ -423,3 +518,303 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 
 	return ok_steps == 5 ? true : false;
 }
+
+/**
+ * Measure the phase resistance by holding one commutation step with DC. The
+ * voltage is ramped until the current reaches half and then the full
+ * measurement current. Using the slope between those points cancels the
+ * dead time and MOSFET voltage drops.
+ *
+ * @param current
+ * The measurement current in amperes.
+ *
+ * @param res
+ * Pointer to store the phase resistance in ohm.
+ *
+ * @return
+ * True if the current could be reached.
+ */
+bool conf_general_measure_resistance(float current, float *res) {
+	float duty = MCPWM_MIN_DUTY_CYCLE;
+	float volt[2];
+	float curr[2];
+	bool ok = true;
+
+	mcpwm_set_detect_dc(duty);
+
+	for (int i = 0;i < 2 && ok;i++) {
+		const float target = i == 0 ? current / 2.0 : current;
+
+		// Ramp up the duty cycle until the current is reached
+		mcpwm_read_reset_detect_dc_current();
+		for (;;) {
+			chThdSleepMilliseconds(1);
+
+			if (mcpwm_get_state() != MC_STATE_DETECTING) {
+				ok = false;
+				break;
+			}
+
+			if (mcpwm_read_reset_detect_dc_current() >= target) {
+				break;
+			}
+
+			duty += MEASURE_RES_DUTY_STEP;
+			if (duty > MEASURE_RES_DUTY_MAX) {
+				ok = false;
+				break;
+			}
+
+			mcpwm_set_detect_dc(duty);
+		}
+
+		// Let the current settle and average it
+		chThdSleepMilliseconds(MEASURE_RES_SETTLE_TIME);
+		mcpwm_read_reset_detect_dc_current();
+		chThdSleepMilliseconds(MEASURE_RES_AVG_TIME);
+		curr[i] = mcpwm_read_reset_detect_dc_current();
+		volt[i] = duty * GET_INPUT_VOLTAGE();
+	}
+
+	mcpwm_release_motor();
+
+	if (!ok || (curr[1] - curr[0]) < (current / 10.0)) {
+		return false;
+	}
+
+	// The current flows through two phases
+	*res = ((volt[1] - volt[0]) / (curr[1] - curr[0])) / 2.0;
+
+	return *res > 0.0;
+}
+
+/**
+ * Measure the phase inductance with the detection pulses. Every pulse applies
+ * MCPWM_DETECT_DUTY for one switching period to two phases in series, after
+ * which the current is sampled.
+ *
+ * @param res
+ * The phase resistance in ohm, to correct for the voltage drop during the
+ * pulse. 0 to ignore it.
+ *
+ * @param ind
+ * Pointer to store the phase inductance in henry.
+ *
+ * @return
+ * True if the pulses produced a measurable current.
+ */
+bool conf_general_measure_inductance(float res, float *ind) {
+	// Wait until commands are accepted again after the previous measurement
+	chThdSleepMilliseconds(MCPWM_DETECT_STOP_TIME + 10);
+
+	mcpwm_set_detect();
+	chThdSleepMilliseconds(50);
+	mcpwm_read_reset_detect_current();
+	chThdSleepMilliseconds(MEASURE_IND_AVG_TIME);
+
+	const bool detecting = mcpwm_get_state() == MC_STATE_DETECTING;
+	const float curr = mcpwm_read_reset_detect_current();
+	const float volt = MCPWM_DETECT_DUTY * GET_INPUT_VOLTAGE();
+	const float t_on = MCPWM_DETECT_DUTY / (float)MCPWM_SWITCH_FREQUENCY_MAX;
+
+	mcpwm_release_motor();
+	chThdSleepMilliseconds(MCPWM_DETECT_STOP_TIME + 10);
+
+	if (!detecting || curr < 0.1) {
+		return false;
+	}
+
+	// i = (V / 2R) * (1 - e^(-R * t / L)) for the two phases in series, which
+	// is V * t / 2L when R is small.
+	const float x = 1.0 - (2.0 * res * curr) / volt;
+	if (res > 0.0 && x > 0.0 && x < 1.0) {
+		*ind = -(res * t_on) / logf(x);
+	} else {
+		*ind = (volt * t_on) / (2.0 * curr);
+	}
+
+	return true;
+}
+
+/*
+ * Check that the autotuning experiment stays within its limits.
+ */
+static bool autotune_in_limits(float rpm, float rpm_dev, float current_max) {
+	return fabsf(mcpwm_get_rpm() - rpm) < rpm_dev &&
+			fabsf(mcpwm_get_tot_current_filtered()) < current_max &&
+			mcpwm_get_fault() == FAULT_CODE_NONE;
+}
+
+/**
+ * Tune the speed PID controller with a relay feedback experiment. The duty
+ * cycle that holds the requested speed is found first. Then the duty cycle is
+ * switched by duty_amp above and below it every time the speed crosses the
+ * set point, which makes the speed oscillate at the ultimate period of the
+ * loop. The ultimate gain follows from the oscillation amplitude, and the
+ * gains are calculated with the Ziegler-Nichols rules.
+ *
+ * The motor is released when the speed deviates more than rpm_dev from the
+ * set point or the current exceeds current_max.
+ *
+ * @param rpm
+ * The ERPM to tune at.
+ *
+ * @param rpm_dev
+ * The maximum allowed ERPM deviation from rpm.
+ *
+ * @param duty_amp
+ * The relay amplitude in duty cycle.
+ *
+ * @param current_max
+ * The maximum allowed motor current.
+ *
+ * @param kp
+ * Pointer to store the proportional gain, in the units of s_pid_kp.
+ *
+ * @param ki
+ * Pointer to store the integral gain, in the units of s_pid_ki.
+ *
+ * @param kd
+ * Pointer to store the derivative gain, in the units of s_pid_kd.
+ *
+ * @param ku
+ * Pointer to store the ultimate gain, in the units of s_pid_kp.
+ *
+ * @param tu
+ * Pointer to store the ultimate period in seconds.
+ *
+ * @return
+ * True if the experiment succeeded.
+ */
+bool conf_general_autotune_speed_pid(float rpm, float rpm_dev, float duty_amp,
+		float current_max, float *kp, float *ki, float *kd, float *ku, float *tu) {
+	const float sign = rpm >= 0.0 ? 1.0 : -1.0;
+	bool ok = true;
+
+	// Find the duty cycle that holds the speed. The speed is roughly
+	// proportional to the duty cycle, so start low and scale twice.
+	float bias = 0.1;
+	for (int i = 0;i < 3 && ok;i++) {
+		mcpwm_set_duty(sign * bias);
+		chThdSleepMilliseconds(AUTOTUNE_BIAS_TIME);
+
+		const float rpm_now = fabsf(mcpwm_get_rpm());
+
+		if (i == 2 || mcpwm_get_fault() != FAULT_CODE_NONE ||
+				fabsf(mcpwm_get_tot_current_filtered()) > current_max) {
+			ok = i == 2 && autotune_in_limits(rpm, rpm_dev, current_max);
+		} else if (rpm_now > 10.0) {
+			bias *= fabsf(rpm) / rpm_now;
+			utils_truncate_number(&bias, MCPWM_MIN_DUTY_CYCLE + duty_amp,
+					MCPWM_MAX_DUTY_CYCLE - duty_amp);
+		} else {
+			ok = false;
+		}
+	}
+
+	// Relay experiment
+	int cycles = 0;
+	int relay_up = 1;
+	float rpm_max = -1e10;
+	float rpm_min = 1e10;
+	float amp_sum = 0.0;
+	int last_switch = 0;
+	int period_sum = 0;
+
+	for (int time = 0;ok && cycles < (AUTOTUNE_CYCLES_SKIP + AUTOTUNE_CYCLES);time++) {
+		const float rpm_now = sign * mcpwm_get_rpm();
+
+		if (time >= AUTOTUNE_TIMEOUT || !autotune_in_limits(rpm, rpm_dev, current_max)) {
+			ok = false;
+			break;
+		}
+
+		if (rpm_now > rpm_max) {
+			rpm_max = rpm_now;
+		}
+
+		if (rpm_now < rpm_min) {
+			rpm_min = rpm_now;
+		}
+
+		if (relay_up && rpm_now > (fabsf(rpm) + AUTOTUNE_HYST_RPM)) {
+			relay_up = 0;
+		} else if (!relay_up && rpm_now < (fabsf(rpm) - AUTOTUNE_HYST_RPM)) {
+			// A full cycle ends when the relay switches up again
+			relay_up = 1;
+
+			if (cycles >= AUTOTUNE_CYCLES_SKIP) {
+				amp_sum += (rpm_max - rpm_min) / 2.0;
+				period_sum += time - last_switch;
+			}
+
+			cycles++;
+			last_switch = time;
+			rpm_max = -1e10;
+			rpm_min = 1e10;
+		}
+
+		mcpwm_set_duty(sign * (relay_up ? bias + duty_amp : bias - duty_amp));
+		chThdSleepMilliseconds(1);
+	}
+
+	mcpwm_release_motor();
+
+	if (!ok || amp_sum <= 0.0) {
+		return false;
+	}
+
+	const float amp = amp_sum / (float)AUTOTUNE_CYCLES;
+	*tu = ((float)period_sum / (float)AUTOTUNE_CYCLES) / 1000.0;
+
+	// Describing function of the relay, in duty cycle per ERPM. run_pid_controller
+	// scales the gains with the inverse of the input voltage.
+	*ku = ((4.0 * duty_amp) / (M_PI * amp)) * GET_INPUT_VOLTAGE();
+
+	*kp = 0.6 * *ku;
+	*ki = *kp / (*tu / 2.0);
+	*kd = *kp * (*tu / 8.0);
+
+	return true;
+}
+
+/**
+ * Calculate the flux integrator limit at 0 ERPM from the flux linkage. From the
+ * zero crossing of the floating phase to the commutation the back-emf rises
+ * from 0 to its peak over 30 electrical degrees, so the integral is
+ * flux_linkage * pi / 12 independent of the speed.
+ *
+ * @param flux_linkage
+ * The flux linkage in Wb.
+ *
+ * @return
+ * The cycle integrator limit.
+ */
+float conf_general_calc_cycle_int_limit(float flux_linkage) {
+	const float volt_per_cnt = (V_REG / 4095.0) * ((VIN_R1 + VIN_R2) / VIN_R2);
+	return ((flux_linkage * M_PI) / 12.0) / (volt_per_cnt * MCPWM_CYCLE_INT_SCALE);
+}
+
+/**
+ * Calculate the current controller gain from the motor resistance and
+ * inductance. The duty cycle integrating controller on the R-L load of two
+ * phases in series is critically damped when
+ * (2R)^2 = 4 * 2L * cc_gain * CC_GAIN_VOLTAGE * CC_GAIN_STEP_RATE, where
+ * the last two factors convert cc_gain to volt per ampere second.
+ *
+ * @param res
+ * The phase resistance in ohm.
+ *
+ * @param ind
+ * The phase inductance in henry.
+ *
+ * @return
+ * The current controller gain.
+ */
+float conf_general_calc_cc_gain(float res, float ind) {
+	if (ind <= 0.0) {
+		return 0.0;
+	}
+
+	return (res * res) / (2.0 * ind * CC_GAIN_VOLTAGE * CC_GAIN_STEP_RATE);
+}
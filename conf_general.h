@@ -83,6 +83,15 @@
 #define WS2811_LED_NUM			14
 #define WS2811_USE_CH2			1		// 0: CH1 (PB6) 1: CH2 (PB7)
 
+/*
+ * Store the WS2811 frames as 24-bit colors and encode the bits while streaming
+ * them instead of keeping the encoded bits of two frames in RAM. This uses
+ * 8 bytes per LED instead of 96, but needs an interrupt every
+ * WS2811_STREAM_LEDS LEDs.
+ */
+#define WS2811_COMPACT_BUFFER	0
+#define WS2811_STREAM_LEDS		4
+
 // Functions
 void conf_general_init(void);
 void conf_general_read_app_configuration(app_configuration *conf);
@@ -90,6 +99,12 @@ bool conf_general_store_app_configuration(app_configuration *conf);
 void conf_general_read_mc_configuration(mc_configuration *conf);
 bool conf_general_store_mc_configuration(mc_configuration *conf);
 bool conf_general_detect_motor_param(float current, float min_rpm, float low_duty,
-		float *int_limit, float *bemf_coupling_k);
+		float res, float *int_limit, float *bemf_coupling_k, float *flux_linkage);
+bool conf_general_measure_resistance(float current, float *res);
+bool conf_general_measure_inductance(float res, float *ind);
+float conf_general_calc_cycle_int_limit(float flux_linkage);
+float conf_general_calc_cc_gain(float res, float ind);
+bool conf_general_autotune_speed_pid(float rpm, float rpm_dev, float duty_amp,
+		float current_max, float *kp, float *ki, float *kd, float *ku, float *tu);
 
 #endif /* CONF_GENERAL_H_ */
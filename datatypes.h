@@ -45,9 +45,18 @@ typedef enum {
 
 typedef enum {
 	COMM_MODE_INTEGRATE = 0,
-	COMM_MODE_DELAY
+	COMM_MODE_DELAY,
+	COMM_MODE_ZERO_CROSSING
 } mc_comm_mode;
 
+typedef enum {
+	DETECT_STAGE_RESISTANCE = 0,
+	DETECT_STAGE_INDUCTANCE,
+	DETECT_STAGE_FLUX_LINKAGE,
+	DETECT_STAGE_DONE,
+	DETECT_STAGE_FAILED
+} detect_stage;
+
 typedef enum {
 	FAULT_CODE_NONE = 0,
 	FAULT_CODE_OVER_VOLTAGE,
@@ -86,6 +95,7 @@ typedef struct {
 	float l_in_current_max;
 	float l_in_current_min;
 	float l_abs_current_max;
+	float l_abs_current_max_hw;
 	float l_min_erpm;
 	float l_max_erpm;
 	float l_max_erpm_fbrake;
@@ -112,6 +122,7 @@ typedef struct {
 	float sl_phase_advance_at_br;
 	float sl_cycle_int_rpm_br;
 	float sl_bemf_coupling_k;
+	float sl_zc_advance;
 	// Hall sensor
 	int8_t hall_dir;
 	int8_t hall_fwd_add;
@@ -125,6 +136,7 @@ typedef struct {
 	float cc_startup_boost_duty;
 	float cc_min_current;
 	float cc_gain;
+	float cc_kp;
 	// Misc
 	int32_t m_fault_stop_time_ms;
 } mc_configuration;
@@ -151,12 +163,26 @@ typedef enum {
 	PPM_CTRL_TYPE_PID_NOREV
 } ppm_control_type;
 
+// PPM input signal types
+typedef enum {
+	PPM_INPUT_PWM = 0,
+	PPM_INPUT_PPM_SUM,
+	PPM_INPUT_SBUS
+} ppm_input_type;
+
 typedef struct {
 	ppm_control_type ctrl_type;
+	ppm_input_type input_type;
+	uint8_t channel;
 	float pid_max_erpm;
 	float hyst;
+	float expo;
+	float ramp_time_pos;
+	float ramp_time_neg;
 	float pulse_start;
 	float pulse_width;
+	uint8_t median_filter_len; // Pulses, 1 to disable
+	uint16_t max_pulse_step; // Microseconds, 0 to disable
 	float rpm_lim_start;
 	float rpm_lim_end;
 	bool multi_esc;
@@ -164,6 +190,17 @@ typedef struct {
 	float tc_max_diff;
 } ppm_config;
 
+// Decoded servo signal statistics
+typedef struct {
+	uint32_t frames;
+	uint32_t invalid;
+	uint32_t rejected;
+	uint32_t dropped;
+	uint16_t rate; // Frames per second
+	uint32_t period_min; // Microseconds
+	uint32_t period_max; // Microseconds
+} servodec_stats;
+
 // Nunchuk control types
 typedef enum {
 	CHUK_CTRL_TYPE_NONE = 0,
@@ -174,6 +211,7 @@ typedef enum {
 typedef struct {
 	chuk_control_type ctrl_type;
 	float hyst;
+	float expo;
 	float rpm_lim_start;
 	float rpm_lim_end;
 	float ramp_time_pos;
@@ -183,12 +221,25 @@ typedef struct {
 	float tc_max_diff;
 } chuk_config;
 
+// CAN bit rates
+typedef enum {
+	CAN_BAUD_125K = 0,
+	CAN_BAUD_250K,
+	CAN_BAUD_500K,
+	CAN_BAUD_1M
+} CAN_BAUD;
+
 typedef struct {
 	// Settings
 	uint8_t controller_id;
 	uint32_t timeout_msec;
 	float timeout_brake_current;
 	bool send_can_status;
+	CAN_BAUD can_baud;
+	uint16_t can_status_rate_1; // Hz, rpm, current and duty cycle
+	uint16_t can_status_rate_2; // Hz, amp hours
+	uint16_t can_status_rate_3; // Hz, tachometer, input voltage and fault
+	uint16_t can_status_rate_4; // Hz, temperatures and input current
 
 	// Application to use
 	app_use app_to_use;
@@ -228,18 +279,74 @@ typedef enum {
 	COMM_GET_DECODED_CHUK,
   COMM_SERVO_MOVE,
   COMM_SERVO_MOVE_WITHIN_TIME,
-  COMM_SERVO_RESET_POS
+  COMM_SERVO_RESET_POS,
+	COMM_FORWARD_CAN,
+	COMM_GET_CAN_STATS,
+	COMM_SAMPLE_TIME,
+	COMM_GET_PPM_STATS,
+	COMM_UART_STREAM,
+	COMM_SERVO_MOVE_TRAJ,
+	COMM_SERVO_SET_LIMITS,
+	COMM_DETECT_MOTOR_ID,
+	COMM_AUTOTUNE_SPEED_PID
 } COMM_PACKET_ID;
 
+// Commands in the app_uartcomm setpoint stream frames
+typedef enum {
+	UART_STREAM_CMD_CURRENT = 0,
+	UART_STREAM_CMD_CURRENT_BRAKE,
+	UART_STREAM_CMD_DUTY,
+	UART_STREAM_CMD_RPM,
+	UART_STREAM_CMD_STOP
+} UART_STREAM_CMD;
+
 // CAN commands
 typedef enum {
 	CAN_PACKET_SET_DUTY = 0,
 	CAN_PACKET_SET_CURRENT,
 	CAN_PACKET_SET_CURRENT_BRAKE,
 	CAN_PACKET_SET_RPM,
-	CAN_PACKET_STATUS
+	CAN_PACKET_STATUS,
+	CAN_PACKET_SET_DUTY_GROUP,
+	CAN_PACKET_SET_CURRENT_GROUP,
+	CAN_PACKET_SET_CURRENT_BRAKE_GROUP,
+	CAN_PACKET_BUFFER_START,
+	CAN_PACKET_FILL_RX_BUFFER,
+	CAN_PACKET_FILL_RX_BUFFER_LAST,
+	CAN_PACKET_BUFFER_ACK,
+	CAN_PACKET_PROCESS_SHORT_BUFFER,
+	CAN_PACKET_STATUS_2,
+	CAN_PACKET_STATUS_3,
+	CAN_PACKET_STATUS_4,
+	CAN_PACKET_TIME_SYNC,
+	CAN_PACKET_TIME_FOLLOW_UP
 } CAN_PACKET_ID;
 
+// CAN transmit priorities, highest first
+typedef enum {
+	CAN_TX_PRIO_SETPOINT = 0,
+	CAN_TX_PRIO_STATUS,
+	CAN_TX_PRIO_BULK,
+	CAN_TX_PRIO_NUM
+} CAN_TX_PRIO;
+
+// CAN bus statistics
+typedef struct {
+	uint32_t rx_frames;
+	uint32_t tx_frames;
+	uint16_t rx_rate; // Frames during the last second
+	uint16_t tx_rate;
+	uint32_t tx_mailbox_full;
+	uint32_t tx_drops[CAN_TX_PRIO_NUM];
+	uint32_t rx_overflows;
+	uint32_t framing_errors;
+	uint32_t bus_off;
+	uint32_t bus_off_recoveries;
+	uint8_t tec; // Transmit error counter
+	uint8_t rec; // Receive error counter
+	uint8_t status_age[4]; // Stored status entries younger than 10 ms, 100 ms, 1 s and older
+} can_stats;
+
 // Logged fault data
 typedef struct {
 	mc_fault_code fault;
@@ -278,10 +385,34 @@ typedef struct {
 
 typedef struct {
 	int id;
+	// CAN_PACKET_STATUS
 	systime_t rx_time;
 	float rpm;
 	float current;
 	float duty;
+	// CAN_PACKET_STATUS_2
+	systime_t rx_time_2;
+	float amp_hours;
+	float amp_hours_charged;
+	// CAN_PACKET_STATUS_3
+	systime_t rx_time_3;
+	int tacho;
+	float v_in;
+	mc_fault_code fault;
+	// CAN_PACKET_STATUS_4
+	systime_t rx_time_4;
+	float temp_fet;
+	float temp_pcb;
+	float current_in;
 } can_status_msg;
 
+// A controller that has sent CAN_PACKET_STATUS recently
+typedef struct {
+	uint8_t id;
+	systime_t rx_time;
+	float rpm;
+	float current;
+	float duty;
+} can_peer;
+
 #endif /* DATATYPES_H_ */
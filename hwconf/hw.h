@@ -43,6 +43,36 @@
 #error "No hardware version defined"
 #endif
 
+// EXTI for the DRV8302 nFAULT pin, derived from DRV_FAULT_GPIO and DRV_FAULT_PIN
+#ifdef DRV_FAULT_PIN
+#define DRV_FAULT_EXTI_PORTSRC		((uint8_t)(((uint32_t)DRV_FAULT_GPIO - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE)))
+#define DRV_FAULT_EXTI_PINSRC		((uint8_t)DRV_FAULT_PIN)
+#define DRV_FAULT_EXTI_LINE			((uint32_t)1 << DRV_FAULT_PIN)
+
+#if DRV_FAULT_PIN >= 10
+#define DRV_FAULT_EXTI_CH			EXTI15_10_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI15_10_IRQHandler
+#elif DRV_FAULT_PIN >= 5
+#define DRV_FAULT_EXTI_CH			EXTI9_5_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI9_5_IRQHandler
+#elif DRV_FAULT_PIN == 4
+#define DRV_FAULT_EXTI_CH			EXTI4_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI4_IRQHandler
+#elif DRV_FAULT_PIN == 3
+#define DRV_FAULT_EXTI_CH			EXTI3_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI3_IRQHandler
+#elif DRV_FAULT_PIN == 2
+#define DRV_FAULT_EXTI_CH			EXTI2_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI2_IRQHandler
+#elif DRV_FAULT_PIN == 1
+#define DRV_FAULT_EXTI_CH			EXTI1_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI1_IRQHandler
+#else
+#define DRV_FAULT_EXTI_CH			EXTI0_IRQn
+#define DRV_FAULT_EXTI_ISR			EXTI0_IRQHandler
+#endif
+#endif
+
 // Functions
 void hw_init_gpio(void);
 void hw_setup_adc_channels(void);
@@ -153,11 +153,13 @@ void hw_setup_servo_outputs(void) {
 	// Set up servo structures
 	servos[0].gpio = GPIOB;
 	servos[0].pin = 5;
+	servos[0].tim_ch = 2;
 	servos[0].offset = 0;
-	servos[0].pos = 128;
+	servos[0].pos = SERVO_POS_MAX / 2;
 
 	servos[1].gpio = GPIOB;
 	servos[1].pin = 4;
+	servos[1].tim_ch = 1;
 	servos[1].offset = 0;
 	servos[1].pos = 0;
 }
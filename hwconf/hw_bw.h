@@ -30,7 +30,9 @@
 #define DISABLE_GATE()			palClearPad(GPIOC, 10)
 #define DCCAL_ON()				palSetPad(GPIOB, 12)
 #define DCCAL_OFF()				palClearPad(GPIOB, 12)
-#define IS_DRV_FAULT()			(!palReadPad(GPIOC, 12))
+#define DRV_FAULT_GPIO			GPIOC
+#define DRV_FAULT_PIN			12
+#define IS_DRV_FAULT()			(!palReadPad(DRV_FAULT_GPIO, DRV_FAULT_PIN))
 
 #define LED1_ON()				palSetPad(GPIOC, 4)
 #define LED1_OFF()				palClearPad(GPIOC, 4)
@@ -109,6 +111,11 @@
 // Number of servo outputs
 #define HW_SERVO_NUM		2
 
+// Timer for hardware servo PWM. The channels are set in hw_setup_servo_outputs.
+#define HW_SERVO_TIM		TIM3
+#define HW_SERVO_TIM_AF		GPIO_AF_TIM3
+#define HW_SERVO_TIM_RCC	RCC_APB1Periph_TIM3
+
 // UART Peripheral
 #define HW_UART_DEV			UARTD6
 #define HW_UART_GPIO_AF		GPIO_AF_USART6
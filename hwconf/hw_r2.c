@@ -150,7 +150,7 @@ void hw_setup_servo_outputs(void) {
 	servos[0].gpio = GPIOB;
 	servos[0].pin = 5;
 	servos[0].offset = 0;
-	servos[0].pos = 128;
+	servos[0].pos = SERVO_POS_MAX / 2;
 
 	servos[1].gpio = GPIOD;
 	servos[1].pin = 2;
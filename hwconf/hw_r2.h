@@ -30,7 +30,9 @@
 #define DISABLE_GATE()			palClearPad(GPIOC, 9)
 #define DCCAL_ON()				palSetPad(GPIOB, 12)
 #define DCCAL_OFF()				palClearPad(GPIOB, 12)
-#define IS_DRV_FAULT()			(!palReadPad(GPIOC, 12))
+#define DRV_FAULT_GPIO			GPIOC
+#define DRV_FAULT_PIN			12
+#define IS_DRV_FAULT()			(!palReadPad(DRV_FAULT_GPIO, DRV_FAULT_PIN))
 
 #define LED1_ON()			palSetPad(GPIOB, 6)
 #define LED1_OFF()			palClearPad(GPIOB, 6)
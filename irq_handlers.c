@@ -22,6 +22,7 @@
 #include "main.h"
 #include "mcpwm.h"
 #include "servo.h"
+#include "ledpwm.h"
 
 CH_IRQ_HANDLER(TIM7_IRQHandler) {
 	CH_IRQ_PROLOGUE();
@@ -30,9 +31,47 @@ CH_IRQ_HANDLER(TIM7_IRQHandler) {
 	CH_IRQ_EPILOGUE();
 }
 
+CH_IRQ_HANDLER(TIM2_IRQHandler) {
+	CH_IRQ_PROLOGUE();
+	if (TIM_GetITStatus(TIM2, TIM_IT_CC1) != RESET) {
+		TIM_ClearITPendingBit(TIM2, TIM_IT_CC1);
+		mcpwm_zc_timer_int_handler();
+	}
+	CH_IRQ_EPILOGUE();
+}
+
 CH_IRQ_HANDLER(ADC1_2_3_IRQHandler) {
 	CH_IRQ_PROLOGUE();
-	ADC_ClearITPendingBit(ADC1, ADC_IT_JEOC);
-	mcpwm_adc_inj_int_handler();
+
+	// Handle the overcurrent watchdogs before anything else
+	if (ADC_GetITStatus(ADC1, ADC_IT_AWD) == SET || ADC_GetITStatus(ADC2, ADC_IT_AWD) == SET) {
+		ADC_ClearITPendingBit(ADC1, ADC_IT_AWD);
+		ADC_ClearITPendingBit(ADC2, ADC_IT_AWD);
+		mcpwm_adc_awd_int_handler();
+	}
+
+	if (ADC_GetITStatus(ADC1, ADC_IT_JEOC) == SET) {
+		ADC_ClearITPendingBit(ADC1, ADC_IT_JEOC);
+		mcpwm_adc_inj_int_handler();
+	}
+
+	CH_IRQ_EPILOGUE();
+}
+
+#ifdef DRV_FAULT_EXTI_LINE
+CH_IRQ_HANDLER(DRV_FAULT_EXTI_ISR) {
+	CH_IRQ_PROLOGUE();
+	if (EXTI_GetITStatus(DRV_FAULT_EXTI_LINE) != RESET) {
+		EXTI_ClearITPendingBit(DRV_FAULT_EXTI_LINE);
+		mcpwm_drv_fault_int_handler();
+	}
+	CH_IRQ_EPILOGUE();
+}
+#endif
+
+// TIM9 shares this vector with the TIM1 break interrupt
+CH_IRQ_HANDLER(TIM1_BRK_IRQHandler) {
+	CH_IRQ_PROLOGUE();
+	ledpwm_irq();
 	CH_IRQ_EPILOGUE();
 }
@@ -28,171 +28,350 @@
 #include "ws2811.h"
 #include "mcpwm.h"
 
+// Settings
+#define FRAME_TIME_MS			20
+#define FAULT_POLL_MS			100
+#define EFFECTS_MAX				2
+#define PALETTE_LEN				32
+#define BLINK_PERIOD_MS			1000
+#define FAULT_LED_TIME_MS		200
+#define FAULT_HOLD_TIME_MS		1000
+#define FAULT_FADE_TIME_MS		500
+
+// Event masks
+#define EVT_STATE				1
+#define EVT_FRAME				2
+
 // Macros
-#define HAS_FAULT()		(mcpwm_get_fault() != FAULT_CODE_NONE)
+#define MS_TO_FRAMES(ms)		((ms) / FRAME_TIME_MS)
+
+// Effects that are drawn on top of the base colors
+typedef enum {
+	LED_EFFECT_BLINK = 0,	// Toggle between the color and black
+	LED_EFFECT_FADE,		// Fade in and out
+	LED_EFFECT_CHASE,		// A single lit LED moving over the range
+	LED_EFFECT_FAULT_CODE	// Light arg LEDs one at a time, hold, then fade out
+} LED_EFFECT;
+
+typedef struct {
+	LED_EFFECT type;
+	int first;
+	int num;
+	int period; // Frames
+	int arg;
+	uint32_t palette[PALETTE_LEN]; // From black to the effect color
+} led_effect;
 
 // Private variables
 static WORKING_AREA(led_thread_wa, 1024);
 static volatile LED_EXT_STATE state;
 static volatile bool reverse_leds;
+static Thread *led_tp = 0;
+static VirtualTimer frame_vt;
+static volatile bool frame_timer_run;
+static uint32_t base_colors[WS2811_LED_NUM];
+static led_effect effects[EFFECTS_MAX];
+static int effect_num;
+static systime_t effect_start;
+static bool showing_fault;
+static uint32_t red_weak;
 
 // Private function prototypes
 static msg_t led_thread(void *arg);
-static uint32_t scale_color(uint32_t color, float scale);
-static void wait_for_state_change(void);
-static void set_led_wrapper(int led, uint32_t color);
+static uint32_t scale_color(uint32_t color, uint32_t scale);
+static void make_palette(uint32_t *palette, uint32_t color);
+static led_effect *add_effect(LED_EFFECT type, int first, int num, uint32_t color, int period);
+static void setup_state(LED_EXT_STATE st);
+static void setup_fault(mc_fault_code fault);
+static void render(int frame);
+static void frame_timer_start(void);
+static void frame_timer_stop(void);
+static void frame_timer_cb(void *p);
 
 void led_external_init(void) {
 	reverse_leds = false;
 	state = LED_EXT_OFF;
+	frame_timer_run = false;
 	chThdCreateStatic(led_thread_wa, sizeof(led_thread_wa), LOWPRIO, led_thread, NULL);
 }
 
 void led_external_set_state(LED_EXT_STATE new_state) {
-	state = new_state;
+	if (new_state != state) {
+		state = new_state;
+		if (led_tp) {
+			chEvtSignal(led_tp, (eventmask_t) EVT_STATE);
+		}
+	}
 }
 
 void led_external_set_reversed(bool newstate) {
-	reverse_leds = newstate;
+	if (newstate != reverse_leds) {
+		reverse_leds = newstate;
+		if (led_tp) {
+			chEvtSignal(led_tp, (eventmask_t) EVT_STATE);
+		}
+	}
 }
 
+/*
+ * The thread only wakes up on state changes, on frames while an effect is
+ * running and periodically to check for faults.
+ */
 static msg_t led_thread(void *arg) {
 	(void) arg;
 	chRegSetThreadName("LEDs External");
 
-	for(;;) {
-		mc_fault_code fault = mcpwm_get_fault();
-		if (fault != FAULT_CODE_NONE) {
-			ws2811_set_all(COLOR_BLACK);
-			for (int i = 0;i < (int)fault;i++) {
-				set_led_wrapper(i, COLOR_RED);
-				chThdSleepMilliseconds(200);
-			}
-
-			chThdSleepMilliseconds(1000);
+	led_tp = chThdSelf();
 
-			float scale = 1.0;
-			for (int i = 0;i < 50;i++) {
-				scale -= 0.02;
-				uint32_t color = scale_color(COLOR_RED, scale);
-				for (int i = 0;i < (int)fault;i++) {
-					set_led_wrapper(i, color);
-				}
-				chThdSleepMilliseconds(10);
-			}
-		} else {
-			uint32_t red_weak = scale_color(COLOR_RED, 0.5);
-			LED_EXT_STATE state_last = state;
-			bool rev_last = reverse_leds;
-
-			switch (state) {
-			case LED_EXT_OFF:
-				ws2811_set_all(COLOR_BLACK);
-				wait_for_state_change();
-				break;
-
-			case LED_EXT_NORMAL:
-				for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
-					set_led_wrapper(i, red_weak);
-					set_led_wrapper(i + WS2811_LED_NUM / 2, COLOR_WHITE);
-				}
-				wait_for_state_change();
-				break;
+	red_weak = scale_color(COLOR_RED, 128);
+	showing_fault = false;
+	setup_state(state);
 
-			case LED_EXT_BRAKE:
-				for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
-					set_led_wrapper(i, COLOR_RED);
-					set_led_wrapper(i + WS2811_LED_NUM / 2, COLOR_WHITE);
-				}
-				wait_for_state_change();
-				break;
-
-			case LED_EXT_TURN_LEFT:
-			case LED_EXT_BRAKE_TURN_LEFT:
-				for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
-					if (state == LED_EXT_TURN_LEFT) {
-						set_led_wrapper(i, red_weak);
-					} else {
-						set_led_wrapper(i, COLOR_RED);
-					}
-					set_led_wrapper(i + WS2811_LED_NUM / 2, COLOR_WHITE);
-				}
+	for(;;) {
+		eventmask_t evt = chEvtWaitAnyTimeout((eventmask_t) (EVT_STATE | EVT_FRAME),
+				MS2ST(FAULT_POLL_MS));
 
-				while (state == state_last && rev_last == reverse_leds && !HAS_FAULT()) {
-					if ((chTimeNow() / (CH_FREQUENCY / 2)) % 2) {
-						set_led_wrapper(WS2811_LED_NUM / 2 - 1, COLOR_ORANGE);
-						set_led_wrapper(WS2811_LED_NUM / 2, COLOR_ORANGE);
-					} else {
-						set_led_wrapper(WS2811_LED_NUM / 2 - 1, COLOR_BLACK);
-						set_led_wrapper(WS2811_LED_NUM / 2, COLOR_BLACK);
-					}
-					chThdSleepMilliseconds(10);
-				}
-				break;
-
-			case LED_EXT_TURN_RIGHT:
-			case LED_EXT_BRAKE_TURN_RIGHT:
-				for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
-					if (state == LED_EXT_TURN_RIGHT) {
-						set_led_wrapper(i, red_weak);
-					} else {
-						set_led_wrapper(i, COLOR_RED);
-					}
-					set_led_wrapper(i + WS2811_LED_NUM / 2, COLOR_WHITE);
-				}
+		int frame = (chTimeNow() - effect_start) / MS2ST(FRAME_TIME_MS);
+		mc_fault_code fault = mcpwm_get_fault();
 
-				while (state == state_last && rev_last == reverse_leds && !HAS_FAULT()) {
-					if ((chTimeNow() / (CH_FREQUENCY / 2)) % 2) {
-						set_led_wrapper(0, COLOR_ORANGE);
-						set_led_wrapper(WS2811_LED_NUM - 1, COLOR_ORANGE);
-					} else {
-						set_led_wrapper(0, COLOR_BLACK);
-						set_led_wrapper(WS2811_LED_NUM - 1, COLOR_BLACK);
-					}
-					chThdSleepMilliseconds(10);
+		if (showing_fault) {
+			// Show the whole fault code before going on
+			if (frame >= effects[0].period) {
+				if (fault != FAULT_CODE_NONE) {
+					setup_fault(fault);
+				} else {
+					showing_fault = false;
+					setup_state(state);
 				}
-				break;
-
-			default:
-				chThdSleepMilliseconds(10);
-				break;
+				continue;
 			}
+		} else if (fault != FAULT_CODE_NONE) {
+			setup_fault(fault);
+			continue;
+		} else if (evt & EVT_STATE) {
+			setup_state(state);
+			continue;
 		}
 
-		chThdSleepMilliseconds(1);
+		if (evt & EVT_FRAME) {
+			render(frame);
+		}
 	}
 
 	return (msg_t) 0;
 }
 
-static uint32_t scale_color(uint32_t color, float scale) {
+/*
+ * Scale a color with scale / 256 using integer math.
+ */
+static uint32_t scale_color(uint32_t color, uint32_t scale) {
 	uint32_t r = (color >> 16) & 0xFF;
 	uint32_t g = (color >> 8) & 0xFF;
 	uint32_t b = color & 0xFF;
 
-	r *= scale;
-	g *= scale;
-	b *= scale;
+	r = (r * scale) >> 8;
+	g = (g * scale) >> 8;
+	b = (b * scale) >> 8;
 
 	return (r << 16) | (g << 8) | b;
 }
 
-static void wait_for_state_change(void) {
-	LED_EXT_STATE st = state;
-	bool reversed = reverse_leds;
-	while (state == st && reversed == reverse_leds && !HAS_FAULT()) {
-		chThdSleepMilliseconds(10);
+static void make_palette(uint32_t *palette, uint32_t color) {
+	for (int i = 0;i < PALETTE_LEN;i++) {
+		palette[i] = scale_color(color, (i * 256) / (PALETTE_LEN - 1));
 	}
 }
 
-static void set_led_wrapper(int led, uint32_t color) {
-	if (reverse_leds) {
-		if (led < WS2811_LED_NUM / 2) {
-			ws2811_set_led_color(led + WS2811_LED_NUM / 2, color);
-		} else {
-			ws2811_set_led_color(led - WS2811_LED_NUM / 2, color);
+static led_effect *add_effect(LED_EFFECT type, int first, int num, uint32_t color, int period) {
+	if (effect_num >= EFFECTS_MAX) {
+		return 0;
+	}
+
+	led_effect *e = &effects[effect_num++];
+	e->type = type;
+	e->first = first;
+	e->num = num;
+	e->period = period > 0 ? period : 1;
+	e->arg = 0;
+	make_palette(e->palette, color);
+
+	return e;
+}
+
+/*
+ * Set up the base colors and effects for a state and draw the first frame.
+ * The frame timer only runs if there are effects.
+ */
+static void setup_state(LED_EXT_STATE st) {
+	effect_num = 0;
+
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		base_colors[i] = COLOR_BLACK;
+	}
+
+	if (st != LED_EXT_OFF) {
+		for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
+			if (st == LED_EXT_NORMAL || st == LED_EXT_TURN_LEFT || st == LED_EXT_TURN_RIGHT) {
+				base_colors[i] = red_weak;
+			} else {
+				base_colors[i] = COLOR_RED;
+			}
+			base_colors[i + WS2811_LED_NUM / 2] = COLOR_WHITE;
 		}
+	}
+
+	switch (st) {
+	case LED_EXT_TURN_LEFT:
+	case LED_EXT_BRAKE_TURN_LEFT:
+		add_effect(LED_EFFECT_BLINK, WS2811_LED_NUM / 2 - 1, 2, COLOR_ORANGE,
+				MS_TO_FRAMES(BLINK_PERIOD_MS));
+		break;
+
+	case LED_EXT_TURN_RIGHT:
+	case LED_EXT_BRAKE_TURN_RIGHT:
+		add_effect(LED_EFFECT_BLINK, 0, 1, COLOR_ORANGE, MS_TO_FRAMES(BLINK_PERIOD_MS));
+		add_effect(LED_EFFECT_BLINK, WS2811_LED_NUM - 1, 1, COLOR_ORANGE,
+				MS_TO_FRAMES(BLINK_PERIOD_MS));
+		break;
+
+	default:
+		break;
+	}
+
+	effect_start = chTimeNow();
+	render(0);
+
+	if (effect_num > 0) {
+		frame_timer_start();
 	} else {
-		ws2811_set_led_color(led, color);
+		frame_timer_stop();
+	}
+}
+
+static void setup_fault(mc_fault_code fault) {
+	effect_num = 0;
+
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		base_colors[i] = COLOR_BLACK;
+	}
+
+	int code = (int)fault;
+	if (code > WS2811_LED_NUM) {
+		code = WS2811_LED_NUM;
+	}
+
+	led_effect *e = add_effect(LED_EFFECT_FAULT_CODE, 0, code, COLOR_RED,
+			code * MS_TO_FRAMES(FAULT_LED_TIME_MS) + MS_TO_FRAMES(FAULT_HOLD_TIME_MS) +
+			MS_TO_FRAMES(FAULT_FADE_TIME_MS));
+	e->arg = code;
+
+	showing_fault = true;
+	effect_start = chTimeNow();
+	render(0);
+	frame_timer_start();
+}
+
+/*
+ * Draw the base colors and all effects for a frame and send them as one
+ * frame to the LEDs.
+ */
+static void render(int frame) {
+	uint32_t colors[WS2811_LED_NUM];
+
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		colors[i] = base_colors[i];
+	}
+
+	for (int i = 0;i < effect_num;i++) {
+		const led_effect *e = &effects[i];
+		const int phase = frame % e->period;
+		int lit = e->num;
+		int level = PALETTE_LEN - 1;
+
+		switch (e->type) {
+		case LED_EFFECT_BLINK:
+			level = phase < (e->period / 2) ? PALETTE_LEN - 1 : 0;
+			break;
+
+		case LED_EFFECT_FADE: {
+			const int half = e->period / 2 > 0 ? e->period / 2 : 1;
+			if (phase < half) {
+				level = (phase * (PALETTE_LEN - 1)) / half;
+			} else {
+				level = ((e->period - phase) * (PALETTE_LEN - 1)) / (e->period - half);
+			}
+			break;
+		}
+
+		case LED_EFFECT_CHASE: {
+			const int pos = (phase * e->num) / e->period;
+			for (int j = 0;j < e->num;j++) {
+				colors[e->first + j] = j == pos ? e->palette[PALETTE_LEN - 1] : COLOR_BLACK;
+			}
+			continue;
+		}
+
+		case LED_EFFECT_FAULT_CODE: {
+			const int led_frames = MS_TO_FRAMES(FAULT_LED_TIME_MS);
+			const int fade_start = e->arg * led_frames + MS_TO_FRAMES(FAULT_HOLD_TIME_MS);
+
+			if (phase < e->arg * led_frames) {
+				lit = phase / led_frames + 1;
+			} else if (phase >= fade_start) {
+				level = PALETTE_LEN - 1 - ((phase - fade_start) * (PALETTE_LEN - 1)) /
+						MS_TO_FRAMES(FAULT_FADE_TIME_MS);
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+
+		for (int j = 0;j < lit && (e->first + j) < WS2811_LED_NUM;j++) {
+			colors[e->first + j] = e->palette[level];
+		}
+	}
+
+	// When reversed, the halves are swapped
+	if (reverse_leds) {
+		for (int i = 0;i < WS2811_LED_NUM / 2;i++) {
+			uint32_t tmp = colors[i];
+			colors[i] = colors[i + WS2811_LED_NUM / 2];
+			colors[i + WS2811_LED_NUM / 2] = tmp;
+		}
+	}
+
+	ws2811_frame_begin();
+	ws2811_frame_set_leds(0, colors, WS2811_LED_NUM);
+	ws2811_frame_commit();
+}
+
+static void frame_timer_start(void) {
+	chSysLock();
+	frame_timer_run = true;
+	if (!chVTIsArmedI(&frame_vt)) {
+		chVTSetI(&frame_vt, MS2ST(FRAME_TIME_MS), frame_timer_cb, NULL);
+	}
+	chSysUnlock();
+}
+
+static void frame_timer_stop(void) {
+	chSysLock();
+	frame_timer_run = false;
+	if (chVTIsArmedI(&frame_vt)) {
+		chVTResetI(&frame_vt);
+	}
+	chSysUnlock();
+}
+
+static void frame_timer_cb(void *p) {
+	(void)p;
+
+	chSysLockFromIsr();
+	chEvtSignalI(led_tp, (eventmask_t) EVT_FRAME);
+	if (frame_timer_run) {
+		chVTSetI(&frame_vt, MS2ST(FRAME_TIME_MS), frame_timer_cb, NULL);
 	}
+	chSysUnlockFromIsr();
 }
@@ -28,18 +28,65 @@
 #include <string.h>
 #include <math.h>
 #include "hw.h"
+#include "stm32f4xx_conf.h"
+
+/*
+ * The LEDs are driven from the update and compare interrupts of TIM9 at a
+ * low priority. The update interrupt switches the LEDs on and the compare
+ * interrupts switch them off, so the timing comes from the timer and only
+ * three short interrupts run per PWM period.
+ */
 
 // Private variables
 static volatile int led_values[LEDPWM_LED_NUM];
-static uint8_t gamma_table[LEDPWM_CNT_TOP + 1];
+static uint16_t gamma_table[LEDPWM_GAMMA_STEPS];
 
 void ledpwm_init(void) {
+	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+	TIM_OCInitTypeDef  TIM_OCInitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+
 	memset((int*)led_values, 0, sizeof(led_values));
 
 	// Generate gamma correction table
-	for (int i = 0;i < (LEDPWM_CNT_TOP + 1);i++) {
-		gamma_table[i] = (int)roundf(powf((float)i / (float)LEDPWM_CNT_TOP, 1.0 / 0.45) * (float)LEDPWM_CNT_TOP);
+	for (int i = 0;i < LEDPWM_GAMMA_STEPS;i++) {
+		gamma_table[i] = (int)roundf(powf((float)i / (float)(LEDPWM_GAMMA_STEPS - 1), 1.0 / 0.45) *
+				(float)LEDPWM_CNT_TOP);
 	}
+
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM9, ENABLE);
+
+	// TIM9 runs from the APB2 timer clock, which is the core clock
+	TIM_TimeBaseStructure.TIM_Period = LEDPWM_CNT_TOP - 1;
+	TIM_TimeBaseStructure.TIM_Prescaler = (uint16_t)(SYSTEM_CORE_CLOCK / (LEDPWM_FREQ * LEDPWM_CNT_TOP)) - 1;
+	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseInit(TIM9, &TIM_TimeBaseStructure);
+
+	// Compare channels without outputs, only for the interrupts. A compare
+	// value above the period never matches, which keeps the LED on.
+	TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_Timing;
+	TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Disable;
+	TIM_OCInitStructure.TIM_Pulse = 0;
+	TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
+	TIM_OC1Init(TIM9, &TIM_OCInitStructure);
+	TIM_OC2Init(TIM9, &TIM_OCInitStructure);
+
+	// New values are applied at the start of the next period
+	TIM_OC1PreloadConfig(TIM9, TIM_OCPreload_Enable);
+	TIM_OC2PreloadConfig(TIM9, TIM_OCPreload_Enable);
+	TIM_ARRPreloadConfig(TIM9, ENABLE);
+
+	TIM_ITConfig(TIM9, TIM_IT_Update | TIM_IT_CC1 | TIM_IT_CC2, ENABLE);
+
+	// The interrupt is shared with TIM1 break
+	NVIC_InitStructure.NVIC_IRQChannel = TIM1_BRK_TIM9_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 6;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	TIM_Cmd(TIM9, ENABLE);
 }
 
 /*
@@ -61,44 +108,57 @@ void ledpwm_set_intensity(unsigned int led, float intensity) {
 		intensity = 1.0;
 	}
 
-	led_values[led] = gamma_table[(int)(intensity * LEDPWM_CNT_TOP)];
+	ledpwm_set_value(led, gamma_table[(int)(intensity * (LEDPWM_GAMMA_STEPS - 1))]);
 }
 
 void ledpwm_led_on(int led) {
-	if (led >= LEDPWM_LED_NUM) {
-		return;
-	}
-
-	led_values[led] = LEDPWM_CNT_TOP;
+	ledpwm_set_value(led, LEDPWM_CNT_TOP);
 }
 
 void ledpwm_led_off(int led) {
-	if (led >= LEDPWM_LED_NUM) {
+	ledpwm_set_value(led, 0);
+}
+
+/*
+ * Set the raw on time of a LED, from 0 to LEDPWM_CNT_TOP.
+ */
+void ledpwm_set_value(int led, int value) {
+	if (led < 0 || led >= LEDPWM_LED_NUM) {
 		return;
 	}
 
-	led_values[led] = 0;
+	led_values[led] = value;
+
+	if (led == 0) {
+		TIM_SetCompare1(TIM9, value);
+	} else {
+		TIM_SetCompare2(TIM9, value);
+	}
 }
 
 /*
- * Call this function as fast as possible, with a deterministic rate.
+ * Called from the TIM9 interrupt.
  */
-void ledpwm_update_pwm(void) {
-	static int cnt = 0;
-	cnt++;
-	if (cnt == LEDPWM_CNT_TOP) {
-		cnt = 0;
+void ledpwm_irq(void) {
+	if (TIM_GetITStatus(TIM9, TIM_IT_Update) != RESET) {
+		TIM_ClearITPendingBit(TIM9, TIM_IT_Update);
+
+		if (led_values[0] > 0) {
+			LED1_ON();
+		}
+
+		if (led_values[1] > 0) {
+			LED2_ON();
+		}
 	}
 
-	if (cnt >= led_values[0]) {
+	if (TIM_GetITStatus(TIM9, TIM_IT_CC1) != RESET) {
+		TIM_ClearITPendingBit(TIM9, TIM_IT_CC1);
 		LED1_OFF();
-	} else {
-		LED1_ON();
 	}
 
-	if (cnt >= led_values[1]) {
+	if (TIM_GetITStatus(TIM9, TIM_IT_CC2) != RESET) {
+		TIM_ClearITPendingBit(TIM9, TIM_IT_CC2);
 		LED2_OFF();
-	} else {
-		LED2_ON();
 	}
 }
@@ -27,7 +27,9 @@
 
 // Settings
 #define LEDPWM_LED_NUM		2
-#define LEDPWM_CNT_TOP		200
+#define LEDPWM_CNT_TOP		1000	// Timer counts per PWM period
+#define LEDPWM_FREQ			500		// PWM frequency in Hz
+#define LEDPWM_GAMMA_STEPS	256
 
 #define LED_GREEN			0
 #define LED_RED				1
@@ -37,6 +39,7 @@ void ledpwm_init(void);
 void ledpwm_set_intensity(unsigned int led, float intensity);
 void ledpwm_led_on(int led);
 void ledpwm_led_off(int led);
-void ledpwm_update_pwm(void);
+void ledpwm_set_value(int led, int value);
+void ledpwm_irq(void);
 
 #endif /* LEDPWM_H_ */
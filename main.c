@@ -38,6 +38,8 @@
 #include "comm_can.h"
 #include "ws2811.h"
 #include "led_external.h"
+#include "timesync.h"
+#include "servo.h"
 
 /*
  * Timers used:
@@ -46,8 +48,10 @@
  * TIM2: mcpwm
  * TIM12: mcpwm
  * TIM8: mcpwm
- * TIM3: servo_dec
+ * TIM3: servo_dec or servo
  * TIM4: WS2811/WS2812 LEDs
+ * TIM5: timesync
+ * TIM9: ledpwm
  *
  * DMA/stream	Device		Function
  * 1, 2			I2C1		Nunchuk, temp on rev 4.5
@@ -96,6 +100,8 @@ static volatile int sample_ready = 1;
 static volatile int sample_now = 0;
 static volatile int sample_at_start = 0;
 static volatile int was_start_sample = 0;
+static volatile uint32_t sample_start_time = 0;
+static volatile uint32_t sample_end_time = 0;
 static volatile int start_comm = 0;
 static volatile float main_last_adc_duration = 0.0;
 
@@ -159,6 +165,9 @@ static msg_t sample_send_thread(void *arg) {
 	for(;;) {
 		chEvtWaitAny((eventmask_t) 1);
 
+		commands_send_sample_time(timesync_local_to_sync(sample_start_time),
+				timesync_local_to_sync(sample_end_time));
+
 		for (int i = 0;i < sample_len;i++) {
 			uint8_t buffer[20];
 			int index = 0;
@@ -206,8 +215,6 @@ static msg_t timer_thread(void *arg) {
  * the ADC is initialized from mcpwm.c
  */
 void main_dma_adc_handler(void) {
-	ledpwm_update_pwm();
-
 	if (sample_at_start && (mcpwm_get_state() == MC_STATE_RUNNING ||
 			start_comm != mcpwm_get_comm_step())) {
 		sample_now = 0;
@@ -254,9 +261,14 @@ void main_dma_adc_handler(void) {
 
 			status_samples[sample_now] = mcpwm_get_comm_step() | (tmp << 3);
 
+			if (sample_now == 0) {
+				sample_start_time = timesync_get_local_us();
+			}
+
 			sample_now++;
 
 			if (sample_now == sample_len) {
+				sample_end_time = timesync_get_local_us();
 				sample_ready = 1;
 				sample_now = 0;
 				was_start_sample = 0;
@@ -307,6 +319,7 @@ int main(void) {
 
 	commands_init();
 	comm_usb_init();
+	timesync_init();
 	comm_can_init();
 
 	app_configuration appconf;
@@ -314,13 +327,16 @@ int main(void) {
 	app_init(&appconf);
 	timeout_init();
 	timeout_configure(appconf.timeout_msec, appconf.timeout_brake_current);
+	comm_can_set_baud(appconf.can_baud);
 
 #if WS2811_ENABLE
 	ws2811_init();
 	led_external_init();
 #endif
 
-  servo_init();
+	// The servo decoder uses TIM3 for the ICU
+	servo_init(!((appconf.app_to_use == APP_PPM || appconf.app_to_use == APP_PPM_UART) &&
+			appconf.app_ppm_conf.input_type != PPM_INPUT_SBUS));
 
 	// Threads
 	chThdCreateStatic(periodic_thread_wa, sizeof(periodic_thread_wa), NORMALPRIO, periodic_thread, NULL);
@@ -95,6 +95,24 @@ static volatile float amp_seconds_charged;
 static volatile float watt_seconds;
 static volatile float watt_seconds_charged;
 static volatile bool dccal_done;
+static volatile bool drv_fault_event;
+static volatile int drv_fault_time;
+static volatile int drv_faults_transient;
+static volatile int drv_faults_latched;
+static volatile bool offset_track_run;
+static volatile int offset_track_sum0;
+static volatile int offset_track_sum1;
+static volatile int offset_track_samples;
+static volatile int offset_track_rejected;
+static volatile float offset_track0;
+static volatile float offset_track1;
+static volatile float offset_cal0;
+static volatile float offset_cal1;
+static volatile bool detect_dc;
+static volatile int detect_dc_curr_sum;
+static volatile int detect_dc_samples;
+static volatile bool zc_pending;
+static volatile uint32_t last_comm_time;
 
 // KV FIR filter
 #define KV_FIR_TAPS_BITS		7
@@ -103,6 +121,7 @@ static volatile bool dccal_done;
 static volatile float kv_fir_coeffs[KV_FIR_LEN];
 static volatile float kv_fir_samples[KV_FIR_LEN];
 static volatile int kv_fir_index = 0;
+static volatile float kv_filtered_now = 0.0;
 
 // Amplitude FIR filter
 #define AMP_FIR_TAPS_BITS		7
@@ -150,6 +169,11 @@ static void set_switching_frequency(float frequency);
 static int try_input(void);
 static void do_dc_cal(void);
 static void update_override_limits(volatile mc_configuration *conf);
+static void update_hw_overcurrent(void);
+static void run_offset_tracking(void);
+static void init_drv_fault_exti(void);
+static void zc_schedule(uint32_t time);
+static void zc_cancel(void);
 
 // Defines
 #define IS_DETECTING()			(state == MC_STATE_DETECTING)
@@ -184,6 +208,10 @@ void mcpwm_init(mc_configuration *configuration) {
 	tachometer_for_direction = 0;
 	state = MC_STATE_OFF;
 	fault_now = FAULT_CODE_NONE;
+	drv_fault_event = false;
+	drv_fault_time = 0;
+	drv_faults_transient = 0;
+	drv_faults_latched = 0;
 	control_mode = CONTROL_MODE_NONE;
 	last_current_sample = 0.0;
 	last_current_sample_filtered = 0.0;
@@ -208,6 +236,20 @@ void mcpwm_init(mc_configuration *configuration) {
 	watt_seconds = 0.0;
 	watt_seconds_charged = 0.0;
 	dccal_done = false;
+	offset_track_run = false;
+	offset_track_sum0 = 0;
+	offset_track_sum1 = 0;
+	offset_track_samples = 0;
+	offset_track_rejected = 0;
+	offset_track0 = 0.0;
+	offset_track1 = 0.0;
+	offset_cal0 = 0.0;
+	offset_cal1 = 0.0;
+	detect_dc = false;
+	detect_dc_curr_sum = 0;
+	detect_dc_samples = 0;
+	zc_pending = false;
+	last_comm_time = 0;
 
 	mcpwm_init_hall_table(conf.hall_dir, conf.hall_fwd_add, conf.hall_rev_add);
 
@@ -420,6 +462,15 @@ void mcpwm_init(mc_configuration *configuration) {
 	// TIM2 enable counter
 	TIM_Cmd(TIM2, ENABLE);
 
+	// The TIM2 compare interrupt schedules commutations after zero crossings. It
+	// has the same priority as the ADC interrupts, so they never preempt each other.
+	TIM_ITConfig(TIM2, TIM_IT_CC1, DISABLE);
+	NVIC_InitStructure.NVIC_IRQChannel = TIM2_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 3;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 3;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
 	// ADC sampling locations
 	stop_pwm_hw();
 	mc_timer_struct timer_tmp;
@@ -430,6 +481,9 @@ void mcpwm_init(mc_configuration *configuration) {
 
 	utils_sys_unlock_cnt();
 
+	// Stop on DRV8302 faults right away
+	init_drv_fault_exti();
+
 	// Calibrate current offset
 	ENABLE_GATE();
 	DCCAL_OFF();
@@ -477,6 +531,7 @@ void mcpwm_set_configuration(mc_configuration *configuration) {
 	conf = *configuration;
 	update_override_limits(&conf);
 	mcpwm_init_hall_table(conf.hall_dir, conf.hall_fwd_add, conf.hall_rev_add);
+	update_hw_overcurrent();
 	utils_sys_unlock_cnt();
 }
 
@@ -507,7 +562,9 @@ void mcpwm_init_hall_table(int dir, int fwd_add, int rev_add) {
 
 static void do_dc_cal(void) {
 	DCCAL_ON();
-	while(IS_DRV_FAULT()){};
+	while(IS_DRV_FAULT()) {
+		chThdSleepMilliseconds(1);
+	}
 	chThdSleepMilliseconds(1000);
 	curr0_sum = 0;
 	curr1_sum = 0;
@@ -515,8 +572,140 @@ static void do_dc_cal(void) {
 	while(curr_start_samples < 4000) {};
 	curr0_offset = curr0_sum / curr_start_samples;
 	curr1_offset = curr1_sum / curr_start_samples;
+	offset_cal0 = (float)curr0_sum / (float)curr_start_samples;
+	offset_cal1 = (float)curr1_sum / (float)curr_start_samples;
+	offset_track0 = offset_cal0;
+	offset_track1 = offset_cal1;
 	DCCAL_OFF();
 	dccal_done = true;
+	update_hw_overcurrent();
+}
+
+/*
+ * Set up the analog watchdogs of ADC1 and ADC2 to check the injected current
+ * samples against l_abs_current_max_hw. They trip in the ADC interrupt right
+ * after the conversion, before any processing, and only need the offsets.
+ * The third phase is not covered, but the two measured phases carry the same
+ * peak currents in all commutation steps.
+ */
+static void update_hw_overcurrent(void) {
+	ADC_ITConfig(ADC1, ADC_IT_AWD, DISABLE);
+	ADC_ITConfig(ADC2, ADC_IT_AWD, DISABLE);
+	ADC_AnalogWatchdogCmd(ADC1, ADC_AnalogWatchdog_None);
+	ADC_AnalogWatchdogCmd(ADC2, ADC_AnalogWatchdog_None);
+
+	if (!dccal_done || conf.l_abs_current_max_hw <= 0.0) {
+		return;
+	}
+
+	const int lim = (int)(conf.l_abs_current_max_hw /
+			((V_REG / 4095.0) / (CURRENT_SHUNT_RES * CURRENT_AMP_GAIN)));
+
+	int high0 = curr0_offset + lim;
+	int low0 = curr0_offset - lim;
+	int high1 = curr1_offset + lim;
+	int low1 = curr1_offset - lim;
+
+	// Outside of the ADC range the watchdog can't trip on that side
+	high0 = high0 > 4095 ? 4095 : high0;
+	high1 = high1 > 4095 ? 4095 : high1;
+	low0 = low0 < 0 ? 0 : low0;
+	low1 = low1 < 0 ? 0 : low1;
+
+	ADC_AnalogWatchdogThresholdsConfig(ADC1, high0, low0);
+	ADC_AnalogWatchdogThresholdsConfig(ADC2, high1, low1);
+
+	// The injected sequence has one conversion, which is in JSQ4
+	ADC_AnalogWatchdogSingleChannelConfig(ADC1, (ADC1->JSQR >> 15) & 0x1F);
+	ADC_AnalogWatchdogSingleChannelConfig(ADC2, (ADC2->JSQR >> 15) & 0x1F);
+
+	ADC_ClearITPendingBit(ADC1, ADC_IT_AWD);
+	ADC_ClearITPendingBit(ADC2, ADC_IT_AWD);
+	ADC_AnalogWatchdogCmd(ADC1, ADC_AnalogWatchdog_SingleInjecEnable);
+	ADC_AnalogWatchdogCmd(ADC2, ADC_AnalogWatchdog_SingleInjecEnable);
+	ADC_ITConfig(ADC1, ADC_IT_AWD, ENABLE);
+	ADC_ITConfig(ADC2, ADC_IT_AWD, ENABLE);
+}
+
+/*
+ * Re-estimate the current offsets while the bridge is off and the motor is
+ * not moving, so that they follow the temperature drift of the amplifiers.
+ * Blocks of samples are collected in the injected ADC interrupt and fed into
+ * an incremental average. The offsets used by the interrupt are moved at most
+ * one ADC count per block towards that average, so the normalized currents
+ * never jump.
+ */
+static void run_offset_tracking(void) {
+	static int settle_time = 0;
+
+	const bool track_ok = dccal_done && state == MC_STATE_OFF &&
+			fault_now == FAULT_CODE_NONE && !IS_DRV_FAULT() &&
+			fabsf(dutycycle_now) < MCPWM_MIN_DUTY_CYCLE &&
+			fabsf(rpm_now) < MCPWM_OFFSET_TRACK_MAX_ERPM;
+
+	if (!track_ok || settle_time < MCPWM_OFFSET_TRACK_SETTLE_TIME) {
+		offset_track_run = false;
+		offset_track_sum0 = 0;
+		offset_track_sum1 = 0;
+		offset_track_samples = 0;
+		offset_track_rejected = 0;
+
+		if (track_ok) {
+			settle_time++;
+		} else {
+			settle_time = 0;
+		}
+
+		return;
+	}
+
+	offset_track_run = true;
+
+	if ((offset_track_samples + offset_track_rejected) < MCPWM_OFFSET_TRACK_SAMPLES) {
+		return;
+	}
+
+	chSysLock();
+	const int sum0 = offset_track_sum0;
+	const int sum1 = offset_track_sum1;
+	const int samples = offset_track_samples;
+	const int rejected = offset_track_rejected;
+	offset_track_sum0 = 0;
+	offset_track_sum1 = 0;
+	offset_track_samples = 0;
+	offset_track_rejected = 0;
+	chSysUnlock();
+
+	// Something is moving the motor or disturbing the measurement
+	if (rejected > (samples / 8)) {
+		return;
+	}
+
+	offset_track0 += ((float)sum0 / (float)samples - offset_track0) * MCPWM_OFFSET_TRACK_GAIN;
+	offset_track1 += ((float)sum1 / (float)samples - offset_track1) * MCPWM_OFFSET_TRACK_GAIN;
+
+	int new0 = curr0_offset;
+	int new1 = curr1_offset;
+
+	if (offset_track0 > ((float)new0 + 0.5)) {
+		new0++;
+	} else if (offset_track0 < ((float)new0 - 0.5)) {
+		new0--;
+	}
+
+	if (offset_track1 > ((float)new1 + 0.5)) {
+		new1++;
+	} else if (offset_track1 < ((float)new1 - 0.5)) {
+		new1--;
+	}
+
+	if (new0 != curr0_offset || new1 != curr1_offset) {
+		chSysLock();
+		curr0_offset = new0;
+		curr1_offset = new1;
+		chSysUnlock();
+		update_hw_overcurrent();
+	}
 }
 
 /**
@@ -1396,11 +1585,29 @@ static msg_t timer_thread(void *arg) {
 							KV_FIR_TAPS_BITS, (uint32_t*)&kv_fir_index);
 				}
 			}
+
+			// For the current controller feed-forward
+			kv_filtered_now = mcpwm_get_kv_filtered();
 		}
 
-		// Check if the DRV8302 indicates any fault
+		// Check if the DRV8302 indicates any fault. This is normally caught by the
+		// EXTI already, but a fault that is present at startup has no edge. Faults
+		// are counted as transient or latched depending on how long they last.
 		if (IS_DRV_FAULT()) {
 			fault_stop(FAULT_CODE_DRV8302);
+			drv_fault_event = true;
+			drv_fault_time++;
+			if (drv_fault_time == MCPWM_DRV_FAULT_LATCH_TIME) {
+				drv_faults_latched++;
+			}
+		} else {
+			chSysLock();
+			if (drv_fault_event && drv_fault_time < MCPWM_DRV_FAULT_LATCH_TIME) {
+				drv_faults_transient++;
+			}
+			drv_fault_event = false;
+			drv_fault_time = 0;
+			chSysUnlock();
 		}
 
 		// Decrease fault iterations
@@ -1412,6 +1619,7 @@ static msg_t timer_thread(void *arg) {
 			}
 		}
 
+		run_offset_tracking();
 		update_override_limits(&conf);
 
 		chThdSleepMilliseconds(1);
@@ -1420,6 +1628,80 @@ static msg_t timer_thread(void *arg) {
 	return 0;
 }
 
+/*
+ * Interrupt on the falling edge of the DRV8302 nFAULT pin, so that the bridge
+ * is stopped without waiting for the timer thread to poll the pin.
+ */
+static void init_drv_fault_exti(void) {
+#ifdef DRV_FAULT_EXTI_LINE
+	EXTI_InitTypeDef EXTI_InitStructure;
+	NVIC_InitTypeDef NVIC_InitStructure;
+
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	SYSCFG_EXTILineConfig(DRV_FAULT_EXTI_PORTSRC, DRV_FAULT_EXTI_PINSRC);
+
+	EXTI_InitStructure.EXTI_Line = DRV_FAULT_EXTI_LINE;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Falling;
+	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&EXTI_InitStructure);
+
+	NVIC_InitStructure.NVIC_IRQChannel = DRV_FAULT_EXTI_CH;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 3;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+#endif
+}
+
+/*
+ * Called on the falling edge of nFAULT. Every edge stops the bridge, even if
+ * the pin is high again when the interrupt runs.
+ */
+void mcpwm_drv_fault_int_handler(void) {
+	stop_pwm_hw();
+	fault_stop(FAULT_CODE_DRV8302);
+	drv_fault_event = true;
+}
+
+/*
+ * Commute on the TIM2 counter value time, in us since the last commutation.
+ */
+static void zc_schedule(uint32_t time) {
+	zc_pending = true;
+	TIM_SetCompare1(TIM2, time);
+	TIM_ClearITPendingBit(TIM2, TIM_IT_CC1);
+	TIM_ITConfig(TIM2, TIM_IT_CC1, ENABLE);
+}
+
+static void zc_cancel(void) {
+	TIM_ITConfig(TIM2, TIM_IT_CC1, DISABLE);
+	zc_pending = false;
+}
+
+/*
+ * Called from the TIM2 compare interrupt when a commutation that was scheduled
+ * after a zero crossing is due.
+ */
+void mcpwm_zc_timer_int_handler(void) {
+	if (zc_pending && conf.sl_is_sensorless &&
+			conf.comm_mode == COMM_MODE_ZERO_CROSSING &&
+			(state == MC_STATE_RUNNING || state == MC_STATE_OFF)) {
+		commutate(1);
+	} else {
+		zc_cancel();
+	}
+}
+
+/*
+ * Called when a current sample is outside of the hardware overcurrent limit.
+ */
+void mcpwm_adc_awd_int_handler(void) {
+	// Switch off the bridge first, the fault logging takes a while
+	stop_pwm_hw();
+	fault_stop(FAULT_CODE_ABS_OVER_CURRENT);
+}
+
 void mcpwm_adc_inj_int_handler(void) {
 	TIM12->CNT = 0;
 
@@ -1438,10 +1720,29 @@ void mcpwm_adc_inj_int_handler(void) {
 	curr1_sum += curr1;
 	curr_start_samples++;
 
+	// Background offset tracking. Samples that are far from the offset are not
+	// caused by drift, so they are only counted.
+	if (offset_track_run) {
+		if (abs(curr0 - curr0_offset) < MCPWM_OFFSET_TRACK_MAX_DEV &&
+				abs(curr1 - curr1_offset) < MCPWM_OFFSET_TRACK_MAX_DEV) {
+			offset_track_sum0 += curr0;
+			offset_track_sum1 += curr1;
+			offset_track_samples++;
+		} else {
+			offset_track_rejected++;
+		}
+	}
+
 	ADC_curr_norm_value[0] = curr0 - curr0_offset;
 	ADC_curr_norm_value[1] = curr1 - curr1_offset;
 	ADC_curr_norm_value[2] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[1]);
 
+	// In step 2 all current flows through the first sensor
+	if (IS_DETECTING() && detect_dc) {
+		detect_dc_curr_sum += ADC_curr_norm_value[0];
+		detect_dc_samples++;
+	}
+
 	float curr_tot_sample = 0;
 
 	/*
@@ -1532,10 +1833,10 @@ void mcpwm_adc_inj_int_handler(void) {
 		detect_now--;
 	}
 
-	if (IS_DETECTING() && detect_now == 0) {
+	if (IS_DETECTING() && !detect_dc && detect_now == 0) {
 		detect_now = 5;
 
-		set_duty_cycle_hw(0.2);
+		set_duty_cycle_hw(MCPWM_DETECT_DUTY);
 
 		detect_step++;
 		if (detect_step > 5) {
@@ -1577,6 +1878,9 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 	int ph1, ph2, ph3;
 	int ph1_raw, ph2_raw, ph3_raw;
 
+	static bool cc_running = false;
+	static float cc_i_term = 0.0;
+
 	static int direction_before = 1;
 	if (state == MC_STATE_RUNNING && direction == direction_before) {
 		cycles_running++;
@@ -1649,7 +1953,8 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 					// produce any torque because of misalignment at start, two
 					// commutations ahead should produce full torque.
 					commutate(2);
-				} else if (conf.comm_mode == COMM_MODE_DELAY) {
+				} else if (conf.comm_mode == COMM_MODE_DELAY ||
+						conf.comm_mode == COMM_MODE_ZERO_CROSSING) {
 					commutate(1);
 				}
 
@@ -1706,12 +2011,12 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 			if (conf.comm_mode == COMM_MODE_INTEGRATE) {
 				float limit;
 				if (has_commutated) {
-					limit = rpm_dep.cycle_int_limit_running * (0.0005 * VDIV_CORR);
+					limit = rpm_dep.cycle_int_limit_running * MCPWM_CYCLE_INT_SCALE;
 				} else {
-					limit = rpm_dep.cycle_int_limit * (0.0005 * VDIV_CORR);
+					limit = rpm_dep.cycle_int_limit * MCPWM_CYCLE_INT_SCALE;
 				}
 
-				if (cycle_integrator >= (rpm_dep.cycle_int_limit_max * (0.0005 * VDIV_CORR)) ||
+				if (cycle_integrator >= (rpm_dep.cycle_int_limit_max * MCPWM_CYCLE_INT_SCALE) ||
 						cycle_integrator >= limit) {
 					commutate(1);
 					cycle_integrator = 0.0;
@@ -1725,7 +2030,7 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 							conf.sl_cycle_int_rpm_br, rpm_dep.comm_time_sum / 2.0,
 							(rpm_dep.comm_time_sum / 2.0) * conf.sl_phase_advance_at_br)) {
 						commutate(1);
-						cycle_integrator_sum += cycle_integrator * (1.0 / (0.0005 * VDIV_CORR));
+						cycle_integrator_sum += cycle_integrator * (1.0 / MCPWM_CYCLE_INT_SCALE);
 						cycle_integrator_iterations += 1.0;
 						cycle_integrator = 0.0;
 						cycle_sum = 0.0;
@@ -1734,6 +2039,86 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 					cycle_integrator = 0.0;
 					cycle_sum = 0.0;
 				}
+			} else if (conf.comm_mode == COMM_MODE_ZERO_CROSSING) {
+				// Find the zero crossing of the floating phase and schedule the
+				// commutation 30 degrees later with TIM2, which counts in us
+				// since the last commutation.
+				static int zc_step = 0;
+				static int zc_v_last = 0;
+				static uint32_t zc_t_last = 0;
+				static float zc_t_this = -1.0;
+				static float zc_t_prev = -1.0;
+				static bool zc_clamped = false;
+				static int zc_fallbacks = 0;
+
+				const uint32_t t_now = TIM2->CNT;
+
+				if (zc_step != comm_step) {
+					zc_step = comm_step;
+					zc_t_prev = zc_t_this;
+					zc_t_this = -1.0;
+					zc_v_last = 0;
+					zc_clamped = false;
+				}
+
+				cycle_integrator = 0.0;
+
+				// Skip samples where the floating phase is clamped to a rail by
+				// the freewheeling current after the commutation.
+				const bool clamped = ph_now_raw <= 100 ||
+						ph_now_raw >= (ADC_Value[ADC_IND_VIN_SENS] - 100);
+
+				if (zc_t_this < 0.0 && clamped && zc_v_last == 0) {
+					zc_clamped = true;
+				}
+
+				if (zc_t_this < 0.0 && v_diff != 0 && !clamped) {
+					if (zc_v_last < 0 && v_diff > 0) {
+						// Interpolate between the two samples around the crossing
+						zc_t_this = (float)zc_t_last + (float)(t_now - zc_t_last) *
+								(float)(-zc_v_last) / (float)(v_diff - zc_v_last);
+						zc_fallbacks = 0;
+					} else if (zc_v_last == 0 && v_diff > 0 && zc_clamped &&
+							zc_t_prev >= 0.0 && fabsf(rpm_now) > MCPWM_ZC_FALLBACK_MIN_ERPM &&
+							zc_fallbacks < MCPWM_ZC_FALLBACK_MAX) {
+						// At high ERPM a step has few samples, and the crossing
+						// can be hidden by the clamped samples after the
+						// commutation. Keep the timing of the previous step if
+						// its crossing fits, otherwise take the crossing at this
+						// sample. Only a few steps in a row are timed like this,
+						// so that the motor does not run open loop.
+						if (zc_t_prev < (float)t_now) {
+							zc_t_this = zc_t_prev;
+						} else {
+							zc_t_this = (float)t_now;
+						}
+						zc_fallbacks++;
+					}
+
+					if (zc_t_this >= 0.0) {
+						float period;
+						if (zc_t_prev >= 0.0 && last_comm_time > 0) {
+							period = (float)last_comm_time - zc_t_prev + zc_t_this;
+						} else {
+							period = 2.0 * zc_t_this;
+						}
+
+						float delay = period * (30.0 - conf.sl_zc_advance) / 60.0;
+						if (delay < 0.0) {
+							delay = 0.0;
+						}
+
+						const uint32_t t_comm = (uint32_t)(zc_t_this + delay);
+						if (t_comm <= (TIM2->CNT + 1)) {
+							commutate(1);
+						} else {
+							zc_schedule(t_comm);
+						}
+					}
+
+					zc_v_last = v_diff;
+					zc_t_last = t_now;
+				}
 			}
 		} else {
 			cycle_integrator = 0.0;
@@ -1811,33 +2196,114 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 		}
 
 		float dutycycle_now_tmp = dutycycle_now;
+		float cc_ff_p = 0.0;
 
 		if (control_mode == CONTROL_MODE_CURRENT) {
+			// Limit arbitration. The current and input current limits are
+			// applied to the set current instead of pulling the duty cycle
+			// against the controller. They are given in the direction of
+			// the motor, while the set current has a fixed direction.
+			const float duty_abs = fabsf(dutycycle_now_tmp) > MCPWM_MIN_DUTY_CYCLE ?
+					fabsf(dutycycle_now_tmp) : MCPWM_MIN_DUTY_CYCLE;
+			float lim_max = conf.lo_current_max;
+			float lim_min = conf.lo_current_min;
+
+			if ((conf.lo_in_current_max / duty_abs) < lim_max) {
+				lim_max = conf.lo_in_current_max / duty_abs;
+			}
+
+			if ((conf.lo_in_current_min / duty_abs) > lim_min) {
+				lim_min = conf.lo_in_current_min / duty_abs;
+			}
+
+			if (!direction) {
+				const float tmp = lim_max;
+				lim_max = -lim_min;
+				lim_min = -tmp;
+			}
+
+			// No torque that accelerates the motor further past the ERPM limits.
+			// With l_rpm_lim_neg_torque the motor is also braked back towards
+			// the limit, even when a braking current is set, like the duty
+			// cycle limiter does in the other modes.
+			if (rpm > conf.l_max_erpm) {
+				float lim = 0.0;
+				if (conf.l_rpm_lim_neg_torque) {
+					lim = -(rpm - conf.l_max_erpm) * MCPWM_RPM_LIMIT_CURRENT_GAIN;
+					if (lim < lim_min) {
+						lim = lim_min;
+					}
+				}
+
+				if (lim_max > lim) {
+					lim_max = lim;
+				}
+			} else if (rpm < conf.l_min_erpm) {
+				float lim = 0.0;
+				if (conf.l_rpm_lim_neg_torque) {
+					lim = (conf.l_min_erpm - rpm) * MCPWM_RPM_LIMIT_CURRENT_GAIN;
+					if (lim > lim_max) {
+						lim = lim_max;
+					}
+				}
+
+				if (lim_min < lim) {
+					lim_min = lim;
+				}
+			}
+
+			float current_set_lim = current_set;
+			utils_truncate_number(&current_set_lim, lim_min, lim_max);
+
 			// Compute error
-			const float error = current_set - (direction ? current_nofilter : -current_nofilter);
-			float step = error * conf.cc_gain * voltage_scale;
+			const float error = current_set_lim - (direction ? current_nofilter : -current_nofilter);
 			const float start_boost = conf.cc_startup_boost_duty / voltage_scale;
 
+			// Back-emf feed-forward from the measured KV
+			const float kv = fabsf(kv_filtered_now);
+			const float ff = kv > 1.0 ? rpm / (kv * input_voltage) : 0.0;
+
+			// Switching frequency correction. Both gains are given for
+			// 1 kHz, like the other ramping steps.
+			const float freq_corr = switching_frequency_now / 1000.0;
+
+			const float p_term = error * conf.cc_kp * voltage_scale / freq_corr;
+			float i_step = error * conf.cc_gain * voltage_scale;
+
 			// Do not ramp too much
-			utils_truncate_number(&step, -MCPWM_RAMP_STEP_CURRENT_MAX,
+			utils_truncate_number(&i_step, -MCPWM_RAMP_STEP_CURRENT_MAX,
 					MCPWM_RAMP_STEP_CURRENT_MAX);
 
-			// Switching frequency correction
-			step /= switching_frequency_now / 1000.0;
+			i_step /= freq_corr;
 
 			if (slow_ramping_cycles) {
 				slow_ramping_cycles--;
-				step *= 0.1;
+				i_step *= 0.1;
+			}
+
+			// Start bumpless from the duty cycle the motor is running at
+			if (!cc_running) {
+				cc_i_term = dutycycle_now_tmp - ff - p_term;
+				cc_running = true;
 			}
 
 			// Optionally apply startup boost.
 			if (fabsf(dutycycle_now_tmp) < start_boost) {
 				utils_step_towards(&dutycycle_now_tmp,
-						current_set > 0.0 ?
+						current_set_lim > 0.0 ?
 								start_boost :
 								-start_boost, ramp_step);
+				cc_i_term = dutycycle_now_tmp - ff - p_term;
 			} else {
-				dutycycle_now_tmp += step;
+				// Conditional integration. Don't integrate further into
+				// saturation, only out of it.
+				const float output = ff + p_term + cc_i_term;
+				if (!(output >= MCPWM_MAX_DUTY_CYCLE && i_step > 0.0) &&
+						!(output <= -MCPWM_MAX_DUTY_CYCLE && i_step < 0.0)) {
+					cc_i_term += i_step;
+				}
+
+				dutycycle_now_tmp = ff + p_term + cc_i_term;
 			}
 
 			// Upper truncation
@@ -1845,13 +2311,15 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 
 			// Lower truncation
 			if (fabsf(dutycycle_now_tmp) < MCPWM_MIN_DUTY_CYCLE) {
-				if (dutycycle_now_tmp < 0.0 && current_set > 0.0) {
+				if (dutycycle_now_tmp < 0.0 && current_set_lim > 0.0) {
 					dutycycle_now_tmp = MCPWM_MIN_DUTY_CYCLE;
-				} else if (dutycycle_now_tmp > 0.0 && current_set < 0.0) {
+				} else if (dutycycle_now_tmp > 0.0 && current_set_lim < 0.0) {
 					dutycycle_now_tmp = -MCPWM_MIN_DUTY_CYCLE;
 				}
 			}
 
+			cc_ff_p = ff + p_term;
+
 			// The set dutycycle should be in the correct direction in case the output is lower
 			// than the minimum duty cycle and the mechanism below gets activated.
 			dutycycle_set = dutycycle_now_tmp >= 0.0 ? MCPWM_MIN_DUTY_CYCLE : -MCPWM_MIN_DUTY_CYCLE;
@@ -1891,10 +2359,17 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 			utils_step_towards((float*)&dutycycle_now_tmp, dutycycle_set, ramp_step);
 		}
 
+		if (control_mode != CONTROL_MODE_CURRENT) {
+			cc_running = false;
+		}
+
 		static int limit_delay = 0;
 
-		// Apply limits in priority order
-		if (current_nofilter > conf.lo_current_max) {
+		// Apply limits in priority order. The current controller applies them to
+		// its set current, so its output is used directly.
+		if (control_mode == CONTROL_MODE_CURRENT) {
+			limit_delay = 0;
+		} else if (current_nofilter > conf.lo_current_max) {
 			utils_step_towards((float*) &dutycycle_now, 0.0,
 					ramp_step_no_lim * fabsf(current_nofilter - conf.lo_current_max) * MCPWM_CURRENT_LIMIT_GAIN);
 			limit_delay = 1;
@@ -1947,7 +2422,16 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 			dutycycle_now = MCPWM_MIN_DUTY_CYCLE;
 		}
 
+		// Keep the current controller integrator at the duty cycle that is
+		// applied after all clipping, so that it does not drift while clipped
+		// and the output does not jump when the clipping releases.
+		if (control_mode == CONTROL_MODE_CURRENT) {
+			cc_i_term = dutycycle_now - cc_ff_p;
+		}
+
 		set_duty_cycle_ll(dutycycle_now);
+	} else {
+		cc_running = false;
 	}
 
 	main_dma_adc_handler();
@@ -1971,9 +2455,93 @@ void mcpwm_set_detect(void) {
 		mcpwm_detect_currents_avg_samples[i] = 0;
 	}
 
+	detect_dc = false;
 	state = MC_STATE_DETECTING;
 }
 
+/**
+ * Hold commutation step 2 with a fixed duty cycle. Current then flows from
+ * phase 1 to phase 3 and is measured by the first current sensor. This can be
+ * used to measure the motor resistance. Like the pulse detection, this is
+ * stopped by any other motor command.
+ *
+ * @param duty
+ * The duty cycle to apply. Calling this again while holding updates it.
+ */
+void mcpwm_set_detect_dc(float duty) {
+	if (!(IS_DETECTING() && detect_dc)) {
+		if (try_input()) {
+			return;
+		}
+
+		control_mode = CONTROL_MODE_NONE;
+		stop_pwm_hw();
+
+		set_switching_frequency(MCPWM_SWITCH_FREQUENCY_MAX);
+
+		detect_dc_curr_sum = 0;
+		detect_dc_samples = 0;
+		detect_dc = true;
+		state = MC_STATE_DETECTING;
+
+		comm_step = 2;
+		set_next_comm_step(2);
+		TIM_GenerateEvent(TIM1, TIM_EventSource_COM);
+	}
+
+	utils_truncate_number(&duty, 0.0, MCPWM_MAX_DUTY_CYCLE);
+	set_duty_cycle_hw(duty);
+}
+
+/**
+ * Read the average current since the last call while holding a step with
+ * mcpwm_set_detect_dc.
+ *
+ * @return
+ * The average current in amperes.
+ */
+float mcpwm_read_reset_detect_dc_current(void) {
+	chSysLock();
+	const int sum = detect_dc_curr_sum;
+	const int samples = detect_dc_samples;
+	detect_dc_curr_sum = 0;
+	detect_dc_samples = 0;
+	chSysUnlock();
+
+	if (samples == 0) {
+		return 0.0;
+	}
+
+	return ((float)sum / (float)samples) * (V_REG / 4095.0) / (CURRENT_SHUNT_RES * CURRENT_AMP_GAIN);
+}
+
+/**
+ * Read the average peak current of the detection pulses since the last
+ * call, over all six commutation steps.
+ *
+ * @return
+ * The average pulse current in amperes.
+ */
+float mcpwm_read_reset_detect_current(void) {
+	float sum = 0.0;
+	float samples = 0.0;
+
+	chSysLock();
+	for(int i = 0;i < 6;i++) {
+		sum += mcpwm_detect_currents_avg[i];
+		samples += mcpwm_detect_currents_avg_samples[i];
+		mcpwm_detect_currents_avg[i] = 0;
+		mcpwm_detect_currents_avg_samples[i] = 0;
+	}
+	chSysUnlock();
+
+	if (samples < 1.0) {
+		return 0.0;
+	}
+
+	return (sum / samples) * (V_REG / 4095.0) / (CURRENT_SHUNT_RES * CURRENT_AMP_GAIN);
+}
+
 float mcpwm_get_detect_pos(void) {
 	float v[6];
 	v[0] = mcpwm_detect_currents_avg[0] / mcpwm_detect_currents_avg_samples[0];
@@ -2064,6 +2632,9 @@ float mcpwm_get_min_rpm(void) {
  * COMM_MODE_INTEGRATE: More robust, but requires many parameters.
  * COMM_MODE_DELAY: Like most hobby ESCs. Requires less parameters,
  * but has worse startup and is less robust.
+ * COMM_MODE_ZERO_CROSSING: Commutate sl_zc_advance degrees before 30 degrees
+ * after the back-emf zero crossing, timed with TIM2. Gives finer timing than
+ * the other modes at high ERPM.
  *
  */
 void mcpwm_set_comm_mode(mc_comm_mode mode) {
@@ -2082,6 +2653,58 @@ float mcpwm_get_last_inj_adc_isr_duration(void) {
 	return last_inj_adc_isr_duration;
 }
 
+/**
+ * Get the number of DRV8302 faults that cleared within
+ * MCPWM_DRV_FAULT_LATCH_TIME since startup.
+ *
+ * @return
+ * The number of transient faults.
+ */
+int mcpwm_get_drv_faults_transient(void) {
+	return drv_faults_transient;
+}
+
+/**
+ * Get the number of DRV8302 faults that lasted longer than
+ * MCPWM_DRV_FAULT_LATCH_TIME since startup.
+ *
+ * @return
+ * The number of latched faults.
+ */
+int mcpwm_get_drv_faults_latched(void) {
+	return drv_faults_latched;
+}
+
+/**
+ * Get the current offsets as tracked in the background.
+ *
+ * @param curr0
+ * Pointer to store the offset of the first current sensor in ADC counts.
+ *
+ * @param curr1
+ * Pointer to store the offset of the second current sensor in ADC counts.
+ */
+void mcpwm_get_current_offsets(float *curr0, float *curr1) {
+	*curr0 = offset_track0;
+	*curr1 = offset_track1;
+}
+
+/**
+ * Get how much the current offsets have drifted since the calibration at
+ * startup.
+ *
+ * @param curr0
+ * Pointer to store the drift of the first current sensor in amperes.
+ *
+ * @param curr1
+ * Pointer to store the drift of the second current sensor in amperes.
+ */
+void mcpwm_get_current_offset_drift(float *curr0, float *curr1) {
+	const float fac = (V_REG / 4095.0) / (CURRENT_SHUNT_RES * CURRENT_AMP_GAIN);
+	*curr0 = (offset_track0 - offset_cal0) * fac;
+	*curr1 = (offset_track1 - offset_cal1) * fac;
+}
+
 mc_rpm_dep_struct mcpwm_get_rpm_dep(void) {
 	return rpm_dep;
 }
@@ -2249,8 +2872,9 @@ static void update_rpm_tacho(void) {
 	}
 
 	if (tacho_diff != 0) {
+		last_comm_time = TIM2->CNT;
 		rpm_dep.comms += tacho_diff;
-		rpm_dep.time_at_comm += TIM2->CNT;
+		rpm_dep.time_at_comm += last_comm_time;
 		TIM2->CNT = 0;
 	}
 
@@ -2266,6 +2890,9 @@ static void update_rpm_tacho(void) {
 }
 
 static void commutate(int steps) {
+	// TIM2 restarts, so a commutation scheduled on it is not valid anymore
+	zc_cancel();
+
 	if (conf.sl_is_sensorless) {
 		last_pwm_cycles_sum = pwm_cycles_sum;
 		last_pwm_cycles_sums[comm_step - 1] = pwm_cycles_sum;
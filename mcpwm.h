@@ -64,6 +64,9 @@ float mcpwm_get_tot_current_in(void);
 float mcpwm_get_tot_current_in_filtered(void);
 void mcpwm_set_detect(void);
 float mcpwm_get_detect_pos(void);
+void mcpwm_set_detect_dc(float duty);
+float mcpwm_read_reset_detect_dc_current(void);
+float mcpwm_read_reset_detect_current(void);
 signed int mcpwm_read_hall_phase(void);
 float mcpwm_read_reset_avg_motor_current(void);
 float mcpwm_read_reset_avg_input_current(void);
@@ -75,9 +78,16 @@ mc_comm_mode mcpwm_get_comm_mode(void);
 float mcpwm_get_last_adc_isr_duration(void);
 float mcpwm_get_last_inj_adc_isr_duration(void);
 mc_rpm_dep_struct mcpwm_get_rpm_dep(void);
+int mcpwm_get_drv_faults_transient(void);
+int mcpwm_get_drv_faults_latched(void);
+void mcpwm_get_current_offsets(float *curr0, float *curr1);
+void mcpwm_get_current_offset_drift(float *curr0, float *curr1);
 
 // Interrupt handlers
 void mcpwm_adc_inj_int_handler(void);
+void mcpwm_adc_awd_int_handler(void);
+void mcpwm_drv_fault_int_handler(void);
+void mcpwm_zc_timer_int_handler(void);
 void mcpwm_adc_int_handler(void *p, uint32_t flags);
 
 // External variables
@@ -99,9 +109,20 @@ extern volatile int mcpwm_vzero;
 #define MCPWM_RAMP_STEP					0.01	// Ramping step (1000 times/sec) at maximum duty cycle
 #define MCPWM_RAMP_STEP_CURRENT_MAX		0.04	// Maximum ramping step (1000 times/sec) for the current control
 #define MCPWM_RAMP_STEP_RPM_LIMIT		0.0005	// Ramping step when limiting the RPM
+#define MCPWM_CYCLE_INT_SCALE			(0.0005 * VDIV_CORR) // Scaling from the cycle integrator limits to the integrated ADC counts
+#define MCPWM_RPM_LIMIT_CURRENT_GAIN	0.01	// Braking current in A per ERPM past the limit in current mode with l_rpm_lim_neg_torque
 #define MCPWM_CURRENT_LIMIT_GAIN		2.0		// The error gain of the current limiting algorithm
 #define MCPWM_CMD_STOP_TIME				0		// Ignore commands for this duration in msec after a stop has been sent
 #define MCPWM_DETECT_STOP_TIME			500		// Ignore commands for this duration in msec after a detect command
+#define MCPWM_DETECT_DUTY				0.2		// Duty cycle of the detection pulses
+#define MCPWM_DRV_FAULT_LATCH_TIME		10		// DRV8302 faults that last longer than this in msec are counted as latched
+#define MCPWM_OFFSET_TRACK_SETTLE_TIME	500		// Wait this long in msec after the motor stops before tracking the current offsets
+#define MCPWM_OFFSET_TRACK_SAMPLES		4000	// Number of current samples per offset tracking block
+#define MCPWM_OFFSET_TRACK_MAX_DEV		60		// Current samples further than this from the offset in ADC counts are rejected
+#define MCPWM_OFFSET_TRACK_GAIN			0.05	// Weight of each block in the incremental offset average
+#define MCPWM_OFFSET_TRACK_MAX_ERPM		100.0	// Only track the current offsets below this speed, so that coasting currents are not included
+#define MCPWM_ZC_FALLBACK_MIN_ERPM		20000.0	// Above this ERPM a zero crossing hidden by the clamped samples is estimated
+#define MCPWM_ZC_FALLBACK_MAX			2		// Maximum number of estimated zero crossings in a row
 
 // Speed PID parameters
 #define MCPWM_PID_TIME_K				0.001	// Pid controller sample time in seconds
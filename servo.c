@@ -25,6 +25,7 @@
 #include "servo.h"
 #include <stdarg.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include "ch.h"
 #include "hal.h"
@@ -47,6 +48,7 @@ static volatile signed char int_index;
 static volatile signed char servo_int_index;
 static volatile signed char masks_ports_index;
 static volatile unsigned char driver_active;
+static volatile unsigned char use_timer;
 static volatile unsigned int delays[SERVOS_NUM + 1];
 static volatile unsigned char same_pos[SERVOS_NUM + 1];
 static volatile unsigned char same_bits[SERVOS_NUM + 1];
@@ -66,6 +68,17 @@ static msg_t servo_thread(void *arg);
 static void servo_get_copy(SERVO *a);
 static void servo_init_timer(void);
 static void servo_start_pulse(void);
+#if USE_COMMANDS
+static void servo_run_commands(void);
+static float servo_traj_min_time(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, float vel_max);
+static void servo_traj_plan(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, float time, float vel_max);
+static float servo_traj_step(volatile SERVO_CMD *cmd);
+#endif
+#ifdef HW_SERVO_TIM
+static bool servo_timer_available(void);
+static void servo_init_pwm_timer(void);
+static void servo_update_pwm_timer(void);
+#endif
 
 /*
  * HW-specific START
@@ -112,13 +125,115 @@ static void servo_init_timer(void) {
 	NVIC_Init(&NVIC_InitStructure);
 }
 
-void servo_init(void) {
-	hw_setup_servo_outputs();
+#ifdef HW_SERVO_TIM
+/*
+ * The hardware PWM backend can be used if all servos are on channels of
+ * HW_SERVO_TIM.
+ */
+static bool servo_timer_available(void) {
+	for (int i = 0;i < SERVOS_NUM;i++) {
+		if (servos[i].tim_ch < 1 || servos[i].tim_ch > 4) {
+			return false;
+		}
+	}
+
+	return true;
+}
 
-	for (int i = 0; i < SERVOS_NUM; i++) {
-		palSetPadMode(servos[i].gpio, servos[i].pin, PAL_MODE_OUTPUT_PUSHPULL |
+static void servo_init_pwm_timer(void) {
+	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+	TIM_OCInitTypeDef  TIM_OCInitStructure;
+
+	RCC_APB1PeriphClockCmd(HW_SERVO_TIM_RCC, ENABLE);
+
+	// One timer period is one servo period
+	TIM_TimeBaseStructure.TIM_Period = SERVO_START_OFFSET + SERVO_PULSE_CNT + SERVO_COOLDOWN_FACTOR - 1;
+	TIM_TimeBaseStructure.TIM_Prescaler = (uint16_t) ((SYSTEM_CORE_CLOCK / 2) / SERVO_CNT_SPEED) - 1;
+	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseInit(HW_SERVO_TIM, &TIM_TimeBaseStructure);
+
+	TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
+	TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Enable;
+	TIM_OCInitStructure.TIM_Pulse = 0;
+	TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
+
+	for (int i = 0;i < SERVOS_NUM;i++) {
+		palSetPadMode(servos[i].gpio, servos[i].pin, PAL_MODE_ALTERNATE(HW_SERVO_TIM_AF) |
 				PAL_STM32_OSPEED_HIGHEST);
-		palClearPad(servos[i].gpio, servos[i].pin);
+
+		switch (servos[i].tim_ch) {
+		case 1:
+			TIM_OC1Init(HW_SERVO_TIM, &TIM_OCInitStructure);
+			TIM_OC1PreloadConfig(HW_SERVO_TIM, TIM_OCPreload_Enable);
+			break;
+
+		case 2:
+			TIM_OC2Init(HW_SERVO_TIM, &TIM_OCInitStructure);
+			TIM_OC2PreloadConfig(HW_SERVO_TIM, TIM_OCPreload_Enable);
+			break;
+
+		case 3:
+			TIM_OC3Init(HW_SERVO_TIM, &TIM_OCInitStructure);
+			TIM_OC3PreloadConfig(HW_SERVO_TIM, TIM_OCPreload_Enable);
+			break;
+
+		case 4:
+			TIM_OC4Init(HW_SERVO_TIM, &TIM_OCInitStructure);
+			TIM_OC4PreloadConfig(HW_SERVO_TIM, TIM_OCPreload_Enable);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	servo_update_pwm_timer();
+
+	TIM_ARRPreloadConfig(HW_SERVO_TIM, ENABLE);
+	TIM_Cmd(HW_SERVO_TIM, ENABLE);
+}
+
+/*
+ * Write the pulse lengths to the compare registers. The preload makes
+ * sure that they are applied at the start of the next period.
+ */
+static void servo_update_pwm_timer(void) {
+	volatile uint32_t *ccr = &HW_SERVO_TIM->CCR1;
+
+	for (int i = 0;i < SERVOS_NUM;i++) {
+		ccr[servos[i].tim_ch - 1] = SERVO_START_OFFSET + ACTUAL_CNT(servos[i]);
+	}
+}
+#endif
+
+/**
+ * Initialize the servo driver.
+ *
+ * @param allow_timer
+ * Use the hardware timer PWM backend if the hardware supports it. Set this
+ * to false if HW_SERVO_TIM is used for something else, e.g. servo decoding.
+ * Otherwise, or if it is not supported, the pulses are generated in
+ * software with TIM7.
+ */
+void servo_init(bool allow_timer) {
+	hw_setup_servo_outputs();
+
+	use_timer = 0;
+#ifdef HW_SERVO_TIM
+	if (allow_timer && servo_timer_available()) {
+		use_timer = 1;
+	}
+#else
+	(void)allow_timer;
+#endif
+
+	if (!use_timer) {
+		for (int i = 0; i < SERVOS_NUM; i++) {
+			palSetPadMode(servos[i].gpio, servos[i].pin, PAL_MODE_OUTPUT_PUSHPULL |
+					PAL_STM32_OSPEED_HIGHEST);
+			palClearPad(servos[i].gpio, servos[i].pin);
+		}
 	}
 
 	int_index = 0;
@@ -128,13 +243,24 @@ void servo_init(void) {
 	unsigned char i;
 	for (i = 0; i < SERVOS_NUM; i++) {
 		commands[i].active = 0;
-		commands[i].last = 0;
+		commands[i].target = servos[i].pos;
+		commands[i].vel_max = SERVO_DEF_VEL_MAX;
+		commands[i].acc_max = SERVO_DEF_ACC_MAX;
 	}
 #endif
 
 	chThdCreateStatic(servo_thread_wa, sizeof(servo_thread_wa), NORMALPRIO, servo_thread, NULL);
 
+#ifdef HW_SERVO_TIM
+	if (use_timer) {
+		servo_init_pwm_timer();
+	} else {
+		servo_init_timer();
+	}
+#else
 	servo_init_timer();
+#endif
+
 	driver_active = 1;
 }
 
@@ -152,8 +278,18 @@ void servo_stop_driver(void) {
 	// Disable clock
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOC, DISABLE);
 
+#ifdef HW_SERVO_TIM
+	if (use_timer) {
+		TIM_Cmd(HW_SERVO_TIM, DISABLE);
+		RCC_APB1PeriphClockCmd(HW_SERVO_TIM_RCC, DISABLE);
+	} else {
+		TIM_Cmd(TIM7, DISABLE);
+		RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM7, DISABLE);
+	}
+#else
 	TIM_Cmd(TIM7, DISABLE);
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM7, DISABLE);
+#endif
 
 	driver_active = 0;
 }
@@ -218,7 +354,28 @@ static msg_t servo_thread(void *arg) {
 
 	servo_tp = chThdSelf();
 
+#ifdef HW_SERVO_TIM
+	systime_t time = chTimeNow();
+#endif
+
 	for(;;) {
+#ifdef HW_SERVO_TIM
+		if (use_timer) {
+			// The timer generates the pulses, so only the commands have to
+			// run and the compare registers have to be updated.
+			time += MS2ST(SERVO_PERIOD_TIME_MS);
+			chThdSleepUntil(time);
+
+			if (driver_active) {
+#if USE_COMMANDS
+				servo_run_commands();
+#endif
+				servo_update_pwm_timer();
+			}
+			continue;
+		}
+#endif
+
 		chEvtWaitAny((eventmask_t) 1);
 
 #if TEST_CYCLE_TIME
@@ -231,7 +388,8 @@ static msg_t servo_thread(void *arg) {
 		servo_get_copy(sorted_servos);
 		qsort(sorted_servos, sorted_servos_len, servo_struct_size, servo_cmp_by_pos);
 
-		delays[0] = ACTUAL_POS(sorted_servos[0]) * SERVO_CPU_FACTOR;
+		unsigned int group_cnt = ACTUAL_CNT(sorted_servos[0]);
+		delays[0] = group_cnt;
 		masks[0] = _BV(sorted_servos[0].pin);
 		ports[0] = sorted_servos[0].gpio;
 
@@ -245,7 +403,7 @@ static msg_t servo_thread(void *arg) {
 		i = 0;
 
 		for(;;) {
-			while (ACTUAL_POS(sorted_servos[j]) == ACTUAL_POS(sorted_servos[j - 1]) && j < SERVOS_NUM) {
+			while (j < SERVOS_NUM && (ACTUAL_CNT(sorted_servos[j]) - group_cnt) < SERVO_MIN_DELAY_CNT) {
 				if (sorted_servos[j].gpio == sorted_servos[j - 1].gpio) {
 					masks[k] |= _BV(sorted_servos[j].pin);
 					same_bits[k]++;
@@ -261,7 +419,9 @@ static msg_t servo_thread(void *arg) {
 			i++;
 
 			if (j < SERVOS_NUM) {
-				delays[i] = (ACTUAL_POS(sorted_servos[j]) - ACTUAL_POS(sorted_servos[j - 1])) * SERVO_CPU_FACTOR;
+				unsigned int cnt = ACTUAL_CNT(sorted_servos[j]);
+				delays[i] = cnt - group_cnt;
+				group_cnt = cnt;
 				ports[++k] = sorted_servos[j].gpio;
 				masks[k] = _BV(sorted_servos[j].pin);
 				j++;
@@ -273,189 +433,349 @@ static msg_t servo_thread(void *arg) {
 		/*                                                                            |
 		 * Add a few extra cycles here to make sure the interrupt is able to finish. \|/
 		 */
-		delays[i] = (ACTUAL_POS(sorted_servos[SERVOS_NUM - 1])) * SERVO_CPU_FACTOR + 120;
+		delays[i] = ACTUAL_CNT(sorted_servos[SERVOS_NUM - 1]) + 120;
 		length = i;
 
 #if USE_COMMANDS
-		/*
-		 * Run the commands for the servos here.
-		 */
-		for (i = 0;i < SERVOS_NUM;i++) {
-			if (commands[i].active) {
-				signed short p = commands[i].pos, ps = servos[i].pos;
-
-				if (p == ps) {
-					commands[i].active = 0;
-					commands[i].last = 0;
-					continue;
-				}
+		servo_run_commands();
+#endif
 
-				commands[i].last += commands[i].speed;
-				signed short delta = commands[i].last >> 5;
+#if TEST_CYCLE_TIME
+		restart_cnt = SERVO_CNT - pwm_start;
+#endif
 
-				if (p < ps) {
-					servos[i].pos -= delta;
-					if (delta > (ps - p)) {
-						servos[i].pos = p;
-					}
-				} else {
-					servos[i].pos += delta;
-					if (delta > (p - ps)) {
-						servos[i].pos = p;
-					}
-				}
+		int_index = -1;
+	}
 
-				//if (delta > 0) {
-				//	commands[i].last = 0;
-				//}
-				commands[i].last -= delta << 5;
-			}
+	return 0;
+}
+
+#if USE_COMMANDS
+/*
+ * Run the commands for the servos. Called once every servo period.
+ */
+static void servo_run_commands(void) {
+	unsigned short i;
+
+	for (i = 0;i < SERVOS_NUM;i++) {
+		chSysLock();
+		if (commands[i].active) {
+			servos[i].pos = (servo_pos_t)(servo_traj_step(&commands[i]) + 0.5);
 		}
+		chSysUnlock();
+	}
 
-		cmd_counter++;
+	cmd_counter++;
 
-		if (cmd_counter == cmd_time_to_run && cmd_seq_running) {
-			signed short tmp1 = 0, tmp2 = 0, tmp3 = 0, tmp4 = 0;
+	if (cmd_counter == cmd_time_to_run && cmd_seq_running) {
+		signed short tmp1 = 0, tmp2 = 0, tmp3 = 0, tmp4 = 0;
+		float time;
+		int target;
 
-			while (cmd_seq_running) {
-				switch (cmd_seq[cmd_ptr++]) {
-				case CMD_MOVE_SERVO:
-					tmp1 = cmd_seq[cmd_ptr++];
-					tmp2 = cmd_seq[cmd_ptr++];
-					tmp3 = cmd_seq[cmd_ptr++];
-
-					if (tmp3 == 0) {
-						commands[tmp1].active = 0;
-						servos[tmp1].pos = tmp2;
-					} else {
-						commands[tmp1].speed = tmp3;
-						commands[tmp1].pos = tmp2;
-						commands[tmp1].active = 1;
-					}
-					break;
+		while (cmd_seq_running) {
+			switch (cmd_seq[cmd_ptr++]) {
+			case CMD_MOVE_SERVO:
+				tmp1 = cmd_seq[cmd_ptr++];
+				tmp2 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+				servo_move(tmp1, tmp2, tmp3);
+				break;
 
-				case CMD_MOVE_SERVO_REL:
+			case CMD_MOVE_SERVO_REL:
+				tmp1 = cmd_seq[cmd_ptr++];
+				tmp2 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+
+				// Relative to the target of the last movement
+				target = (int)commands[tmp1].target + (int)tmp2 * 257;
+				target = MAX(MIN(target, SERVO_POS_MAX), 0);
+
+				if (tmp3 == 0) {
+					chSysLock();
+					commands[tmp1].active = 0;
+					commands[tmp1].target = target;
+					servos[tmp1].pos = target;
+					chSysUnlock();
+				} else {
+					servo_traj_plan(tmp1, target, SERVO_TRAJ_TRAPEZOIDAL, 0.0,
+							(float)tmp3 * 257.0 / 32.0 / SERVO_PERIOD_TIME_S);
+				}
+				break;
+
+			case CMD_MOVE_MULTIPLE_SERVOS:
+				tmp4 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+
+				for (i = 0; i < tmp4; i++) {
 					tmp1 = cmd_seq[cmd_ptr++];
 					tmp2 = cmd_seq[cmd_ptr++];
-					tmp3 = cmd_seq[cmd_ptr++];
-
-					if (tmp3 == 0) {
-						commands[tmp1].active = 0;
-						servos[tmp1].pos += tmp2;
-					} else {
-						commands[tmp1].speed = tmp3;
-						commands[tmp1].pos += tmp2;
-						commands[tmp1].active = 1;
-					}
-					break;
-
-				case CMD_MOVE_MULTIPLE_SERVOS:
-					tmp4 = cmd_seq[cmd_ptr++];
-					tmp3 = cmd_seq[cmd_ptr++];
 
-					for (i = 0; i < tmp4; i++) {
-						tmp1 = cmd_seq[cmd_ptr++];
-						tmp2 = cmd_seq[cmd_ptr++];
+					servo_move_within_time(tmp1, tmp2, tmp3);
+				}
+				break;
 
-						servo_move_within_time(tmp1, tmp2, tmp3);
-					}
-					break;
+			case CMD_CENTER_ALL:
+				tmp4 = cmd_seq[cmd_ptr++];
+				for (i = 0;i < SERVOS_NUM;i++) {
+					servo_move_within_time(i, 0, tmp4);
+				}
+				break;
 
-				case CMD_CENTER_ALL:
-					tmp4 = cmd_seq[cmd_ptr++];
-					for (i = 0;i < SERVOS_NUM;i++) {
-						servo_move_within_time(i, 0, tmp4);
-					}
-					break;
+			case CMD_WAIT:
+				cmd_counter = 0;
+				cmd_time_to_run = cmd_seq[cmd_ptr++] * CMD_WAIT_FACTOR;
+				return;
+				break;
 
-				case CMD_WAIT:
+			case CMD_WAIT_SERVO:
+				tmp1 = cmd_seq[cmd_ptr++];
+				if (commands[tmp1].active) {
+					cmd_ptr -= 2;
 					cmd_counter = 0;
-					cmd_time_to_run = cmd_seq[cmd_ptr++] * CMD_WAIT_FACTOR;
-					goto end_cmds;
-					break;
+					cmd_time_to_run = 1;
+					return;
+				}
+				break;
 
-				case CMD_WAIT_SERVO:
-					tmp1 = cmd_seq[cmd_ptr++];
+			case CMD_WAIT_ALL_SERVOS:
+				for (tmp1 = 0; tmp1 < SERVOS_NUM; tmp1++) {
 					if (commands[tmp1].active) {
-						cmd_ptr -= 2;
+						cmd_ptr--;
 						cmd_counter = 0;
 						cmd_time_to_run = 1;
-						goto end_cmds;
-					}
-					break;
-
-				case CMD_WAIT_ALL_SERVOS:
-					for (tmp1 = 0; tmp1 < SERVOS_NUM; tmp1++) {
-						if (commands[tmp1].active) {
-							cmd_ptr--;
-							cmd_counter = 0;
-							cmd_time_to_run = 1;
-							goto end_cmds;
-						}
+						return;
 					}
-					break;
+				}
+				break;
 
-				case CMD_STOP_DRIVER:
-					servo_stop_cmds();
-					servo_stop_driver();
-					goto end_cmds;
-					break;
+			case CMD_STOP_DRIVER:
+				servo_stop_cmds();
+				servo_stop_driver();
+				return;
+				break;
 
-				case CMD_STOP_CMDS:
-					servo_stop_cmds();
-					goto end_cmds;
-					break;
+			case CMD_STOP_CMDS:
+				servo_stop_cmds();
+				return;
+				break;
+
+			case CMD_RESTART:
+				cmd_ptr = 0;
+				break;
 
-				case CMD_RESTART:
+			case CMD_REPEAT:
+				tmp1 = cmd_seq[cmd_ptr++];
+				cmd_repeat++;
+				if (cmd_repeat < tmp1) {
 					cmd_ptr = 0;
-					break;
+				}
+				break;
 
-				case CMD_REPEAT:
-					tmp1 = cmd_seq[cmd_ptr++];
-					cmd_repeat++;
-					if (cmd_repeat < tmp1) {
-						cmd_ptr = 0;
-					}
-					break;
+			case CMD_MOVE_SERVO_TRAJ:
+				tmp1 = cmd_seq[cmd_ptr++];
+				tmp2 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+				tmp4 = cmd_seq[cmd_ptr++];
+				servo_move_traj(tmp1, (unsigned short)tmp2, tmp3, (unsigned short)tmp4);
+				break;
 
-				default:
-					servo_stop_cmds();
-					goto end_cmds;
-					break;
+			case CMD_MOVE_MULTIPLE_SERVOS_TRAJ:
+				tmp4 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+				time = (float)(unsigned short)cmd_seq[cmd_ptr++] / 1000.0;
+
+				// The slowest servo decides the time for all of them
+				for (i = 0;i < tmp4;i++) {
+					tmp1 = cmd_seq[cmd_ptr + 2 * i];
+					tmp2 = cmd_seq[cmd_ptr + 2 * i + 1];
+					time = MAX(time, servo_traj_min_time(tmp1, (unsigned short)tmp2,
+							tmp3, commands[tmp1].vel_max));
 				}
 
+				for (i = 0;i < tmp4;i++) {
+					tmp1 = cmd_seq[cmd_ptr++];
+					tmp2 = cmd_seq[cmd_ptr++];
+					servo_traj_plan(tmp1, (unsigned short)tmp2, tmp3, time, commands[tmp1].vel_max);
+				}
+				break;
+
+			case CMD_SET_LIMITS:
+				tmp1 = cmd_seq[cmd_ptr++];
+				tmp2 = cmd_seq[cmd_ptr++];
+				tmp3 = cmd_seq[cmd_ptr++];
+				tmp2 = MAX(tmp2, 1);
+				tmp3 = MAX(tmp3, 1);
+				servo_set_limits(tmp1, (float)SERVO_POS_MAX * 1000.0 / (float)tmp2,
+						(float)SERVO_POS_MAX * 1000000.0 / ((float)tmp2 * (float)tmp3));
+				break;
+
+			default:
+				servo_stop_cmds();
+				return;
+				break;
 			}
+		}
+	}
+}
+#endif
 
-			end_cmds: ;
+#if USE_COMMANDS
+/*
+ * Get the shortest time in seconds in which a servo can move to pos without
+ * exceeding its acceleration limit and the velocity limit vel_max.
+ */
+static float servo_traj_min_time(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, float vel_max) {
+	const float dist = fabsf((float)pos - (float)servos[servo].pos);
+	const float acc_max = commands[servo].acc_max;
+
+	switch (type) {
+	case SERVO_TRAJ_SCURVE:
+		// Peak velocity is 1.875 * dist / t and peak acceleration 5.7735 * dist / t^2
+		return MAX(1.875 * dist / vel_max, sqrtf(5.7735 * dist / acc_max));
+
+	case SERVO_TRAJ_TRAPEZOIDAL:
+	default:
+		if (dist * acc_max <= vel_max * vel_max) {
+			// Max velocity is never reached
+			return 2.0 * sqrtf(dist / acc_max);
+		} else {
+			return dist / vel_max + vel_max / acc_max;
 		}
+	}
+}
 
-#endif
+/*
+ * Start a trajectory from the current position to pos. The time is
+ * extended to the shortest possible time if it is too short for the
+ * limits. 0 gives the fastest possible trajectory.
+ */
+static void servo_traj_plan(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, float time, float vel_max) {
+	volatile SERVO_CMD *cmd = &commands[servo];
 
-#if TEST_CYCLE_TIME
-		restart_cnt = SERVO_CNT - pwm_start;
-#endif
+	// The type comes from commands, unknown types are planned as trapezoidal
+	// so that servo_traj_step never uses stale parameters.
+	if (type != SERVO_TRAJ_SCURVE) {
+		type = SERVO_TRAJ_TRAPEZOIDAL;
+	}
 
-		int_index = -1;
+	vel_max = MIN(vel_max, cmd->vel_max);
+
+	chSysLock();
+
+	const float start = servos[servo].pos;
+	const float dist = (float)pos - start;
+	const float dist_abs = fabsf(dist);
+
+	time = MAX(time, servo_traj_min_time(servo, pos, type, vel_max));
+
+	cmd->target = pos;
+
+	if (dist_abs < 1.0 || time <= 0.0) {
+		servos[servo].pos = pos;
+		cmd->active = 0;
+		chSysUnlock();
+		return;
 	}
 
-	return 0;
+	cmd->type = type;
+	cmd->start = start;
+	cmd->dist = dist;
+	cmd->duration = time;
+	cmd->time = 0.0;
+
+	if (type == SERVO_TRAJ_TRAPEZOIDAL) {
+		// Solve dist = vel * (time - vel / acc) for the cruise velocity. The
+		// time is at least the minimum time, so the root exists.
+		const float acc = cmd->acc_max;
+		float root = time * time - 4.0 * dist_abs / acc;
+		if (root < 0.0) {
+			root = 0.0;
+		}
+
+		cmd->vel = 2.0 * dist_abs / (time + sqrtf(root));
+		cmd->acc = acc;
+		cmd->time_acc = cmd->vel / acc;
+	}
+
+	cmd->active = 1;
+
+	chSysUnlock();
+}
+
+/*
+ * Advance a trajectory by one servo period.
+ *
+ * @return
+ * The position on the trajectory.
+ */
+static float servo_traj_step(volatile SERVO_CMD *cmd) {
+	cmd->time += SERVO_PERIOD_TIME_S;
+
+	const float t = cmd->time;
+	const float dist_abs = fabsf(cmd->dist);
+	float x;
+
+	if (t >= cmd->duration) {
+		cmd->active = 0;
+		return cmd->target;
+	}
+
+	switch (cmd->type) {
+	case SERVO_TRAJ_SCURVE: {
+		const float tau = t / cmd->duration;
+		x = dist_abs * tau * tau * tau * (10.0 + tau * (-15.0 + 6.0 * tau));
+		break;
+	}
+
+	case SERVO_TRAJ_TRAPEZOIDAL:
+	default:
+		if (t < cmd->time_acc) {
+			x = 0.5 * cmd->acc * t * t;
+		} else if (t < (cmd->duration - cmd->time_acc)) {
+			x = 0.5 * cmd->vel * cmd->time_acc + cmd->vel * (t - cmd->time_acc);
+		} else {
+			const float t_left = cmd->duration - t;
+			x = dist_abs - 0.5 * cmd->acc * t_left * t_left;
+		}
+		break;
+	}
+
+	x = MIN(x, dist_abs);
+
+	return cmd->dist >= 0.0 ? cmd->start + x : cmd->start - x;
 }
 
-#if USE_COMMANDS
 volatile signed char cmd_seq_running = 0;
 volatile unsigned int cmd_ptr = 0;
 volatile const signed short *cmd_seq;
 
+/**
+ * Move a servo with a given speed.
+ *
+ * @param servo
+ * The servo to move.
+ *
+ * @param position
+ * The 8-bit position, 0 to 255.
+ *
+ * @param speed
+ * The speed in 1/32 8-bit position steps per servo period. 0 to move
+ * immediately.
+ */
 void servo_move(unsigned char servo, signed short position, unsigned char speed) {
+	servo_pos_t pos = SERVO_POS_FROM_8BIT(position);
+
 	if (speed == 0) {
-		servos[servo].pos = position;
+		chSysLock();
+		servos[servo].pos = pos;
+		commands[servo].target = pos;
 		commands[servo].active = 0;
+		chSysUnlock();
 		return;
 	}
 
-	commands[servo].speed = speed;
-	commands[servo].pos = position;
-	commands[servo].active = 1;
+	servo_traj_plan(servo, pos, SERVO_TRAJ_TRAPEZOIDAL, 0.0,
+			(float)speed * 257.0 / 32.0 / SERVO_PERIOD_TIME_S);
 }
 
 void servo_run_cmds(const signed short *cmds) {
@@ -482,18 +802,25 @@ void servo_wait_for_cmds() {
 	while (cmd_seq_running) {}
 }
 
+/**
+ * Move a servo to an 8-bit position within a given time.
+ *
+ * @param servo
+ * The servo to move.
+ *
+ * @param pos
+ * The 8-bit position, 0 to 255.
+ *
+ * @param time_ms
+ * The time for the movement. 0 to move immediately.
+ */
 void servo_move_within_time(unsigned char servo, signed short pos, unsigned short time_ms) {
 	if (time_ms == 0) {
-		servos[servo].pos = pos;
-		commands[servo].active = 0;
+		servo_move(servo, pos, 0);
 		return;
 	}
 
-	unsigned short diff = abs(pos - servos[servo].pos);
-
-	commands[servo].speed = ((diff * SERVO_PERIOD_TIME_MS) << 1) / (time_ms >> 4);
-	commands[servo].pos = pos;
-	commands[servo].active = 1;
+	servo_move_traj(servo, SERVO_POS_FROM_8BIT(pos), SERVO_TRAJ_TRAPEZOIDAL, time_ms);
 }
 
 void servo_move_within_time_multiple(unsigned short time_ms, unsigned short num, ...) {
@@ -510,6 +837,104 @@ void servo_move_within_time_multiple(unsigned short time_ms, unsigned short num,
 	}
 	va_end(arguments);
 }
+
+/**
+ * Set the trajectory limits of a servo.
+ *
+ * @param servo
+ * The servo.
+ *
+ * @param vel_max
+ * The maximum velocity in positions per second.
+ *
+ * @param acc_max
+ * The maximum acceleration in positions per second^2.
+ */
+void servo_set_limits(unsigned char servo, float vel_max, float acc_max) {
+	if (servo >= SERVOS_NUM) {
+		return;
+	}
+
+	chSysLock();
+	commands[servo].vel_max = MAX(vel_max, 1.0);
+	commands[servo].acc_max = MAX(acc_max, 1.0);
+	chSysUnlock();
+}
+
+/**
+ * Move a servo to a 16-bit position along a trajectory.
+ *
+ * @param servo
+ * The servo to move.
+ *
+ * @param pos
+ * The position.
+ *
+ * @param type
+ * The trajectory shape.
+ *
+ * @param time_ms
+ * The time for the movement. It is extended if the limits can't be
+ * met otherwise, so 0 moves as fast as the limits allow.
+ */
+void servo_move_traj(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, unsigned short time_ms) {
+	if (servo >= SERVOS_NUM) {
+		return;
+	}
+
+	servo_traj_plan(servo, pos, type, (float)time_ms / 1000.0, commands[servo].vel_max);
+}
+
+/**
+ * Move multiple servos along trajectories such that they arrive at the
+ * same time. If the time is too short for any of them, all movements are
+ * extended to the time of the slowest one.
+ *
+ * @param type
+ * The trajectory shape.
+ *
+ * @param time_ms
+ * The time for the movement. 0 to move as fast as possible.
+ *
+ * @param num
+ * The number of servos.
+ *
+ * @param servo_ind
+ * The servo indexes.
+ *
+ * @param pos
+ * The positions.
+ */
+void servo_move_traj_multiple(SERVO_TRAJ type, unsigned short time_ms, unsigned short num,
+		const unsigned char *servo_ind, const servo_pos_t *pos) {
+	float time = (float)time_ms / 1000.0;
+
+	for (int i = 0;i < num;i++) {
+		if (servo_ind[i] < SERVOS_NUM) {
+			time = MAX(time, servo_traj_min_time(servo_ind[i], pos[i], type,
+					commands[servo_ind[i]].vel_max));
+		}
+	}
+
+	for (int i = 0;i < num;i++) {
+		if (servo_ind[i] < SERVOS_NUM) {
+			servo_traj_plan(servo_ind[i], pos[i], type, time, commands[servo_ind[i]].vel_max);
+		}
+	}
+}
+
+/**
+ * Check if a servo is following a trajectory.
+ *
+ * @param servo
+ * The servo.
+ *
+ * @return
+ * 1 if the servo is moving, 0 otherwise.
+ */
+unsigned char servo_is_moving(unsigned char servo) {
+	return servo < SERVOS_NUM && commands[servo].active;
+}
 #endif
 
 unsigned char servo_driver_is_active() {
@@ -23,6 +23,10 @@
  *
  *
  * Changelog:
+ * 2014-XX-XX
+ * - 16-bit positions
+ * - Trapezoidal and S-curve trajectories with velocity and acceleration limits
+ *
  * 2013-12-XX
  * - Port to ChibiOS and STM32F4
  * - probably more changes
@@ -49,6 +53,7 @@
 #include "hw.h"
 
 #include "stm32f4xx_conf.h"
+#include <stdbool.h>
 
 #ifndef _BV
 #define _BV(bit) (1 << (bit))
@@ -101,9 +106,32 @@
  * Calculated from F_CPU
  */
 #define SERVO_START_OFFSET		(SERVO_CNT_SPEED / (1000000L / S_STARTPULSE))
-#define SERVO_CPU_FACTOR		((SERVO_CNT_SPEED + ((1000000L / S_PULSELEN) * 256L) - 1L) / ((1000000L / S_PULSELEN) * 256L)) // Round up
+#define SERVO_PULSE_CNT			(SERVO_CNT_SPEED / (1000000L / S_PULSELEN))
 #define SERVO_COOLDOWN_FACTOR	(SERVO_CNT_SPEED / (1000000L / S_COOLDOWN))
 
+/*
+ * Pulses that end closer than this many timer counts to each other are ended
+ * together by the software backend, since the interrupt can't keep up otherwise.
+ */
+#define SERVO_MIN_DELAY_CNT		4
+
+/*
+ * Servo positions have 16 bits of resolution over S_PULSELEN. The output
+ * is quantized to the timer resolution, SERVO_PULSE_CNT steps.
+ */
+typedef uint16_t servo_pos_t;
+#define SERVO_POS_MAX			65535
+#define SERVO_POS_FROM_8BIT(pos)	((servo_pos_t)(MAX(MIN((pos), 255), 0) * 257))
+
+/*
+ * Default trajectory limits.
+ *
+ * SERVO_DEF_VEL_MAX: Positions per second (full range in 0.1s)
+ * SERVO_DEF_ACC_MAX: Positions per second^2 (max velocity in 0.05s)
+ */
+#define SERVO_DEF_VEL_MAX		655350.0
+#define SERVO_DEF_ACC_MAX		13107000.0
+
 /*
  * Compile with commands to mode servos with a specified speed
  * to s specified position interrupt driven. Enabling this will
@@ -125,27 +153,41 @@ extern volatile unsigned int interrupt_cnt;
 #endif
 
 // Servo macros
-#define ACTUAL_POS(servo)			(MAX(MIN(servo.pos + (signed short)servo.offset, 255), 0))
-#define ACTUAL_POS_PTR(servo)		(MAX(MIN(servo->pos + (signed short)servo->offset, 255), 0))
+#define ACTUAL_POS(servo)			(MAX(MIN((int)servo.pos + ((int)servo.offset << 8), SERVO_POS_MAX), 0))
+#define ACTUAL_POS_PTR(servo)		(MAX(MIN((int)servo->pos + ((int)servo->offset << 8), SERVO_POS_MAX), 0))
+#define SERVO_POS_TO_CNT(pos)		(((uint32_t)(pos) * SERVO_PULSE_CNT + SERVO_POS_MAX / 2) / SERVO_POS_MAX)
+#define ACTUAL_CNT(servo)			SERVO_POS_TO_CNT(ACTUAL_POS(servo))
 #define CMD_MS_TO_VAL(ms)			((ms) / (((S_STARTPULSE + S_PULSELEN + S_COOLDOWN) * CMD_WAIT_FACTOR) / 1000))
 #define SERVO_PERIOD_TIME_MS		((S_STARTPULSE + S_PULSELEN + S_COOLDOWN) / 1000)
-
-// Some servo speed defines
-// TODO
+#define SERVO_PERIOD_TIME_S			((float)(S_STARTPULSE + S_PULSELEN + S_COOLDOWN) / 1000000.0)
 
 typedef struct {
-	volatile signed short pos;
+	volatile servo_pos_t pos;
 	volatile unsigned char offset;
 	GPIO_TypeDef* gpio;
 	volatile unsigned int pin;
+	volatile unsigned char tim_ch; // Channel on HW_SERVO_TIM, 0 if none
 } SERVO;
 
 #if USE_COMMANDS
+typedef enum {
+	SERVO_TRAJ_TRAPEZOIDAL = 0,	// Constant acceleration, cruise, constant deceleration
+	SERVO_TRAJ_SCURVE			// Minimum jerk, zero acceleration at both ends
+} SERVO_TRAJ;
+
 typedef struct {
 	volatile signed char active;
-	volatile signed short pos;
-	volatile signed short speed;
-	volatile signed short last;
+	SERVO_TRAJ type;
+	servo_pos_t target;
+	float start;		// Position
+	float dist;			// Signed distance
+	float vel;			// Cruise velocity, trapezoidal only
+	float acc;			// Acceleration, trapezoidal only
+	float time_acc;		// Acceleration time, trapezoidal only
+	float duration;		// Seconds
+	float time;			// Seconds since start
+	float vel_max;		// Positions per second
+	float acc_max;		// Positions per second^2
 } SERVO_CMD;
 
 extern volatile signed char cmd_seq_running;
@@ -166,7 +208,8 @@ extern volatile const signed short *cmd_seq;
  */
 
 /*
- * Move servo to given position with given speed.
+ * Move servo to given position with given speed. The 8-bit commands
+ * use positions from 0 to 255, which are scaled to the full range.
  *
  * Param 1: Servo.
  * Param 2: Position.
@@ -243,11 +286,44 @@ extern volatile const signed short *cmd_seq;
  * Param 1: Number of times to repeat commands.
  */
 #define CMD_REPEAT			10
+
+/*
+ * Move servo to a 16-bit position along a trajectory.
+ *
+ * Param 1: Servo.
+ * Param 2: Position, read as unsigned short.
+ * Param 3: Trajectory type, see SERVO_TRAJ.
+ * Param 4: Time for movement in milliseconds. 0 to move as fast as the
+ * limits allow. The time is extended if the limits can't be met otherwise.
+ */
+#define CMD_MOVE_SERVO_TRAJ		11
+
+/*
+ * Move multiple servos along trajectories such that they arrive at the
+ * same time.
+ *
+ * Param 1: Number of servos.
+ * Param 2: Trajectory type, see SERVO_TRAJ.
+ * Param 3: Time for movement in milliseconds. 0 for as fast as possible.
+ * Param 4: Servo 1 index
+ * Param 5: Servo 1 pos, read as unsigned short
+ * ... and so on
+ */
+#define CMD_MOVE_MULTIPLE_SERVOS_TRAJ	12
+
+/*
+ * Set the trajectory limits of a servo.
+ *
+ * Param 1: Servo.
+ * Param 2: Time in milliseconds to move over the full range at max velocity.
+ * Param 3: Time in milliseconds to accelerate to max velocity.
+ */
+#define CMD_SET_LIMITS			13
 #endif
 
 extern volatile SERVO servos[SERVOS_NUM];
 
-void servo_init(void);
+void servo_init(bool allow_timer);
 void servo_stop_driver(void);
 unsigned char servo_driver_is_active(void);
 void servo_irq(void);
@@ -260,6 +336,11 @@ void servo_reset_pos(unsigned char speed);
 void servo_wait_for_cmds(void);
 void servo_move_within_time(unsigned char servo, signed short pos, unsigned short time_ms);
 void servo_move_within_time_multiple(unsigned short time_ms, unsigned short num, ...);
+void servo_set_limits(unsigned char servo, float vel_max, float acc_max);
+void servo_move_traj(unsigned char servo, servo_pos_t pos, SERVO_TRAJ type, unsigned short time_ms);
+void servo_move_traj_multiple(SERVO_TRAJ type, unsigned short time_ms, unsigned short num,
+		const unsigned char *servo_ind, const servo_pos_t *pos);
+unsigned char servo_is_moving(unsigned char servo);
 #endif
 
 #endif /* SERVO_H_ */
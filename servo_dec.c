@@ -27,46 +27,114 @@
 #include "ch.h"
 #include "hal.h"
 #include "hw.h"
+#include "timesync.h"
 
 /*
  * Settings
  */
-#define SERVO_NUM				1
 #define TIMER_FREQ				1000000
+#define PPM_SUM_SYNC_US			2700	// Periods longer than this separate the PPM-sum frames
+#define PPM_SUM_MIN_US			700		// Shorter periods are glitches
+#define SBUS_BAUDRATE			100000
+#define SBUS_FRAME_LEN			25
+#define SBUS_HEADER				0x0F
+#define SBUS_SYNC_GAP_US		2000	// Minimum idle time before a frame header
+#define SBUS_FLAG_FRAME_LOST		(1 << 2)
+#define SBUS_FLAG_FAILSAFE		(1 << 3)
+#define FILTER_MAX_REJECTS		2		// Accept a step after this many rejected pulses in a row
 
 // Private variables
 static volatile systime_t last_update_time;
-static volatile float servo_pos[SERVO_NUM];
+static volatile uint16_t servo_us[SERVODEC_CHANNELS];
+static volatile int channels = 0;
+static volatile ppm_input_type input_type = PPM_INPUT_PWM;
+static volatile uint16_t pulse_start_us = 1000;
+static volatile uint16_t pulse_width_us = 1000;
 static volatile float pulse_start = 1.0;
 static volatile float pulse_width = 1.0;
+static int ppm_sum_ch = -1;
+static uint8_t sbus_frame[SBUS_FRAME_LEN];
+static uint32_t sbus_last_char = 0;
+
+// Filter state
+static volatile int median_len = 1;
+static volatile uint16_t max_step = 0;
+static uint16_t filter_hist[SERVODEC_CHANNELS][SERVODEC_MEDIAN_MAX];
+static uint8_t filter_hist_pos[SERVODEC_CHANNELS];
+static uint8_t filter_hist_num[SERVODEC_CHANNELS];
+static uint8_t filter_rejects[SERVODEC_CHANNELS];
+static bool filter_init[SERVODEC_CHANNELS];
+
+// Statistics
+static volatile uint32_t stat_frames = 0;
+static volatile uint32_t stat_invalid = 0;
+static volatile uint32_t stat_rejected = 0;
+static volatile uint32_t stat_dropped = 0;
+static volatile uint32_t last_frame_us = 0;
+static volatile uint32_t period_avg = 0;
+static volatile uint32_t period_min = 0xFFFFFFFF;
+static volatile uint32_t period_max = 0;
 
 // Function pointers
 static void(*done_func)(void) = 0;
 
+// Private functions
+static bool filter_channel(int ch, uint16_t us);
+static uint16_t median(const uint16_t *values, int num);
+static void update_done(int num);
+
 static void icuwidthcb(ICUDriver *icup) {
-	float len = ((float)icuGetWidth(icup) / ((float)TIMER_FREQ / 1000.0)) - pulse_start;
+	if (input_type != PPM_INPUT_PWM) {
+		return;
+	}
+
+	const uint16_t width = icuGetWidth(icup);
+	const uint16_t max = pulse_start_us + pulse_width_us;
+
+	uint16_t us = width;
+
+	if (width <= pulse_start_us) {
+		stat_invalid++;
+		return;
+	}
 
-	if (len > pulse_width) {
-		if (len < pulse_width * 1.2) {
-			len = pulse_width;
+	if (width > max) {
+		if (width < pulse_start_us + (pulse_width_us * 6) / 5) {
+			us = max;
 		} else {
 			// Too long pulse. Most likely something is wrong.
-			len = -1.0;
+			stat_invalid++;
+			return;
 		}
 	}
 
-	if (len > 0.0) {
-		servo_pos[0] = (len * 2.0 - pulse_width) / pulse_width;
-		last_update_time = chTimeNow();
-
-		if (done_func) {
-			done_func();
-		}
+	if (filter_channel(0, us)) {
+		update_done(1);
 	}
 }
 
 static void icuperiodcb(ICUDriver *icup) {
-	(void)icup;
+	if (input_type != PPM_INPUT_PPM_SUM) {
+		return;
+	}
+
+	const uint16_t period = icuGetPeriod(icup);
+
+	if (period > PPM_SUM_SYNC_US) {
+		// Sync gap, the previous frame is complete
+		if (ppm_sum_ch > 0) {
+			update_done(ppm_sum_ch);
+		}
+		ppm_sum_ch = 0;
+	} else if (period < PPM_SUM_MIN_US || ppm_sum_ch >= SERVODEC_CHANNELS) {
+		// Glitch, wait for the next sync gap
+		if (ppm_sum_ch >= 0) {
+			stat_invalid++;
+		}
+		ppm_sum_ch = -1;
+	} else if (ppm_sum_ch >= 0) {
+		filter_channel(ppm_sum_ch++, period);
+	}
 }
 
 static ICUConfig icucfg = {
@@ -79,20 +147,106 @@ static ICUConfig icucfg = {
 		0
 };
 
+/*
+ * SBUS frames are received in two steps. The header is received as a single
+ * character after the bus has been idle, and then the rest of the frame is
+ * received with DMA. Frames are decoded in the DMA end callback.
+ */
+static void sbus_rxchar(UARTDriver *uartp, uint16_t c) {
+	const uint32_t now = timesync_get_local_us();
+	const bool after_gap = (now - sbus_last_char) > SBUS_SYNC_GAP_US;
+	sbus_last_char = now;
+
+	if (after_gap && (c & 0xFF) == SBUS_HEADER) {
+		sbus_frame[0] = SBUS_HEADER;
+		chSysLockFromIsr();
+		uartStartReceiveI(uartp, SBUS_FRAME_LEN - 1, sbus_frame + 1);
+		chSysUnlockFromIsr();
+	}
+}
+
+static void sbus_rxend(UARTDriver *uartp) {
+	(void)uartp;
+
+	sbus_last_char = timesync_get_local_us();
+
+	if (sbus_frame[23] & SBUS_FLAG_FRAME_LOST) {
+		stat_dropped++;
+	}
+
+	// Ignore frames sent in failsafe mode and let the timeout stop the motor
+	if (sbus_frame[23] & SBUS_FLAG_FAILSAFE) {
+		stat_invalid++;
+		return;
+	}
+
+	// 16 channels with 11 bits each, LSB first
+	uint32_t bits = 0;
+	int bit_num = 0;
+	int byte = 1;
+
+	for (int i = 0;i < SERVODEC_CHANNELS;i++) {
+		while (bit_num < 11) {
+			bits |= (uint32_t)sbus_frame[byte++] << bit_num;
+			bit_num += 8;
+		}
+
+		// 172 - 1811 maps to about 988 - 2012 us
+		filter_channel(i, 880 + (((bits & 0x7FF) * 5) >> 3));
+		bits >>= 11;
+		bit_num -= 11;
+	}
+
+	update_done(SERVODEC_CHANNELS);
+}
+
+static void sbus_rxerr(UARTDriver *uartp, uartflags_t e) {
+	(void)uartp;
+	(void)e;
+	stat_invalid++;
+}
+
+static UARTConfig sbus_cfg = {
+		0,
+		0,
+		sbus_rxend,
+		sbus_rxchar,
+		sbus_rxerr,
+		SBUS_BAUDRATE,
+		USART_CR1_M | USART_CR1_PCE,
+		USART_CR2_STOP_1, // Two stop bits
+		0
+};
+
 /**
  * Initialize the serve decoding driver.
  *
+ * @param input
+ * The type of input signal. PWM and PPM-sum are decoded on the ICU pin and
+ * SBUS on the UART RX pin. Note that SBUS is inverted and requires an
+ * external inverter.
+ *
  * @param d_func
  * A function that should be called every time the servo signals have been
  * decoded. Can be NULL.
  */
-void servodec_init(void (*d_func)(void)) {
-	icuStart(&ICUD3, &icucfg);
-	palSetPadMode(HW_ICU_GPIO, HW_ICU_PIN, PAL_MODE_ALTERNATE(HW_ICU_GPIO_AF));
-	icuEnable(&ICUD3);
+void servodec_init(ppm_input_type input, void (*d_func)(void)) {
+	input_type = input;
+	channels = 0;
 
 	// Set our function pointer
 	done_func = d_func;
+
+	if (input == PPM_INPUT_SBUS) {
+		uartStart(&HW_UART_DEV, &sbus_cfg);
+		palSetPadMode(HW_UART_RX_PORT, HW_UART_RX_PIN, PAL_MODE_ALTERNATE(HW_UART_GPIO_AF) |
+				PAL_STM32_OSPEED_HIGHEST |
+				PAL_STM32_PUDR_PULLUP);
+	} else {
+		icuStart(&ICUD3, &icucfg);
+		palSetPadMode(HW_ICU_GPIO, HW_ICU_PIN, PAL_MODE_ALTERNATE(HW_ICU_GPIO_AF));
+		icuEnable(&ICUD3);
+	}
 }
 
 /**
@@ -107,23 +261,125 @@ void servodec_init(void (*d_func)(void)) {
 void servodec_set_pulse_options(float start, float width) {
 	pulse_start = start;
 	pulse_width = width;
+	pulse_start_us = (uint16_t)(start * 1000.0);
+	pulse_width_us = (uint16_t)(width * 1000.0);
+}
+
+/**
+ * Configure the filtering of decoded pulses. The filters are applied in the
+ * interrupts on integer microseconds.
+ *
+ * @param median_filter_len
+ * The length of the median filter, at most SERVODEC_MEDIAN_MAX. 1 disables
+ * the filter.
+ *
+ * @param max_pulse_step
+ * The largest accepted change in microseconds between two pulses on a
+ * channel. Larger steps are rejected, unless they persist for more than
+ * FILTER_MAX_REJECTS pulses. 0 disables the check.
+ */
+void servodec_set_filter(int median_filter_len, uint16_t max_pulse_step) {
+	if (median_filter_len < 1) {
+		median_filter_len = 1;
+	} else if (median_filter_len > SERVODEC_MEDIAN_MAX) {
+		median_filter_len = SERVODEC_MEDIAN_MAX;
+	}
+
+	chSysLock();
+	median_len = median_filter_len;
+	max_step = max_pulse_step;
+
+	for (int i = 0;i < SERVODEC_CHANNELS;i++) {
+		filter_hist_pos[i] = 0;
+		filter_hist_num[i] = 0;
+		filter_rejects[i] = 0;
+		filter_init[i] = false;
+	}
+	chSysUnlock();
 }
 
 /**
  * Get a decoded servo value.
  *
  * @param servo_num
- * The servo index. If it is out of range, 0.0 will be returned.
+ * The channel index. If it is out of range, 0.0 will be returned.
  *
  * @return
  * The servo value in the range [-1.0 1.0].
  */
 float servodec_get_servo(int servo_num) {
-	if (servo_num < SERVO_NUM) {
-		return servo_pos[servo_num];
-	} else {
+	if (servo_num < 0 || servo_num >= channels) {
 		return 0.0;
 	}
+
+	float len = ((float)servo_us[servo_num] / 1000.0) - pulse_start;
+
+	if (len < 0.0) {
+		len = 0.0;
+	} else if (len > pulse_width) {
+		len = pulse_width;
+	}
+
+	return (len * 2.0 - pulse_width) / pulse_width;
+}
+
+/**
+ * Get a decoded channel as a pulse length.
+ *
+ * @param servo_num
+ * The channel index. If it is out of range, 0 will be returned.
+ *
+ * @return
+ * The pulse length in microseconds.
+ */
+uint16_t servodec_get_servo_us(int servo_num) {
+	if (servo_num < 0 || servo_num >= channels) {
+		return 0;
+	}
+
+	return servo_us[servo_num];
+}
+
+/**
+ * Get the number of channels in the last decoded frame.
+ *
+ * @return
+ * The number of channels. 1 for PWM input.
+ */
+int servodec_get_channels(void) {
+	return channels;
+}
+
+/**
+ * Get statistics about the decoded signal.
+ *
+ * @param stats
+ * Pointer to store the statistics in.
+ */
+void servodec_get_stats(servodec_stats *stats) {
+	chSysLock();
+	stats->frames = stat_frames;
+	stats->invalid = stat_invalid;
+	stats->rejected = stat_rejected;
+	stats->dropped = stat_dropped;
+	stats->rate = period_avg > 0 ? 1000000 / period_avg : 0;
+	stats->period_min = period_min == 0xFFFFFFFF ? 0 : period_min;
+	stats->period_max = period_max;
+	chSysUnlock();
+}
+
+/**
+ * Reset the signal statistics.
+ */
+void servodec_reset_stats(void) {
+	chSysLock();
+	stat_frames = 0;
+	stat_invalid = 0;
+	stat_rejected = 0;
+	stat_dropped = 0;
+	period_min = 0xFFFFFFFF;
+	period_max = 0;
+	chSysUnlock();
 }
 
 /**
@@ -136,3 +392,86 @@ float servodec_get_servo(int servo_num) {
 uint32_t servodec_get_time_since_update(void) {
 	return chTimeElapsedSince(last_update_time) / (CH_FREQUENCY / 1000);
 }
+
+/*
+ * Run a pulse through the median filter and the step check and store it.
+ * Returns false if the pulse was rejected.
+ */
+static bool filter_channel(int ch, uint16_t us) {
+	if (median_len > 1) {
+		filter_hist[ch][filter_hist_pos[ch]] = us;
+		filter_hist_pos[ch] = (filter_hist_pos[ch] + 1) % median_len;
+		if (filter_hist_num[ch] < median_len) {
+			filter_hist_num[ch]++;
+		}
+
+		us = median(filter_hist[ch], filter_hist_num[ch]);
+	}
+
+	if (max_step > 0 && filter_init[ch]) {
+		const int diff = (int)us - (int)servo_us[ch];
+
+		if ((diff > max_step || diff < -max_step) && filter_rejects[ch] < FILTER_MAX_REJECTS) {
+			filter_rejects[ch]++;
+			stat_rejected++;
+			return false;
+		}
+	}
+
+	filter_rejects[ch] = 0;
+	filter_init[ch] = true;
+	servo_us[ch] = us;
+
+	return true;
+}
+
+static uint16_t median(const uint16_t *values, int num) {
+	uint16_t sorted[SERVODEC_MEDIAN_MAX];
+
+	for (int i = 0;i < num;i++) {
+		int j = i;
+		while (j > 0 && sorted[j - 1] > values[i]) {
+			sorted[j] = sorted[j - 1];
+			j--;
+		}
+		sorted[j] = values[i];
+	}
+
+	return sorted[num / 2];
+}
+
+static void update_done(int num) {
+	const uint32_t now = timesync_get_local_us();
+	const uint32_t period = now - last_frame_us;
+
+	if (stat_frames > 0 && period < 1000000) {
+		// Frames that are missing between two frames
+		if (period_avg > 0 && period > 2 * period_avg) {
+			stat_dropped += period / period_avg - 1;
+		} else {
+			if (period_avg == 0) {
+				period_avg = period;
+			} else {
+				period_avg = (7 * period_avg + period) / 8;
+			}
+
+			if (period < period_min) {
+				period_min = period;
+			}
+
+			if (period > period_max) {
+				period_max = period;
+			}
+		}
+	}
+
+	last_frame_us = now;
+	stat_frames++;
+
+	channels = num;
+	last_update_time = chTimeNow();
+
+	if (done_func) {
+		done_func();
+	}
+}
@@ -27,11 +27,21 @@
 
 #include <stdint.h>
 #include <conf_general.h>
+#include "datatypes.h"
+
+// Settings
+#define SERVODEC_CHANNELS		16
+#define SERVODEC_MEDIAN_MAX		5
 
 // Functions
-void servodec_init(void (*d_func)(void));
+void servodec_init(ppm_input_type input, void (*d_func)(void));
 void servodec_set_pulse_options(float start, float width);
+void servodec_set_filter(int median_filter_len, uint16_t max_pulse_step);
 float servodec_get_servo(int servo_num);
+uint16_t servodec_get_servo_us(int servo_num);
+int servodec_get_channels(void);
+void servodec_get_stats(servodec_stats *stats);
+void servodec_reset_stats(void);
 uint32_t servodec_get_time_since_update(void);
 
 #endif /* SERVO_DEC_H_ */
@@ -30,6 +30,8 @@
 #include "hw.h"
 #include "comm_can.h"
 #include "utils.h"
+#include "timesync.h"
+#include "app.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -89,6 +91,9 @@ void terminal_process_string(char *str) {
 	} else if (strcmp(argv[0], "fault") == 0) {
 		commands_printf("%s\n", mcpwm_fault_to_string(mcpwm_get_fault()));
 	} else if (strcmp(argv[0], "faults") == 0) {
+		commands_printf("DRV8302 faults: %d transient, %d latched\n",
+				mcpwm_get_drv_faults_transient(), mcpwm_get_drv_faults_latched());
+
 		if (fault_vec_write == 0) {
 			commands_printf("No faults registered since startup\n");
 		} else {
@@ -148,7 +153,7 @@ void terminal_process_string(char *str) {
 
 				float cycle_integrator;
 				float coupling_k;
-				if (conf_general_detect_motor_param(current, min_rpm, low_duty, &cycle_integrator, &coupling_k)) {
+				if (conf_general_detect_motor_param(current, min_rpm, low_duty, 0.0, &cycle_integrator, &coupling_k, 0)) {
 					commands_printf("Cycle integrator limit: %.2f", (double)cycle_integrator);
 					commands_printf("Coupling factor: %.2f\n", (double)coupling_k);
 				} else {
@@ -176,9 +181,55 @@ void terminal_process_string(char *str) {
 				commands_printf("Age (milliseconds) : %.2f", (double)(UTILS_AGE_S(msg->rx_time) * 1000.0));
 				commands_printf("RPM                : %.2f", (double)msg->rpm);
 				commands_printf("Current            : %.2f", (double)msg->current);
-				commands_printf("Duty               : %.2f\n", (double)msg->duty);
+				commands_printf("Duty               : %.2f", (double)msg->duty);
+				commands_printf("Amp hours          : %.4f", (double)msg->amp_hours);
+				commands_printf("Amp hours charged  : %.4f", (double)msg->amp_hours_charged);
+				commands_printf("Tachometer         : %i", msg->tacho);
+				commands_printf("Input voltage      : %.1f", (double)msg->v_in);
+				commands_printf("Fault              : %s", mcpwm_fault_to_string(msg->fault));
+				commands_printf("Temp FET           : %.1f", (double)msg->temp_fet);
+				commands_printf("Temp PCB           : %.1f", (double)msg->temp_pcb);
+				commands_printf("Input current      : %.2f\n", (double)msg->current_in);
+			}
+		}
+	} else if (strcmp(argv[0], "can_stats") == 0) {
+		can_stats stats;
+		comm_can_get_stats(&stats);
+		commands_printf("RX frames          : %u (%u/s)", stats.rx_frames, stats.rx_rate);
+		commands_printf("TX frames          : %u (%u/s)", stats.tx_frames, stats.tx_rate);
+		commands_printf("TX mailbox full    : %u", stats.tx_mailbox_full);
+		commands_printf("TX drops setpoint  : %u", stats.tx_drops[CAN_TX_PRIO_SETPOINT]);
+		commands_printf("TX drops status    : %u", stats.tx_drops[CAN_TX_PRIO_STATUS]);
+		commands_printf("TX drops bulk      : %u", stats.tx_drops[CAN_TX_PRIO_BULK]);
+		commands_printf("RX overflows       : %u", stats.rx_overflows);
+		commands_printf("Framing errors     : %u", stats.framing_errors);
+		commands_printf("Bus off            : %u", stats.bus_off);
+		commands_printf("Bus off recoveries : %u", stats.bus_off_recoveries);
+		commands_printf("TEC / REC          : %u / %u", stats.tec, stats.rec);
+		commands_printf("Status age < 10 ms, < 100 ms, < 1 s, older: %u %u %u %u",
+				stats.status_age[0], stats.status_age[1], stats.status_age[2], stats.status_age[3]);
+
+		commands_printf("Frame rates per packet id (rx/s tx/s):");
+		for (int i = 0;i < CAN_STATS_CMDS;i++) {
+			uint16_t rx = comm_can_get_rx_rate(i);
+			uint16_t tx = comm_can_get_tx_rate(i);
+			if (rx || tx) {
+				commands_printf("  %2i: %5u %5u", i, rx, tx);
 			}
 		}
+		commands_printf("");
+	} else if (strcmp(argv[0], "timesync") == 0) {
+		commands_printf("Role          : %s", timesync_is_master() ? "Master" : "Slave");
+		commands_printf("Synchronized  : %s", timesync_is_synced() ? "Yes" : "No");
+		commands_printf("Time          : %u us", timesync_get_us());
+		commands_printf("Offset        : %i us", timesync_get_offset_us());
+		commands_printf("Drift         : %.2f ppm\n", (double)timesync_get_drift_ppm());
+	} else if (strcmp(argv[0], "uart_stream") == 0) {
+		uint32_t frames, errors, lost;
+		app_uartcomm_get_stream_stats(&frames, &errors, &lost);
+		commands_printf("Frames         : %u", frames);
+		commands_printf("Checksum errors: %u", errors);
+		commands_printf("Lost frames    : %u\n", lost);
 	}
 
 	// Setters
@@ -257,7 +308,16 @@ void terminal_process_string(char *str) {
 		commands_printf("  Prints some rpm-dep values");
 
 		commands_printf("can_devs");
-		commands_printf("  Prints all CAN devices seen on the bus the past second\n");
+		commands_printf("  Prints all CAN devices seen on the bus the past second");
+
+		commands_printf("can_stats");
+		commands_printf("  Prints CAN bus load and error statistics\n");
+
+		commands_printf("timesync");
+		commands_printf("  Prints the state of the CAN time synchronization\n");
+
+		commands_printf("uart_stream");
+		commands_printf("  Prints statistics for the UART setpoint stream mode\n");
 	} else {
 		commands_printf("Invalid command: %s\n"
 				"type help to list all available commands\n", argv[0]);
@@ -0,0 +1,81 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * test_can_timing.c
+ *
+ * Host test for the CAN bit timing calculation. Build and run with
+ * make test in this directory.
+ */
+
+#include "can_timing.h"
+#include <stdio.h>
+#include <math.h>
+
+#define PCLK1			42000000
+#define SAMPLE_POINT	0.875
+
+static int check_bitrate(uint32_t bitrate) {
+	uint32_t btr = 0;
+
+	if (!can_timing_calc_btr(PCLK1, bitrate, SAMPLE_POINT, &btr)) {
+		printf("FAIL %lu: no timing found\n", (unsigned long)bitrate);
+		return 1;
+	}
+
+	const uint32_t brp = CAN_TIMING_BTR_BRP(btr);
+	const uint32_t ts1 = CAN_TIMING_BTR_TS1(btr);
+	const uint32_t ts2 = CAN_TIMING_BTR_TS2(btr);
+	const uint32_t tq = 1 + ts1 + ts2;
+	const float sp = (float)(1 + ts1) / (float)tq;
+	int fails = 0;
+
+	if (PCLK1 / (brp * tq) != bitrate || PCLK1 % (brp * tq) != 0) {
+		printf("FAIL %lu: bit rate is %lu\n", (unsigned long)bitrate,
+				(unsigned long)(PCLK1 / (brp * tq)));
+		fails++;
+	}
+
+	if (ts1 > 16 || ts2 > 8 || tq < 8 || tq > 25) {
+		printf("FAIL %lu: TS1 %lu TS2 %lu\n", (unsigned long)bitrate,
+				(unsigned long)ts1, (unsigned long)ts2);
+		fails++;
+	}
+
+	// CiA 301 recommends 87.5 %, allow some margin for the exact prescaler
+	if (fabs(sp - SAMPLE_POINT) > 0.05) {
+		printf("FAIL %lu: sample point %.1f %%\n", (unsigned long)bitrate, sp * 100.0);
+		fails++;
+	}
+
+	printf("%s %7lu: BRP %4lu  TS1 %2lu  TS2 %lu  %2lu tq  %.1f %%\n",
+			fails ? "FAIL" : "OK  ", (unsigned long)bitrate, (unsigned long)brp,
+			(unsigned long)ts1, (unsigned long)ts2, (unsigned long)tq, sp * 100.0);
+
+	return fails;
+}
+
+int main(void) {
+	int fails = 0;
+
+	fails += check_bitrate(125000);
+	fails += check_bitrate(250000);
+	fails += check_bitrate(500000);
+	fails += check_bitrate(1000000);
+
+	return fails ? 1 : 0;
+}
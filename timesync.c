@@ -0,0 +1,191 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * timesync.c
+ *
+ * A microsecond clock that is synchronized between the controllers on the CAN
+ * bus. The master broadcasts its local time and the other controllers estimate
+ * the offset and drift of their local clock relative to it.
+ */
+
+#include "timesync.h"
+#include "ch.h"
+#include "hal.h"
+#include "stm32f4xx_conf.h"
+#include "conf_general.h"
+
+#include <math.h>
+
+// Private variables
+static volatile bool is_master = false;
+static volatile bool has_sample = false;
+static volatile systime_t last_sample_time;
+static volatile uint32_t ref_local;	// Local time of the last sample
+static volatile int32_t offset;		// Synchronized time - local time at ref_local
+static volatile float drift;		// Rate difference, synchronized - local
+
+void timesync_init(void) {
+	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
+
+	// TIM5 is a free running 32-bit microsecond counter
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM5, ENABLE);
+
+	TIM_TimeBaseStructure.TIM_Period = 0xFFFFFFFF;
+	TIM_TimeBaseStructure.TIM_Prescaler = (uint16_t)(((SYSTEM_CORE_CLOCK / 2) / 1000000) - 1);
+	TIM_TimeBaseStructure.TIM_ClockDivision = 0;
+	TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+	TIM_TimeBaseInit(TIM5, &TIM_TimeBaseStructure);
+
+	TIM_Cmd(TIM5, ENABLE);
+}
+
+/**
+ * Get the local microsecond time. This function can be called from
+ * interrupts.
+ *
+ * @return
+ * The local time in microseconds.
+ */
+uint32_t timesync_get_local_us(void) {
+	return TIM5->CNT;
+}
+
+/**
+ * Convert a local time to the synchronized time.
+ *
+ * @param local_us
+ * The local time in microseconds, e.g. from timesync_get_local_us.
+ *
+ * @return
+ * The synchronized time in microseconds.
+ */
+uint32_t timesync_local_to_sync(uint32_t local_us) {
+	chSysLock();
+	const int32_t dt = (int32_t)(local_us - ref_local);
+	const uint32_t res = local_us + offset + (int32_t)(drift * (float)dt);
+	chSysUnlock();
+
+	return res;
+}
+
+/**
+ * Get the synchronized microsecond time. All controllers on the bus that
+ * are synchronized to the same master report the same time.
+ *
+ * @return
+ * The synchronized time in microseconds.
+ */
+uint32_t timesync_get_us(void) {
+	return timesync_local_to_sync(timesync_get_local_us());
+}
+
+/**
+ * Make this controller the time master or stop being it. The master keeps
+ * its current offset and drift and the other controllers follow it.
+ *
+ * @param master
+ * True to become the master.
+ */
+void timesync_set_master(bool master) {
+	if (master && !is_master) {
+		// Continue from the current synchronized time so that it does not
+		// jump when the master changes.
+		chSysLock();
+		const uint32_t now = timesync_get_local_us();
+		const int32_t dt = (int32_t)(now - ref_local);
+		offset += (int32_t)(drift * (float)dt);
+		ref_local = now;
+		chSysUnlock();
+	}
+
+	if (!master && is_master) {
+		has_sample = false;
+	}
+
+	is_master = master;
+}
+
+bool timesync_is_master(void) {
+	return is_master;
+}
+
+/**
+ * Check if the synchronized time is valid.
+ *
+ * @return
+ * True if this is the master or a sync was received recently.
+ */
+bool timesync_is_synced(void) {
+	return is_master || (has_sample &&
+			chTimeElapsedSince(last_sample_time) < MS2ST(TIMESYNC_TIMEOUT_MS));
+}
+
+/**
+ * Update the offset and drift estimation with a sync from the master.
+ *
+ * @param master_us
+ * The local time of the master when it sent the sync.
+ *
+ * @param local_us
+ * The local time when the sync was received.
+ */
+void timesync_process_sample(uint32_t master_us, uint32_t local_us) {
+	if (is_master) {
+		return;
+	}
+
+	const int32_t sample_offset = (int32_t)(master_us - local_us);
+	const bool timed_out = !has_sample ||
+			chTimeElapsedSince(last_sample_time) > MS2ST(TIMESYNC_TIMEOUT_MS);
+
+	chSysLock();
+
+	const int32_t dt = (int32_t)(local_us - ref_local);
+	const float pred = (float)offset + drift * (float)dt;
+	const float err = (float)sample_offset - pred;
+
+	if (timed_out || dt <= 0 || fabsf(err) > TIMESYNC_MAX_STEP_US) {
+		// Start over from this sample
+		offset = sample_offset;
+		drift = 0.0;
+	} else {
+		offset = (int32_t)(pred + TIMESYNC_OFFSET_GAIN * err);
+		drift += TIMESYNC_DRIFT_GAIN * err / (float)dt;
+
+		if (drift > TIMESYNC_MAX_DRIFT) {
+			drift = TIMESYNC_MAX_DRIFT;
+		} else if (drift < -TIMESYNC_MAX_DRIFT) {
+			drift = -TIMESYNC_MAX_DRIFT;
+		}
+	}
+
+	ref_local = local_us;
+
+	chSysUnlock();
+
+	last_sample_time = chTimeNow();
+	has_sample = true;
+}
+
+int32_t timesync_get_offset_us(void) {
+	return offset;
+}
+
+float timesync_get_drift_ppm(void) {
+	return drift * 1000000.0;
+}
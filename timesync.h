@@ -0,0 +1,48 @@
+/*
+	Copyright 2012-2014 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * timesync.h
+ */
+
+#ifndef TIMESYNC_H_
+#define TIMESYNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#define TIMESYNC_INTERVAL_MS		100		// Sync interval of the master
+#define TIMESYNC_TIMEOUT_MS			1000	// Not synchronized if no sync was received for this time
+#define TIMESYNC_MAX_STEP_US		5000	// Larger offset errors restart the estimation
+#define TIMESYNC_OFFSET_GAIN		0.3		// Offset correction gain
+#define TIMESYNC_DRIFT_GAIN			0.05	// Drift correction gain
+#define TIMESYNC_MAX_DRIFT			0.0005	// Largest accepted clock drift (500 ppm)
+
+// Functions
+void timesync_init(void);
+uint32_t timesync_get_local_us(void);
+uint32_t timesync_local_to_sync(uint32_t local_us);
+uint32_t timesync_get_us(void);
+void timesync_set_master(bool is_master);
+bool timesync_is_master(void);
+bool timesync_is_synced(void);
+void timesync_process_sample(uint32_t master_us, uint32_t local_us);
+int32_t timesync_get_offset_us(void);
+float timesync_get_drift_ppm(void);
+
+#endif /* TIMESYNC_H_ */
@@ -23,6 +23,8 @@
  */
 
 #include <math.h>
+#include <string.h>
+#include <stdbool.h>
 #include "ws2811.h"
 #include "stm32f4xx_conf.h"
 #include "ch.h"
@@ -32,53 +34,90 @@
 #define TIM_PERIOD			(((168000000 / 2 / WS2811_CLK_HZ) - 1))
 #define LED_BUFFER_LEN		(WS2811_LED_NUM + 1)
 #define BITBUFFER_PAD		50
-#define BITBUFFER_LEN		(24 * LED_BUFFER_LEN + BITBUFFER_PAD)
 #define WS2811_ZERO			(TIM_PERIOD * 0.2)
 #define WS2811_ONE			(TIM_PERIOD * 0.8)
+#define DMA_IRQ_PRIORITY	5
+
+#if WS2811_COMPACT_BUFFER
+// One half of the bit buffer holds WS2811_STREAM_LEDS LEDs. After the LEDs,
+// zeros are sent for at least BITBUFFER_PAD bits to latch the frame.
+#define BITBUFFER_LEN		(2 * 24 * WS2811_STREAM_LEDS)
+#define RESET_SLOTS			((BITBUFFER_PAD + 23) / 24)
+#define FRAME_SLOTS			(((WS2811_LED_NUM + RESET_SLOTS + WS2811_STREAM_LEDS - 1) / \
+		WS2811_STREAM_LEDS) * WS2811_STREAM_LEDS)
+#else
+#define BITBUFFER_LEN		(24 * LED_BUFFER_LEN + BITBUFFER_PAD)
+#endif
+
+#if WS2811_USE_CH2
+#define WS2811_DMA_STREAM		DMA1_Stream3
+#define WS2811_DMA_STREAM_ID	STM32_DMA_STREAM_ID(1, 3)
+#define WS2811_TIM_CCR			TIM4->CCR2
+#else
+#define WS2811_DMA_STREAM		DMA1_Stream0
+#define WS2811_DMA_STREAM_ID	STM32_DMA_STREAM_ID(1, 0)
+#define WS2811_TIM_CCR			TIM4->CCR1
+#endif
 
 // Private variables
-static uint16_t bitbuffer[BITBUFFER_LEN];
-static uint32_t RGBdata[LED_BUFFER_LEN];
+static uint32_t RGBdata[WS2811_LED_NUM];
 static uint8_t gamma_table[256];
+static volatile int front;
+static volatile bool frame_pending;
+static volatile bool back_stale;
+#if WS2811_COMPACT_BUFFER
+static uint16_t bitbuffer[BITBUFFER_LEN];
+static uint32_t framebuffer[2][WS2811_LED_NUM];
+static int stream_slot;
+#else
+static uint16_t bitbuffer[2][BITBUFFER_LEN];
+#endif
 
 // Private function prototypes
 static uint32_t rgb_to_local(uint32_t color);
+static void encode_bits(uint16_t *bits, uint32_t color);
+static void dma_handler(void *p, uint32_t flags);
+#if WS2811_COMPACT_BUFFER
+static void stream_fill(uint16_t *bits);
+#endif
 
 void ws2811_init(void) {
 	TIM_TimeBaseInitTypeDef  TIM_TimeBaseStructure;
 	TIM_OCInitTypeDef  TIM_OCInitStructure;
 	DMA_InitTypeDef DMA_InitStructure;
 
-	// Default LED values
-	int i, bit;
+	// Generate gamma correction table
+	for (int i = 0;i < 256;i++) {
+		gamma_table[i] = (int)roundf(powf((float)i / 255.0, 1.0 / 0.45) * 255.0);
+	}
 
-	for (i = 0;i < LED_BUFFER_LEN;i++) {
+	// Default LED values
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
 		RGBdata[i] = 0;
 	}
 
-	for (i = 0;i < LED_BUFFER_LEN;i++) {
-		uint32_t tmp_color = rgb_to_local(RGBdata[i]);
-
-		for (bit = 0;bit < 24;bit++) {
-			if(tmp_color & (1 << 23)) {
-				bitbuffer[bit + i * 24] = WS2811_ONE;
-			} else {
-				bitbuffer[bit + i * 24] = WS2811_ZERO;
-			}
-			tmp_color <<= 1;
-		}
-	}
+	front = 0;
+	frame_pending = false;
+	back_stale = false;
 
-	// Fill the rest of the buffer with zeros to give the LEDs a chance to update
-	// after sending all bits
-	for (i = 0;i < BITBUFFER_PAD;i++) {
-		bitbuffer[BITBUFFER_LEN - BITBUFFER_PAD - 1 + i] = 0;
+#if WS2811_COMPACT_BUFFER
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		framebuffer[0][i] = rgb_to_local(0);
+		framebuffer[1][i] = rgb_to_local(0);
 	}
 
-	// Generate gamma correction table
-	for (int i = 0;i < 256;i++) {
-		gamma_table[i] = (int)roundf(powf((float)i / 255.0, 1.0 / 0.45) * 255.0);
+	stream_slot = 0;
+	stream_fill(bitbuffer);
+	stream_fill(bitbuffer + BITBUFFER_LEN / 2);
+#else
+	// The extra LED and the padding at the end are zeros to give the LEDs a
+	// chance to update after sending all bits
+	memset(bitbuffer, 0, sizeof(bitbuffer));
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		encode_bits(bitbuffer[0] + i * 24, rgb_to_local(0));
+		encode_bits(bitbuffer[1] + i * 24, rgb_to_local(0));
 	}
+#endif
 
 #if WS2811_USE_CH2
 	palSetPadMode(GPIOB, 7,
@@ -95,33 +134,35 @@ void ws2811_init(void) {
 	// DMA clock enable
 	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1 , ENABLE);
 
-#if WS2811_USE_CH2
-	DMA_DeInit(DMA1_Stream3);
-	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&TIM4->CCR2;
-#else
-	DMA_DeInit(DMA1_Stream0);
-	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&TIM4->CCR1;
-#endif
+	dmaStreamAllocate(STM32_DMA_STREAM(WS2811_DMA_STREAM_ID),
+			DMA_IRQ_PRIORITY,
+			(stm32_dmaisr_t)dma_handler,
+			(void *)0);
+
+	DMA_DeInit(WS2811_DMA_STREAM);
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&WS2811_TIM_CCR;
 	DMA_InitStructure.DMA_Channel = DMA_Channel_2;
+#if WS2811_COMPACT_BUFFER
 	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)bitbuffer;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+#else
+	// Every frame is a single transfer, which is restarted from the transfer
+	// complete interrupt. This is where the buffers are swapped.
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)bitbuffer[front];
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+#endif
 	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
 	DMA_InitStructure.DMA_BufferSize = BITBUFFER_LEN;
 	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
 	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
 	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
 	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
-	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
 	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
 	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
 	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
 	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
 	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
-
-#if WS2811_USE_CH2
-	DMA_Init(DMA1_Stream3, &DMA_InitStructure);
-#else
-	DMA_Init(DMA1_Stream0, &DMA_InitStructure);
-#endif
+	DMA_Init(WS2811_DMA_STREAM, &DMA_InitStructure);
 
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM4, ENABLE);
 
@@ -137,7 +178,7 @@ void ws2811_init(void) {
 	// Channel 1 Configuration in PWM mode
 	TIM_OCInitStructure.TIM_OCMode = TIM_OCMode_PWM1;
 	TIM_OCInitStructure.TIM_OutputState = TIM_OutputState_Enable;
-	TIM_OCInitStructure.TIM_Pulse = bitbuffer[0];
+	TIM_OCInitStructure.TIM_Pulse = 0;
 	TIM_OCInitStructure.TIM_OCPolarity = TIM_OCPolarity_High;
 
 #if WS2811_USE_CH2
@@ -152,10 +193,13 @@ void ws2811_init(void) {
 	TIM_Cmd(TIM4, ENABLE);
 
 	// DMA enable
-#if WS2811_USE_CH2
-	DMA_Cmd(DMA1_Stream3, ENABLE);
+	DMA_Cmd(WS2811_DMA_STREAM, ENABLE);
+
+	// Interrupts for swapping and filling the buffers
+#if WS2811_COMPACT_BUFFER
+	DMA_ITConfig(WS2811_DMA_STREAM, DMA_IT_HT | DMA_IT_TC, ENABLE);
 #else
-	DMA_Cmd(DMA1_Stream0, ENABLE);
+	DMA_ITConfig(WS2811_DMA_STREAM, DMA_IT_TC, ENABLE);
 #endif
 
 	// TIM4 Update DMA Request enable
@@ -169,26 +213,104 @@ void ws2811_init(void) {
 	TIM_CtrlPWMOutputs(TIM4, ENABLE);
 }
 
-void ws2811_set_led_color(int led, uint32_t color) {
-	if (led < WS2811_LED_NUM) {
+/**
+ * Start updating a frame. The LEDs keep showing the last committed frame
+ * until ws2811_frame_commit is called, so a partially updated frame is never
+ * shown. The frame starts with the colors of the last committed frame. Only
+ * one thread should update frames.
+ */
+void ws2811_frame_begin(void) {
+	bool copy = false;
+
+	chSysLock();
+	if (frame_pending) {
+		// The last commit has not been shown yet, so the back buffer is still
+		// the newest frame. Take it back.
+		frame_pending = false;
+	} else {
+		copy = back_stale;
+	}
+	back_stale = false;
+	chSysUnlock();
+
+	// The front buffer does not change until the next commit
+	if (copy) {
+#if WS2811_COMPACT_BUFFER
+		memcpy(framebuffer[front ^ 1], framebuffer[front], sizeof(framebuffer[0]));
+#else
+		memcpy(bitbuffer[front ^ 1], bitbuffer[front], sizeof(bitbuffer[0]));
+#endif
+	}
+}
+
+/**
+ * Set the color of a LED in the frame that is being updated.
+ *
+ * @param led
+ * The LED index.
+ *
+ * @param color
+ * The color in RGB format.
+ */
+void ws2811_frame_set_led(int led, uint32_t color) {
+	if (led >= 0 && led < WS2811_LED_NUM) {
 		RGBdata[led] = color;
+#if WS2811_COMPACT_BUFFER
+		framebuffer[front ^ 1][led] = rgb_to_local(color);
+#else
+		encode_bits(bitbuffer[front ^ 1] + led * 24, rgb_to_local(color));
+#endif
+	}
+}
 
-		color = rgb_to_local(color);
+/**
+ * Set the colors of consecutive LEDs in the frame that is being updated.
+ *
+ * @param first
+ * The index of the first LED.
+ *
+ * @param colors
+ * The colors in RGB format.
+ *
+ * @param num
+ * The number of LEDs to set.
+ */
+void ws2811_frame_set_leds(int first, const uint32_t *colors, int num) {
+	for (int i = 0;i < num;i++) {
+		ws2811_frame_set_led(first + i, colors[i]);
+	}
+}
 
-		int bit;
-		for (bit = 0;bit < 24;bit++) {
-			if(color & (1 << 23)) {
-				bitbuffer[bit + led * 24] = WS2811_ONE;
-			} else {
-				bitbuffer[bit + led * 24] = WS2811_ZERO;
-			}
-			color <<= 1;
-		}
+/**
+ * Set the color of all LEDs in the frame that is being updated.
+ *
+ * @param color
+ * The color in RGB format.
+ */
+void ws2811_frame_set_all(uint32_t color) {
+	for (int i = 0;i < WS2811_LED_NUM;i++) {
+		ws2811_frame_set_led(i, color);
 	}
 }
 
+/**
+ * Show the updated frame. The buffers are swapped when the current frame
+ * has been sent.
+ */
+void ws2811_frame_commit(void) {
+	chSysLock();
+	frame_pending = true;
+	chSysUnlock();
+}
+
+void ws2811_set_led_color(int led, uint32_t color) {
+	ws2811_frame_begin();
+	ws2811_frame_set_led(led, color);
+	ws2811_frame_commit();
+}
+
 uint32_t ws2811_get_led_color(int led) {
-	if (led < WS2811_LED_NUM) {
+	if (led >= 0 && led < WS2811_LED_NUM) {
 		return RGBdata[led];
 	}
 
@@ -196,34 +318,13 @@ uint32_t ws2811_get_led_color(int led) {
 }
 
 void ws2811_all_off(void) {
-	int i;
-
-	for (i = 0;i < WS2811_LED_NUM;i++) {
-		RGBdata[i] = 0;
-	}
-
-	for (i = 0;i < (WS2811_LED_NUM * 24);i++) {
-		bitbuffer[i] = WS2811_ZERO;
-	}
+	ws2811_set_all(COLOR_BLACK);
 }
 
 void ws2811_set_all(uint32_t color) {
-	int i, bit;
-
-	for (i = 0;i < WS2811_LED_NUM;i++) {
-		RGBdata[i] = color;
-
-		uint32_t tmp_color = rgb_to_local(color);
-
-		for (bit = 0;bit < 24;bit++) {
-			if(tmp_color & (1 << 23)) {
-				bitbuffer[bit + i * 24] = WS2811_ONE;
-			} else {
-				bitbuffer[bit + i * 24] = WS2811_ZERO;
-			}
-			tmp_color <<= 1;
-		}
-	}
+	ws2811_frame_begin();
+	ws2811_frame_set_all(color);
+	ws2811_frame_commit();
 }
 
 static uint32_t rgb_to_local(uint32_t color) {
@@ -237,3 +338,76 @@ static uint32_t rgb_to_local(uint32_t color) {
 
 	return (g << 16) | (r << 8) | b;
 }
+
+static void encode_bits(uint16_t *bits, uint32_t color) {
+	for (int bit = 0;bit < 24;bit++) {
+		if (color & (1 << 23)) {
+			bits[bit] = WS2811_ONE;
+		} else {
+			bits[bit] = WS2811_ZERO;
+		}
+		color <<= 1;
+	}
+}
+
+#if WS2811_COMPACT_BUFFER
+/*
+ * Encode the next WS2811_STREAM_LEDS slots of the frame into one half of the
+ * bit buffer. The frame buffers are only swapped at the end of a frame.
+ */
+static void stream_fill(uint16_t *bits) {
+	for (int i = 0;i < WS2811_STREAM_LEDS;i++) {
+		if (stream_slot < WS2811_LED_NUM) {
+			encode_bits(bits + i * 24, framebuffer[front][stream_slot]);
+		} else {
+			memset(bits + i * 24, 0, 24 * sizeof(uint16_t));
+		}
+
+		stream_slot++;
+		if (stream_slot >= FRAME_SLOTS) {
+			stream_slot = 0;
+
+			if (frame_pending) {
+				front ^= 1;
+				frame_pending = false;
+				back_stale = true;
+			}
+		}
+	}
+}
+
+static void dma_handler(void *p, uint32_t flags) {
+	(void)p;
+
+	// Fill the half that was just sent while the other half is being sent
+	if (flags & STM32_DMA_ISR_HTIF) {
+		stream_fill(bitbuffer);
+	}
+
+	if (flags & STM32_DMA_ISR_TCIF) {
+		stream_fill(bitbuffer + BITBUFFER_LEN / 2);
+	}
+}
+#else
+static void dma_handler(void *p, uint32_t flags) {
+	(void)p;
+
+	if (!(flags & STM32_DMA_ISR_TCIF)) {
+		return;
+	}
+
+	if (frame_pending) {
+		front ^= 1;
+		frame_pending = false;
+		back_stale = true;
+	}
+
+	// The last value in the buffer is zero, so the output stays low while
+	// the transfer is restarted.
+	DMA_Cmd(WS2811_DMA_STREAM, DISABLE);
+	while (DMA_GetCmdStatus(WS2811_DMA_STREAM) == ENABLE) {}
+	WS2811_DMA_STREAM->M0AR = (uint32_t)bitbuffer[front];
+	DMA_SetCurrDataCounter(WS2811_DMA_STREAM, BITBUFFER_LEN);
+	DMA_Cmd(WS2811_DMA_STREAM, ENABLE);
+}
+#endif
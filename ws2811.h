@@ -76,5 +76,10 @@ void ws2811_set_led_color(int led, uint32_t color);
 uint32_t ws2811_get_led_color(int led);
 void ws2811_all_off(void);
 void ws2811_set_all(uint32_t color);
+void ws2811_frame_begin(void);
+void ws2811_frame_set_led(int led, uint32_t color);
+void ws2811_frame_set_leds(int first, const uint32_t *colors, int num);
+void ws2811_frame_set_all(uint32_t color);
+void ws2811_frame_commit(void);
 
 #endif /* WS2811_H_ */